@@ -1,8 +1,13 @@
 #include "drawsvg.h"
+#include "svg_cache.h"
 
+#include <algorithm>
+#include <set>
 #include <sstream>
 #include <iostream>
 #include <cstdlib>
+#include <cstdio>
+#include <cmath>
 
 using namespace std;
 
@@ -10,6 +15,15 @@ namespace CMU462 {
 
 DrawSVG::~DrawSVG() {
 
+  // stop the render worker before anything it reads goes away
+  {
+    lock_guard<mutex> lock(render_lock);
+    render_quit = true;
+    render_cancel = true;
+    render_cv.notify_all();
+  }
+  if (render_thread.joinable()) render_thread.join();
+
   tabs.clear();
   viewport_imp.clear();
   viewport_ref.clear();
@@ -38,9 +52,22 @@ string DrawSVG::info() {
     if (software_renderer == software_renderer_ref) {
       osd += "- Reference";
     }
-    if (sample_rate > 1) {
+    if (software_renderer == software_renderer_ref && sample_rate > 1) {
       osd += "( " + to_string(sample_rate * sample_rate) + "x SSAA)";
     }
+    if (software_renderer == software_renderer_imp && sample_pattern.size() > 1) {
+      const char* names[] = { "grid", "sparse", "jittered" };
+      osd += "( " + to_string(sample_pattern.size()) + "x SSAA, " +
+             names[pattern_type] + ")";
+    }
+    if (progressive_active()) {
+      lock_guard<mutex> lock(render_lock);
+      osd += " [progressive " + to_string(frame_pass) + "/" +
+             to_string(sample_pattern.size()) + "]";
+    }
+    if (show_profile) {
+      osd += " [profiling]";
+    }
   }
 
   return osd;
@@ -64,6 +91,12 @@ void DrawSVG::init() {
   software_renderer_imp->set_tex_sampler(sampler_imp);
   software_renderer_ref->set_tex_sampler(sampler_ref);
 
+  // software frames are drawn on a worker thread
+  software_renderer_imp->set_cancel_flag(&render_cancel);
+  render_thread = thread(&DrawSVG::render_loop, this);
+
+  profile_text.init(false);
+
   // generate mipmaps & set initial viewports
   for (size_t i = 0; i < tabs.size(); ++i) {
 
@@ -76,8 +109,11 @@ void DrawSVG::init() {
     // set initial svg_2_norm for imp using ref
     viewport_imp[i]->set_svg_2_norm(viewport_ref[i]->get_svg_2_norm());
 
-    // generate mipmaps
-    regenerate_mipmap(i);
+    // generate mipmaps and cache the document with them
+    if (!tab_cached[i]) {
+      regenerate_mipmap(i, true);
+      if (tab_cache_keys[i]) SVGCache::save(tab_cache_keys[i], tabs[i]);
+    }
   }
 
   // set tab and transformation if tabs loaded
@@ -94,8 +130,11 @@ void DrawSVG::render() {
     redraw();
   }
 
+  // show the last completed frame, the one in flight keeps drawing
   if( method == Software ) {
-    display_pixels( &framebuffer[0] );
+    lock_guard<mutex> lock(render_lock);
+    display_pixels( &frontbuffer[0] );
+    if (show_profile) draw_profile();
   }
 
   if (show_zoom) {
@@ -106,16 +145,20 @@ void DrawSVG::render() {
 
 void DrawSVG::resize( size_t width, size_t height ) {
 
+  stop_render();
+
   this->width  = width;
   this->height = height;
 
-  // resize render target
+  // resize render target and the displayed frame
   framebuffer.resize( 4 * width * height);
+  frontbuffer.assign( 4 * width * height, 255 );
   software_renderer_imp->set_render_target(&framebuffer[0], width, height);
   software_renderer_ref->set_render_target(&framebuffer[0], width, height);
 
   // update hardware renderer
   hardware_renderer->resize(width, height);
+  profile_text.resize(width, height);
 
   // re-adjust norm_to_screen
   float scale = min(width, height);
@@ -144,8 +187,30 @@ void DrawSVG::char_event( unsigned int key ) {
       dec_sample_rate();
       break;
 
+    // cycle sample patterns
+    case 'n': case 'N':
+      next_sample_pattern();
+      break;
+
+    // toggle sub-pixel level of detail
+    case 'l': case 'L':
+      stop_render();
+      if (software_renderer_imp->get_lod_threshold() > 0) {
+        software_renderer_imp->set_lod(0, 0);
+      } else {
+        software_renderer_imp->set_lod(1.0f, 0.5f);
+      }
+      redraw();
+      break;
+
+    // toggle progressive anti-aliasing
+    case 'p': case 'P':
+      toggle_progressive();
+      break;
+
     // switch between iml and ref renderer
     case 'r': case 'R':
+      stop_render();
       if (software_renderer == software_renderer_imp) {
         software_renderer = software_renderer_ref;
       } else {software_renderer = software_renderer_imp; }
@@ -173,11 +238,21 @@ void DrawSVG::char_event( unsigned int key ) {
     // toggle diff
     case 'd': case 'D':
       if (method == Software) {
+        stop_render();
         show_diff = !show_diff; 
         redraw();
       }
       break;
 
+    // toggle cost profile
+    case 'c': case 'C':
+      if (method == Software) {
+        stop_render();
+        show_profile = !show_profile;
+        redraw();
+      }
+      break;
+
     // toggle zoom
     case 'z': case 'Z':
       show_zoom = !show_zoom;
@@ -245,6 +320,7 @@ void DrawSVG::cursor_event( float x, float y ) {
   // diff is disabled when panning - it's too slow
   if (leftDown) {
   
+    stop_render();
     show_diff = false;
     float dx = (x - cursor_x) / width  * tabs[current_tab]->width;
     float dy = (y - cursor_y) / height * tabs[current_tab]->height;
@@ -261,6 +337,7 @@ void DrawSVG::cursor_event( float x, float y ) {
 void DrawSVG::scroll_event( float offset_x, float offset_y ) {
   // diff is disabled when zooming - it's too slow
   if (offset_x || offset_y) {
+    stop_render();
     show_diff = false;
     // prevent inverting axis when scrolling too fast
     float scale = 1 + 0.05 * offset_x + 0.05 * offset_y;
@@ -282,17 +359,23 @@ void DrawSVG::clear( void ) {
   }
 }
 
-void DrawSVG::newTab( SVG* svg ) {
+void DrawSVG::newTab( SVG* svg, uint64_t cache_key, bool cached ) {
+  stop_render();
   if (tabs.size() < 9) {
     tabs.push_back(svg);
+    tab_cache_keys.push_back(cache_key);
+    tab_cached.push_back(cached);
   } else {
     fprintf(stderr, "DrawSVG can only hold up to 9 tabs");
   }
 }
 
 void DrawSVG::delTab( size_t tab_index ) {
+  stop_render();
   if (tab_index < tabs.size()) {
     tabs.erase(tabs.begin() + tab_index);
+    tab_cache_keys.erase(tab_cache_keys.begin() + tab_index);
+    tab_cached.erase(tab_cached.begin() + tab_index);
   }
 }
 
@@ -301,6 +384,7 @@ void DrawSVG::setTab( size_t tab_index ) {
   if ( tab_index < tabs.size() ) {
 
     // switch tab and update transformation
+    stop_render();
     current_tab = tab_index;
 
     // update output
@@ -318,8 +402,16 @@ void DrawSVG::draw_diff() {
   memcpy(&reference[0], &framebuffer[0], 4 * width * height );
   memset(&framebuffer[0], 255, 4 * width * height);
 
-  // get implementation output
+  // get implementation output (always at the full sample rate and
+  // without level of detail so that the diff is against what the
+  // reference actually computes)
+  float lod_threshold = software_renderer_imp->get_lod_threshold();
+  float lod_tolerance = software_renderer_imp->get_lod_tolerance();
+  software_renderer_imp->set_lod(0, 0);
+  if (progressive) software_renderer_imp->set_sample_pattern(sample_pattern);
   software_renderer_imp->draw_svg(*tabs[current_tab]);
+  if (progressive) software_renderer_imp->set_sample_pattern(SamplePattern::grid(1));
+  software_renderer_imp->set_lod(lod_threshold, lod_tolerance);
 
   // take difference and count errors
   int errorCount = 0;
@@ -417,8 +509,7 @@ void DrawSVG::draw_zoom() {
 void DrawSVG::inc_sample_rate() {
   if (method == Software) {
     sample_rate += sample_rate < 4 ? 1 : 0;
-    software_renderer_imp->set_sample_rate(sample_rate);
-    software_renderer_ref->set_sample_rate(sample_rate);
+    update_sample_pattern();
     redraw();
   }
 }
@@ -426,8 +517,7 @@ void DrawSVG::inc_sample_rate() {
 void DrawSVG::dec_sample_rate() {
   if (method == Software) {
     sample_rate -= sample_rate > 1 ? 1 : 0;
-    software_renderer_imp->set_sample_rate(sample_rate);
-    software_renderer_ref->set_sample_rate(sample_rate);
+    update_sample_pattern();
     redraw();
 
   }
@@ -435,6 +525,9 @@ void DrawSVG::dec_sample_rate() {
 
 void DrawSVG::redraw() {
 
+  // the frame in flight is for an outdated view
+  stop_render();
+
   clear();
   // set svg_2_screen transformation
   Matrix3x3 m_imp = norm_to_screen * viewport_imp[current_tab]->get_svg_2_norm();
@@ -443,6 +536,18 @@ void DrawSVG::redraw() {
   software_renderer_ref->set_svg_2_screen( m_ref ); 
   hardware_renderer->set_svg_2_screen( m_ref );
 
+  // shared textures are copied into the images of a tab only while the
+  // reference renderer or the diff view reads them
+  SVG* reference = method == Software && (show_diff ||
+                   software_renderer == software_renderer_ref) ?
+                   tabs[current_tab] : NULL;
+  if (reference != reference_svg) {
+    vector<SVG*>::iterator it = find(tabs.begin(), tabs.end(), reference_svg);
+    if (it != tabs.end()) release_reference_textures(it - tabs.begin());
+    if (reference) copy_reference_textures(current_tab);
+    reference_svg = reference;
+  }
+
   switch (method) {
 
     case Hardware:  
@@ -451,29 +556,319 @@ void DrawSVG::redraw() {
       
     case Software: 
 
-      if (show_diff) { draw_diff(); return; }
-      software_renderer->draw_svg(*tabs[current_tab]);
-      display_pixels( &framebuffer[0] );
+      if (show_diff) { draw_diff(); publish_frame(); return; }
+      start_render();
 
       break;
 
   }
 }
 
-void DrawSVG::regenerate_mipmap(size_t tab_index) {
+bool DrawSVG::progressive_active() const {
+  return progressive && method == Software && !show_diff &&
+         software_renderer == software_renderer_imp;
+}
+
+void DrawSVG::toggle_progressive() {
+  if (method == Software) {
+    stop_render();
+    progressive = !progressive;
+    update_sample_pattern();
+    redraw();
+  }
+}
+
+void DrawSVG::refine() {
+
+  // NOTE:
+  // Each refinement pass renders the sample at position k of the sample
+  // pattern for every pixel at 1x, and the passes are averaged with the
+  // pattern weights. After sample_pattern.size() passes the image matches
+  // the configured supersampling quality. Moving the sample by (dx, dy)
+  // is done by moving the drawing by (-dx, -dy) in screen space.
+  const Vector2D& p = sample_pattern.positions[progressive_pass];
+  float w = sample_pattern.weights[progressive_pass];
+
+  Matrix3x3 jitter = Matrix3x3::identity();
+  jitter(0,2) = 0.5 - p.x;
+  jitter(1,2) = 0.5 - p.y;
+
+  Matrix3x3 m_imp = norm_to_screen * viewport_imp[current_tab]->get_svg_2_norm();
+  software_renderer_imp->set_svg_2_screen( jitter * m_imp );
+  software_renderer_imp->draw_svg(*tabs[current_tab]);
+  software_renderer_imp->set_svg_2_screen( m_imp );
+
+  // the first pass replaces the preview
+  if (progressive_pass == 0) {
+    progressive_accum.assign(framebuffer.size(), 0.0f);
+    progressive_weight = 0;
+  }
+
+  // accumulate and resolve the running average into the framebuffer
+  progressive_pass++;
+  progressive_weight += w;
+  for (size_t k = 0; k < framebuffer.size(); k++) {
+    progressive_accum[k] += w * framebuffer[k];
+    framebuffer[k] = (unsigned char) (progressive_accum[k] / progressive_weight + 0.5f);
+  }
+}
+
+void DrawSVG::start_render() {
+  lock_guard<mutex> lock(render_lock);
+  render_cancel = false;
+  render_pending = true;
+  render_cv.notify_all();
+}
+
+void DrawSVG::stop_render() {
+  unique_lock<mutex> lock(render_lock);
+  render_pending = false;
+  if (!render_busy) return;
+
+  // the implementation gives up between elements, the reference renderer
+  // can only be waited for
+  render_cancel = true;
+  render_cv.wait(lock, [this] { return !render_busy; });
+  render_cancel = false;
+}
+
+void DrawSVG::render_loop() {
+  unique_lock<mutex> lock(render_lock);
+  while (true) {
+    render_cv.wait(lock, [this] { return render_pending || render_quit; });
+    if (render_quit) return;
+    render_pending = false;
+    render_busy = true;
+
+    lock.unlock();
+    draw_frame();
+    lock.lock();
+
+    render_busy = false;
+    render_cv.notify_all();
+  }
+}
+
+void DrawSVG::draw_frame() {
+
+  // only the implementation can be profiled
+  profiling_frame = show_profile && software_renderer == software_renderer_imp;
+  if (profiling_frame) {
+    profiler.begin_frame(width, height);
+    software_renderer_imp->set_profiler(&profiler);
+  }
+
+  draw_passes();
+
+  software_renderer_imp->set_profiler(nullptr);
+  profiling_frame = false;
+}
+
+void DrawSVG::draw_passes() {
+
+  software_renderer->draw_svg(*tabs[current_tab]);
+  if (render_cancel) return;
+
+  // the 1 sample per pixel render is a preview that is shown while the
+  // refinement passes are drawn
+  if (progressive_active()) {
+    progressive_pass = sample_pattern.size() > 1 ? 0 : 1;
+  }
+  publish_frame();
+
+  while (progressive_active() && progressive_pass < sample_pattern.size()) {
+    refine();
+    if (render_cancel) return;
+    publish_frame();
+  }
+}
+
+void DrawSVG::publish_frame() {
+
+  // the profile covers all passes drawn so far
+  vector<unsigned char> heat;
+  vector<string> lines;
+  if (profiling_frame) build_profile(heat, lines);
+
+  lock_guard<mutex> lock(render_lock);
+  memcpy(&frontbuffer[0], &framebuffer[0], framebuffer.size());
+  frame_pass = progressive_pass;
+  if (profiling_frame) {
+    profile_heat.swap(heat);
+    profile_lines.swap(lines);
+  }
+}
+
+void DrawSVG::build_profile(vector<unsigned char>& heat,
+                            vector<string>& lines) {
+
+  // samples written per pixel on a log scale, from translucent blue for
+  // a single sample to opaque red for the most overdrawn pixel
+  uint32_t peak = 1;
+  for (size_t i = 0; i < profiler.heat.size(); i++) {
+    peak = max(peak, profiler.heat[i]);
+  }
+  float scale = 1.0f / log(1.0f + peak);
+
+  heat.assign(4 * profiler.heat.size(), 0);
+  for (size_t i = 0; i < profiler.heat.size(); i++) {
+    if (!profiler.heat[i]) continue;
+    float t = log(1.0f + profiler.heat[i]) * scale;
+    heat[4 * i + 0] = (unsigned char) (255 * t);
+    heat[4 * i + 2] = (unsigned char) (255 * (1 - t));
+    heat[4 * i + 3] = (unsigned char) (64 + 160 * t);
+  }
+
+  // totals and the most expensive elements
+  char line[256];
+  const RenderCost& total = profiler.total;
+  snprintf(line, sizeof(line), "%.2f ms, %llu samples, %llu triangles",
+           total.time * 1e3, (unsigned long long) total.samples,
+           (unsigned long long) total.triangles);
+  lines.push_back(line);
+
+  unordered_map<const SVGElement*, string> names;
+  RenderProfiler::name_elements(*tabs[current_tab], names);
+  vector< pair<const SVGElement*, RenderCost> > top = profiler.top(10);
+  for (size_t i = 0; i < top.size(); i++) {
+    const RenderCost& cost = top[i].second;
+    snprintf(line, sizeof(line), "%-8s %-12s %7.2f ms %9llu samples %6llu triangles",
+             RenderProfiler::type_name(top[i].first->type),
+             names[top[i].first].c_str(), cost.time * 1e3,
+             (unsigned long long) cost.samples,
+             (unsigned long long) cost.triangles);
+    lines.push_back(line);
+  }
+}
+
+void DrawSVG::draw_profile() {
+
+  if (profile_heat.size() == 4 * width * height) {
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    display_pixels(&profile_heat[0]);
+    glDisable(GL_BLEND);
+  }
+
+  profile_text.clear();
+  for (size_t i = 0; i < profile_lines.size(); i++) {
+    float y = 40 + 18 * i;
+    profile_text.add_line(-1.0f + 20.0f / width, 1.0f - 2.0f * y / height,
+                          profile_lines[i], 14, Color(1, 1, 1));
+  }
+  profile_text.render();
+}
+
+void DrawSVG::next_sample_pattern() {
+  if (method == Software) {
+    pattern_type = (SamplePatternType) ((pattern_type + 1) % 3);
+    update_sample_pattern();
+    redraw();
+  }
+}
+
+void DrawSVG::update_sample_pattern() {
+
+  stop_render();
+
+  sample_pattern = SamplePattern::create(pattern_type, sample_rate);
+  progressive_pass = 0;
+
+  // in progressive mode the implementation renders one sample per pass
+  software_renderer_imp->set_sample_pattern(
+    progressive ? SamplePattern::grid(1) : sample_pattern);
+  software_renderer_ref->set_sample_rate(sample_rate);
+}
+
+// images of a list of elements, including those in groups
+static void collect_images(const vector<SVGElement*>& elements,
+                           vector<Image*>& images) {
+  for (size_t i = 0; i < elements.size(); ++i) {
+    SVGElement* element = elements[i];
+    if (!element) continue;
+    if (element->type == IMAGE) {
+      images.push_back(static_cast<Image*>(element));
+    } else if (element->type == GROUP) {
+      collect_images(static_cast<Group*>(element)->elements, images);
+    }
+  }
+}
+
+static void collect_images(SVG* svg, vector<Image*>& images) {
+  collect_images(svg->elements, images);
+  map<string, SVGElement*>::iterator it;
+  for (it = svg->symbols.begin(); it != svg->symbols.end(); ++it) {
+    if (it->second) collect_images(vector<SVGElement*>(1, it->second), images);
+  }
+}
+
+void DrawSVG::generate_mipmaps(SVG* svg, Sampler2D* sampler,
+                               bool missing_only) {
+  vector<Image*> images;
+  collect_images(svg, images);
+
+  set<Texture*> done;
+  for ( size_t i = 0; i < images.size(); ++i ) {
+
+    Image* image = images[i];
+    Texture& tex = image->texture();
+    if (!done.insert(&tex).second) continue;
+    if (missing_only && tex.mipmap.size() > 1) continue;
+
+    // mips are generated from uncompressed texels, those of a texture that
+    // was compressed before are decoded again from its source image. Large
+    // textures are then block compressed
+    TextureCompression::restore(tex);
+    sampler->generate_mips(tex, 0);
+    if (tex.width * tex.height >= TextureCompression::kMinTexels) {
+      TextureCompression::compress(tex);
+    }
+  }
+}
+
+void DrawSVG::regenerate_mipmap(size_t tab_index, bool missing_only) {
+  stop_render();
   if (tab_index < tabs.size()) {
-    SVG* svg = tabs[tab_index];
-    for ( size_t i = 0; i < svg->elements.size(); ++i ) {
-  
-      SVGElement* element = svg->elements[i];
-      if (element->type == IMAGE) {
-          Texture& tex = static_cast<Image*>(element)->tex;
-          sampler->generate_mips(tex, 0);
+    generate_mipmaps(tabs[tab_index], sampler, missing_only);
+
+    // refresh copies held for the reference renderer
+    vector<Image*> images;
+    collect_images(tabs[tab_index], images);
+    for ( size_t i = 0; i < images.size(); ++i ) {
+      Image* image = images[i];
+      if (image->shared_tex && !image->tex.mipmap.empty()) {
+        image->tex = *image->shared_tex;
+        TextureCompression::decompress(image->tex);
+      }
+    }
+  }
+}
+
+void DrawSVG::copy_reference_textures(size_t tab_index) {
+  if (tab_index < tabs.size()) {
+    vector<Image*> images;
+    collect_images(tabs[tab_index], images);
+    for ( size_t i = 0; i < images.size(); ++i ) {
+      Image* image = images[i];
+      if (image->shared_tex && image->tex.mipmap.empty()) {
+        image->tex = *image->shared_tex;
+        TextureCompression::decompress(image->tex);
       }
     }
   }
 }
 
+void DrawSVG::release_reference_textures(size_t tab_index) {
+  if (tab_index < tabs.size()) {
+    vector<Image*> images;
+    collect_images(tabs[tab_index], images);
+    for ( size_t i = 0; i < images.size(); ++i ) {
+      Image* image = images[i];
+      if (image->shared_tex) image->tex = Texture();
+    }
+  }
+}
+
 void DrawSVG::auto_adjust(size_t tab_index) {
   
   float w = tabs[tab_index]->width;
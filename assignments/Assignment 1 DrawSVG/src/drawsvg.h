@@ -1,13 +1,20 @@
 #ifndef CMU462_DRAWSVG_H
 #define CMU462_DRAWSVG_H
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <vector>
+#include <stdint.h>
 
 #include "CMU462.h"
 #include "renderer.h"
+#include "osdtext.h"
 #include "svg.h"
 #include "hardware_renderer.h"
 #include "software_renderer.h"
+#include "render_profiler.h"
 
 namespace CMU462 {
 
@@ -41,6 +48,19 @@ class DrawSVG : public Renderer {
     current_tab (0),
     show_diff (false),
     show_zoom (false),
+    show_profile (false),
+    profiling_frame (false),
+    pattern_type (SAMPLE_GRID),
+    sample_pattern ( SamplePattern::grid(1) ),
+    progressive (false),
+    progressive_pass (0),
+    progressive_weight (0),
+    render_pending (false),
+    render_busy (false),
+    render_quit (false),
+    render_cancel (false),
+    frame_pass (0),
+    reference_svg (NULL),
     norm_to_screen ( Matrix3x3::identity() )  { }
 
   /**
@@ -78,6 +98,7 @@ class DrawSVG : public Renderer {
    */
   inline void setRenderMethod( RenderMethod method ) {    
     
+    stop_render();
     this->method = method; 
     
     switch (method) {
@@ -98,9 +119,11 @@ class DrawSVG : public Renderer {
   void drawIllustration( SVG& svg );
 
   /**
-   * Load a svg into a new tab if there is one available.
+   * Load a svg into a new tab if there is one available. A svg with a
+   * cache key is cached once its mipmaps are generated, a svg loaded from
+   * the cache already has its mipmaps.
    */
-  void newTab( SVG* svg );
+  void newTab( SVG* svg, uint64_t cache_key = 0, bool cached = false );
 
   /**
    * Delete a tab and in the renderer.
@@ -117,6 +140,14 @@ class DrawSVG : public Renderer {
    */
   int getErrorCount( void ) const;
 
+  /**
+   * Generate the mipmaps of all images of a svg, each shared texture
+   * once. With missing_only set textures that already have mip levels
+   * are left as they are.
+   */
+  static void generate_mipmaps( SVG* svg, Sampler2D* sampler,
+                                bool missing_only = false );
+
  private:
 
   /* window size */
@@ -139,7 +170,7 @@ class DrawSVG : public Renderer {
 
   /* software renderer */
   SoftwareRenderer* software_renderer;
-  SoftwareRenderer* software_renderer_imp;
+  SoftwareRendererImp* software_renderer_imp;
   SoftwareRenderer* software_renderer_ref;
 
   /* texture sampler */
@@ -149,6 +180,8 @@ class DrawSVG : public Renderer {
 
   /* tabs */
   std::vector<SVG*> tabs; size_t current_tab;
+  std::vector<uint64_t> tab_cache_keys;
+  std::vector<bool> tab_cached;
   std::vector<Viewport*> viewport_imp;
   std::vector<Viewport*> viewport_ref;
   
@@ -160,13 +193,72 @@ class DrawSVG : public Renderer {
   bool show_zoom;
   void draw_zoom();
 
+  /* cost profile of the implementation, shown as a heat map of the
+     samples written per pixel and a list of the most expensive elements.
+     The overlay is built by the render worker along with each frame */
+  bool show_profile;
+  bool profiling_frame;
+  RenderProfiler profiler;
+  std::vector<unsigned char> profile_heat;
+  std::vector<std::string> profile_lines;
+  OSDText profile_text;
+  void build_profile( std::vector<unsigned char>& heat,
+                      std::vector<std::string>& lines );
+  void draw_profile();
+
   /* samples rate (sqrt(s/pix)) */
   size_t sample_rate;
   void inc_sample_rate();
   void dec_sample_rate();
 
-  /* regenerate mipmap */
-  void regenerate_mipmap(size_t tab_index);
+  /* sample positions used by the implementation at sample_rate */
+  SamplePatternType pattern_type;
+  SamplePattern sample_pattern;
+  void next_sample_pattern();
+  void update_sample_pattern();
+
+  /* progressive anti-aliasing */
+  bool progressive;
+  size_t progressive_pass;
+  std::vector<float> progressive_accum;
+  float progressive_weight;
+  bool progressive_active() const;
+  void toggle_progressive();
+  void refine();
+
+  /* background rendering: the software renderer draws into framebuffer
+     on a worker thread and completed frames are copied to frontbuffer,
+     which is what gets displayed. Anything the worker reads may only be
+     changed after stop_render() */
+  std::thread render_thread;
+  std::mutex render_lock;
+  std::condition_variable render_cv;
+  bool render_pending;
+  bool render_busy;
+  bool render_quit;
+  std::atomic<bool> render_cancel;
+  std::vector<unsigned char> frontbuffer;
+  size_t frame_pass; // progressive pass of the frame in frontbuffer
+  void start_render();
+  void stop_render();
+  void render_loop();
+  void draw_frame();
+  void draw_passes();
+  void publish_frame();
+
+  /* regenerate mipmap, textures shared with other tabs are regenerated
+     once and only if they have no mip levels yet when missing_only is set */
+  void regenerate_mipmap(size_t tab_index, bool missing_only = false);
+
+  /* copy shared textures of a tab into its images for the reference
+     renderer, which only reads uncompressed texels from Image::tex */
+  void copy_reference_textures(size_t tab_index);
+
+  /* free the copies of shared textures held for the reference renderer */
+  void release_reference_textures(size_t tab_index);
+
+  /* tab whose images hold copies of shared textures, if any */
+  SVG* reference_svg;
 
   /* audo-adjust canvas_to_norm */
   void auto_adjust(size_t tab_index);
@@ -108,6 +108,12 @@ void HardwareRenderer::draw_element( SVGElement* element ) {
     case GROUP:
       draw_group(static_cast<Group&>(*element));
       break;
+    case USE:
+      draw_use(static_cast<Use&>(*element));
+      break;
+    case PATH:
+      draw_path(static_cast<Path&>(*element));
+      break;
     default:
       break;
   }
@@ -190,9 +196,8 @@ void HardwareRenderer::draw_polygon( Polygon& polygon ) {
   c = polygon.style.fillColor;
   if( c.a != 0 ) {
 
-    // triangulate
-    vector<Vector2D> triangles;
-    triangulate( polygon, triangles );
+    // triangulated when parsed
+    const vector<Vector2D>& triangles = polygon.triangles;
 
     // draw as triangles
     for (size_t i = 0; i < triangles.size(); i += 3) {
@@ -226,7 +231,7 @@ void HardwareRenderer::draw_image( Image& image ) {
   Vector2D p0 = transform(image.position);
   Vector2D p1 = transform(image.position + image.dimension);
 
-  rasterize_image( p0.x, p0.y, p1.x, p1.y, image.tex );
+  rasterize_image( p0.x, p0.y, p1.x, p1.y, image.texture() );
 }
 
 void HardwareRenderer::draw_group( Group& group ) {
@@ -237,6 +242,54 @@ void HardwareRenderer::draw_group( Group& group ) {
 
 }
 
+void HardwareRenderer::draw_path( Path& path ) {
+
+  Path::Flattening& f = path.flatten(transformation);
+
+  // draw fill
+  Color c = path.style.fillColor;
+  if( c.a != 0 ) {
+    for (size_t i = 0; i < f.subpaths.size(); i++) {
+      Polygon& subpath = f.subpaths[i];
+      vector<Vector2D>& triangles = subpath.triangles;
+      if( triangles.empty() && subpath.points.size() >= 3 ) {
+        triangulate( subpath, triangles );
+      }
+      for (size_t j = 0; j < triangles.size(); j += 3) {
+        Vector2D p0 = transform(triangles[j + 0]);
+        Vector2D p1 = transform(triangles[j + 1]);
+        Vector2D p2 = transform(triangles[j + 2]);
+        rasterize_triangle( p0.x, p0.y, p1.x, p1.y, p2.x, p2.y, c );
+      }
+    }
+  }
+
+  // draw outline
+  c = path.style.strokeColor;
+  if( c.a != 0 ) {
+    for (size_t i = 0; i < f.subpaths.size(); i++) {
+      const vector<Vector2D>& points = f.subpaths[i].points;
+      int nPoints = points.size();
+      int nEdges = f.closed[i] ? nPoints : nPoints - 1;
+      for( int j = 0; j < nEdges; j++ ) {
+        Vector2D p0 = transform(points[(j+0) % nPoints]);
+        Vector2D p1 = transform(points[(j+1) % nPoints]);
+        rasterize_line( p0.x, p0.y, p1.x, p1.y, c );
+      }
+    }
+  }
+}
+
+void HardwareRenderer::draw_use( Use& use ) {
+
+  // unresolved reference
+  if (!use.symbol) return;
+
+  // style overrides are only applied by the software renderer
+  draw_element(use.symbol);
+
+}
+
 
 // Rasterization //
 
@@ -283,10 +336,6 @@ void HardwareRenderer::rasterize_image(float x0, float y0,
                                        Texture& tex) {
   glColor4f(1, 1, 1, 1);
   
-  size_t w = tex.mipmap[0].width;
-  size_t h = tex.mipmap[0].height;
-  unsigned char* texels = &tex.mipmap[0].texels[0];
-
   GLuint texid;
   glGenTextures(1, &texid);
 
@@ -296,11 +345,41 @@ void HardwareRenderer::rasterize_image(float x0, float y0,
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
   glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
   glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); 
-  
-  // create texture and mipmap
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 
-                              0, GL_RGBA, GL_UNSIGNED_BYTE, texels);
-  glGenerateMipmap(GL_TEXTURE_2D);
+
+  TexelFormat format = TextureCompression::format(tex, 0);
+  if (format != TEXELS_RGBA8 && GLEW_EXT_texture_compression_s3tc) {
+
+    // block compressed levels are uploaded as they are stored, every level
+    // of 4x4 or more is compressed and those below are left out of the chain
+    GLenum internal = format == TEXELS_BC1 ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+                                           : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    GLint max_level = 0;
+    for (size_t i = 0; i < tex.mipmap.size(); i++) {
+      const MipLevel& level = tex.mipmap[i];
+      if (TextureCompression::format(tex, i) != format) break;
+      glCompressedTexImage2D(GL_TEXTURE_2D, i, internal,
+                             level.width, level.height, 0,
+                             level.texels.size(), &level.texels[0]);
+      max_level = i;
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, max_level);
+
+  } else {
+
+    // without S3TC support a compressed level 0 is decoded for the upload
+    const MipLevel* level = &tex.mipmap[0];
+    MipLevel decoded;
+    if (format != TEXELS_RGBA8) {
+      decoded = *level;
+      TextureCompression::decompress(decoded, format);
+      level = &decoded;
+    }
+
+    // create texture and mipmap
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, level->width, level->height, 
+                                0, GL_RGBA, GL_UNSIGNED_BYTE, &level->texels[0]);
+    glGenerateMipmap(GL_TEXTURE_2D);
+  }
   
   // enable texture and draw
   glEnable(GL_TEXTURE_2D);
@@ -313,6 +392,7 @@ void HardwareRenderer::rasterize_image(float x0, float y0,
   glEnd();
 
   glDisable(GL_TEXTURE_2D);
+  glDeleteTextures(1, &texid);
 
   return;
 }
@@ -68,6 +68,12 @@ class HardwareRenderer : public SVGRenderer {
   // Draw a group
   void draw_group( Group& group );
 
+  // Draw an instance of a shared element
+  void draw_use( Use& use );
+
+  // Draw a path
+  void draw_path( Path& path );
+
   // Rasterization //
 
   // rasterize a point
@@ -1,6 +1,7 @@
 #include "CMU462.h"
 #include "viewer.h"
 #include "drawsvg.h"
+#include "svg_cache.h"
 
 #include <sys/stat.h>
 #include <dirent.h>
@@ -11,16 +12,110 @@ using namespace CMU462;
 
 #define msg(s) cerr << "[DrawSVG] " << s << endl;
 
-int loadFile( DrawSVG* drawsvg, const char* path ) {
+// files larger than this are streamed instead of loaded as a XML document
+#define STREAM_THRESHOLD (64 << 20)
+
+// size of the frame drawn when profiling without a window
+#define PROFILE_SIZE 1024
+
+// opens a document, NULL if it is not a valid svg file
+SVG* openFile( const char* path, uint64_t& key, bool& cached ) {
+
+  // previously opened documents are loaded from the cache
+  key = SVGCache::hash_file( path );
+  cached = false;
+  if( key ) {
+    SVG* svg = new SVG();
+    if( SVGCache::load( key, svg ) == 0 ) {
+      cached = true;
+      return svg;
+    }
+    delete svg;
+  }
 
   SVG* svg = new SVG();
 
-  if( SVGParser::load( path, svg ) < 0) {
+  struct stat st;
+  bool streamed = stat(path, &st) == 0 && st.st_size > STREAM_THRESHOLD;
+
+  if( (streamed ? SVGParser::stream( path, svg ) 
+                : SVGParser::load( path, svg )) < 0) {
     delete svg;
-    return -1;
+    return NULL;
   }
+
+  return svg;
+}
+
+int loadFile( DrawSVG* drawsvg, const char* path ) {
+
+  uint64_t key; bool cached;
+  SVG* svg = openFile( path, key, cached );
+  if( !svg ) return -1;
   
-  drawsvg->newTab( svg );
+  drawsvg->newTab( svg, key, cached );
+  return 0;
+}
+
+// draws a document once without a window, the way the viewer first shows
+// it, and writes the cost of its elements to a JSON or CSV report
+int profileFile( const char* path, const char* report ) {
+
+  uint64_t key; bool cached;
+  SVG* svg = openFile( path, key, cached );
+  if( !svg ) {
+    msg("Invalid svg file: " << path);
+    return -1;
+  }
+
+  Sampler2DImp sampler;
+  DrawSVG::generate_mipmaps( svg, &sampler, true );
+
+  const size_t width = PROFILE_SIZE, height = PROFILE_SIZE;
+  vector<unsigned char> pixels( 4 * width * height );
+  SoftwareRendererImp renderer;
+  renderer.set_render_target( &pixels[0], width, height );
+  renderer.set_tex_sampler( &sampler );
+
+  ViewportImp viewport;
+  viewport.set_viewbox( svg->width / 2, svg->height / 2,
+                        1.2 * max( svg->width, svg->height ) / 2 );
+  Matrix3x3 norm_to_screen = Matrix3x3::identity();
+  norm_to_screen(0,0) = width; norm_to_screen(1,1) = height;
+  renderer.set_svg_2_screen( norm_to_screen * viewport.get_svg_2_norm() );
+
+  RenderProfiler profiler;
+  profiler.begin_frame( width, height );
+  renderer.set_profiler( &profiler );
+  renderer.draw_svg( *svg );
+
+  int result = profiler.write_report( report, *svg );
+  if( result < 0 ) {
+    msg("Could not write " << report);
+  } else {
+    msg("Rendered " << path << " in " << profiler.total.time * 1e3 << " ms, "
+        << "report written to " << report);
+  }
+
+  delete svg;
+  return result;
+}
+
+// loads a document with both the XML and the streaming parser and
+// compares the results, returns 0 if they are the same
+int checkStream( const char* path ) {
+
+  SVG dom, streamed;
+  if( SVGParser::load( path, &dom ) < 0 || SVGParser::stream( path, &streamed ) < 0 ) {
+    msg("Invalid svg file: " << path);
+    return -1;
+  }
+
+  if( !SVGCache::equal( &dom, &streamed ) ) {
+    msg("Streaming " << path << " gives a different document");
+    return -1;
+  }
+  msg("Streaming " << path << " gives the same document");
   return 0;
 }
 
@@ -90,6 +185,16 @@ int loadPath( DrawSVG* drawsvg, const char* path) {
 
 int main( int argc, char** argv ) {
 
+  // profile without a window
+  if( argc == 4 && string(argv[1]) == "--profile" ) {
+    return profileFile( argv[3], argv[2] ) < 0 ? 1 : 0;
+  }
+
+  // compare the streaming parser with the XML parser
+  if( argc == 3 && string(argv[1]) == "--check-stream" ) {
+    return checkStream( argv[2] ) < 0 ? 1 : 0;
+  }
+
   // create viewer
   Viewer viewer = Viewer();
 
@@ -103,7 +208,10 @@ int main( int argc, char** argv ) {
   if( argc == 2 ) {
     if (loadPath(drawsvg, argv[1]) < 0) exit(0);
   } else {
-    msg("Usage: drawsvg <path to test file or directory>"); exit(0);
+    msg("Usage: drawsvg <path to test file or directory>");
+    msg("       drawsvg --profile <report.json|report.csv> <test file>");
+    msg("       drawsvg --check-stream <test file>");
+    exit(0);
   }
 
   // init viewer
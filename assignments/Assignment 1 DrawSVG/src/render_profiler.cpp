@@ -0,0 +1,183 @@
+#include "render_profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+using namespace std;
+
+namespace CMU462 {
+
+static inline double now() {
+  return chrono::duration<double>(
+    chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+void RenderProfiler::begin_frame( size_t width, size_t height ) {
+
+  this->width = width;
+  this->height = height;
+  heat.assign( width * height, 0 );
+
+  elements.clear();
+  for ( int i = 0; i <= PATH; i++ ) types[i] = RenderCost();
+  total = RenderCost();
+  stack.clear();
+}
+
+void RenderProfiler::enter( const SVGElement* element ) {
+
+  Scope scope;
+  scope.element = element;
+  scope.samples = samples;
+  scope.triangles = triangles;
+  stack.push_back( scope );
+
+  // taken last so that the bookkeeping is not timed
+  stack.back().start = now();
+}
+
+void RenderProfiler::leave() {
+
+  double end = now();
+  Scope& scope = stack.back();
+
+  RenderCost inclusive;
+  inclusive.time = end - scope.start;
+  inclusive.samples = samples - scope.samples;
+  inclusive.triangles = triangles - scope.triangles;
+
+  RenderCost cost;
+  cost.time = max( 0.0, inclusive.time - scope.children.time );
+  cost.samples = inclusive.samples - scope.children.samples;
+  cost.triangles = inclusive.triangles - scope.children.triangles;
+  cost.draws = 1;
+
+  elements[scope.element].add( cost );
+  types[scope.element->type].add( cost );
+  total.add( cost );
+
+  stack.pop_back();
+  if ( !stack.empty() ) stack.back().children.add( inclusive );
+}
+
+static bool more_expensive( const pair<const SVGElement*, RenderCost>& a,
+                            const pair<const SVGElement*, RenderCost>& b ) {
+  return a.second.time > b.second.time;
+}
+
+vector< pair<const SVGElement*, RenderCost> > RenderProfiler::top( size_t n ) const {
+
+  vector< pair<const SVGElement*, RenderCost> > costs ( elements.begin(), elements.end() );
+  n = min( n, costs.size() );
+  partial_sort( costs.begin(), costs.begin() + n, costs.end(), more_expensive );
+  costs.resize( n );
+  return costs;
+}
+
+static void name_element( const SVGElement* element, const string& name,
+                          unordered_map<const SVGElement*, string>& names ) {
+  if ( !element ) return;
+  names[element] = name;
+  if ( element->type == GROUP ) {
+    const vector<SVGElement*>& elements = static_cast<const Group*>( element )->elements;
+    for ( size_t i = 0; i < elements.size(); i++ ) {
+      name_element( elements[i], name + "/" + to_string( i ), names );
+    }
+  }
+}
+
+void RenderProfiler::name_elements( const SVG& svg,
+    unordered_map<const SVGElement*, string>& names ) {
+
+  names.clear();
+  map<string, SVGElement*>::const_iterator it;
+  for ( it = svg.symbols.begin(); it != svg.symbols.end(); ++it ) {
+    name_element( it->second, "#" + it->first, names );
+  }
+
+  // document positions take precedence over symbol names
+  for ( size_t i = 0; i < svg.elements.size(); i++ ) {
+    name_element( svg.elements[i], to_string( i ), names );
+  }
+}
+
+const char* RenderProfiler::type_name( SVGElementType type ) {
+  static const char* names[] = { "none", "point", "line", "polyline", "rect",
+                                 "polygon", "ellipse", "image", "group",
+                                 "use", "path" };
+  return type >= NONE && type <= PATH ? names[type] : "unknown";
+}
+
+// quotes a string for JSON
+static string quote( const string& str ) {
+  string quoted = "\"";
+  for ( size_t i = 0; i < str.size(); i++ ) {
+    if ( str[i] == '"' || str[i] == '\\' ) quoted += '\\';
+    quoted += str[i];
+  }
+  return quoted + "\"";
+}
+
+int RenderProfiler::write_report( const char* filename, const SVG& svg ) const {
+
+  unordered_map<const SVGElement*, string> names;
+  name_elements( svg, names );
+  vector< pair<const SVGElement*, RenderCost> > costs = top( elements.size() );
+
+  size_t length = strlen( filename );
+  bool csv = length >= 4 && strcmp( filename + length - 4, ".csv" ) == 0;
+
+  ostringstream out;
+  if ( csv ) {
+
+    // one row per element type, then one row per element
+    out << "element,type,time_ms,samples,triangles,draws\n";
+    for ( int i = 0; i <= PATH; i++ ) {
+      const RenderCost& cost = types[i];
+      if ( !cost.draws ) continue;
+      out << "*," << type_name( (SVGElementType) i ) << "," << cost.time * 1e3 << ","
+          << cost.samples << "," << cost.triangles << "," << cost.draws << "\n";
+    }
+    for ( size_t i = 0; i < costs.size(); i++ ) {
+      const RenderCost& cost = costs[i].second;
+      out << names[costs[i].first] << "," << type_name( costs[i].first->type ) << ","
+          << cost.time * 1e3 << "," << cost.samples << "," << cost.triangles << ","
+          << cost.draws << "\n";
+    }
+
+  } else {
+
+    out << "{\n  \"width\": " << width << ", \"height\": " << height << ",\n"
+        << "  \"time_ms\": " << total.time * 1e3 << ", \"samples\": " << total.samples
+        << ", \"triangles\": " << total.triangles << ",\n  \"types\": [";
+    bool first = true;
+    for ( int i = 0; i <= PATH; i++ ) {
+      const RenderCost& cost = types[i];
+      if ( !cost.draws ) continue;
+      out << ( first ? "\n" : ",\n" ) << "    { \"type\": " << quote( type_name( (SVGElementType) i ) )
+          << ", \"time_ms\": " << cost.time * 1e3 << ", \"samples\": " << cost.samples
+          << ", \"triangles\": " << cost.triangles << ", \"draws\": " << cost.draws << " }";
+      first = false;
+    }
+    out << "\n  ],\n  \"elements\": [";
+    for ( size_t i = 0; i < costs.size(); i++ ) {
+      const RenderCost& cost = costs[i].second;
+      out << ( i ? ",\n" : "\n" ) << "    { \"element\": " << quote( names[costs[i].first] )
+          << ", \"type\": " << quote( type_name( costs[i].first->type ) )
+          << ", \"time_ms\": " << cost.time * 1e3 << ", \"samples\": " << cost.samples
+          << ", \"triangles\": " << cost.triangles << ", \"draws\": " << cost.draws << " }";
+    }
+    out << "\n  ]\n}\n";
+  }
+
+  FILE* file = fopen( filename, "w" );
+  if ( !file ) return -1;
+  string report = out.str();
+  bool ok = fwrite( report.data(), 1, report.size(), file ) == report.size();
+  return fclose( file ) == 0 && ok ? 0 : -1;
+}
+
+} // namespace CMU462
@@ -0,0 +1,109 @@
+#ifndef CMU462_RENDER_PROFILER_H
+#define CMU462_RENDER_PROFILER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "svg.h"
+
+namespace CMU462 {
+
+/**
+ * Cost of drawing an element, or all elements of a type. The cost of an
+ * element excludes the elements drawn inside it (group members and the
+ * symbols of instances), which are counted on their own.
+ */
+struct RenderCost {
+
+  RenderCost() : time ( 0 ), samples ( 0 ), triangles ( 0 ), draws ( 0 ) { }
+
+  double time;        // seconds
+  uint64_t samples;   // samples written
+  uint64_t triangles; // triangles rasterized
+  uint64_t draws;     // times drawn, shared symbols are drawn per instance
+
+  inline void add( const RenderCost& cost ) {
+    time += cost.time;
+    samples += cost.samples;
+    triangles += cost.triangles;
+    draws += cost.draws;
+  }
+
+}; // struct RenderCost
+
+/**
+ * Records the cost of every element drawn by the software renderer over a
+ * frame, and the number of samples written to every pixel as a heat map.
+ * The renderer only calls into the profiler when one is set, so there is
+ * no cost to drawing without it.
+ */
+class RenderProfiler {
+ public:
+
+  RenderProfiler() : width ( 0 ), height ( 0 ), samples ( 0 ), triangles ( 0 ) { }
+
+  // clears the costs of the previous frame
+  void begin_frame( size_t width, size_t height );
+
+  // brackets the drawing of an element, scopes nest for groups and uses
+  void enter( const SVGElement* element );
+  void leave();
+
+  // n samples were written to each of count pixels from (x, y) on, which
+  // are inside the frame
+  inline void span( int x, int y, int count, int n = 1 ) {
+    samples += (uint64_t) count * n;
+    uint32_t* h = &heat[x + y * width];
+    for ( int i = 0; i < count; i++ ) h[i] += n;
+  }
+
+  // a triangle was rasterized
+  inline void triangle() {
+    triangles++;
+  }
+
+  // elements with the highest cost in time, most expensive first
+  std::vector< std::pair<const SVGElement*, RenderCost> > top( size_t n ) const;
+
+  // names elements by their position in the document, "3/0" is the first
+  // child of the fourth element and "#id/0" the first child of a symbol
+  // group
+  static void name_elements( const SVG& svg,
+      std::unordered_map<const SVGElement*, std::string>& names );
+
+  static const char* type_name( SVGElementType type );
+
+  // writes the costs of the frame as CSV if the file name ends with .csv
+  // and as JSON otherwise, returns 0 on success
+  int write_report( const char* filename, const SVG& svg ) const;
+
+  // costs of the frame
+  std::unordered_map<const SVGElement*, RenderCost> elements;
+  RenderCost types[PATH + 1];
+  RenderCost total;
+
+  // samples written per pixel
+  std::vector<uint32_t> heat;
+  size_t width, height;
+
+ private:
+
+  struct Scope {
+    const SVGElement* element;
+    double start;
+    uint64_t samples;
+    uint64_t triangles;
+    RenderCost children;
+  };
+
+  std::vector<Scope> stack;
+  uint64_t samples;
+  uint64_t triangles;
+
+}; // class RenderProfiler
+
+} // namespace CMU462
+
+#endif // CMU462_RENDER_PROFILER_H
@@ -0,0 +1,437 @@
+#include "sample_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SAMPLE_SSE
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SAMPLE_AVX2
+#endif
+#endif
+
+using namespace std;
+
+namespace CMU462 {
+
+static const float SAMPLE_MAX = 65535.0f;
+
+// colors are rounded to samples half up, here and in the SIMD kernels
+static inline uint16_t to_sample( float c ) {
+  c = c * SAMPLE_MAX + 0.5f;
+  return c <= 0 ? 0 : c >= SAMPLE_MAX ? 65535 : (uint16_t) c;
+}
+
+// a * b / 65535 with rounding, so that stacked layers do not drift
+static inline uint32_t mul( uint32_t a, uint32_t b ) {
+  uint32_t t = a * b + 32768;
+  return ( t + ( t >> 16 ) ) >> 16;
+}
+
+// src + dst * (1 - src alpha) for one sample
+static inline void blend( uint16_t* dst, const uint16_t* src ) {
+  uint32_t inv = 65535 - src[3];
+  for ( int c = 0; c < 4; c++ ) {
+    uint32_t v = src[c] + mul( dst[c], inv );
+    dst[c] = v > 65535 ? 65535 : v;
+  }
+}
+
+// factors of the Porter-Duff operators, src * Fa + dst * Fb
+enum Factor {
+  F_ZERO,
+  F_ONE,
+  F_SRC_ALPHA,
+  F_INV_SRC_ALPHA,
+  F_DST_ALPHA,
+  F_INV_DST_ALPHA
+};
+
+// c scaled by factor F of a sample with alpha sa over alpha da
+template <int F>
+static inline uint32_t apply( uint32_t c, uint32_t sa, uint32_t da ) {
+  switch ( F ) {
+    case F_ZERO:          return 0;
+    case F_ONE:           return c;
+    case F_SRC_ALPHA:     return mul( c, sa );
+    case F_INV_SRC_ALPHA: return mul( c, 65535 - sa );
+    case F_DST_ALPHA:     return mul( c, da );
+    default:              return mul( c, 65535 - da );
+  }
+}
+
+#ifdef SAMPLE_SSE
+
+// packs 32 bit values in [0, 65535] to unsigned 16 bit, SSE2 only packs
+// with signed saturation so the values are biased
+static inline __m128i pack_u16( __m128i a, __m128i b ) {
+  const __m128i bias = _mm_set1_epi32( 32768 );
+  __m128i r = _mm_packs_epi32( _mm_sub_epi32( a, bias ), _mm_sub_epi32( b, bias ) );
+  return _mm_xor_si128( r, _mm_set1_epi16( (short) 0x8000 ) );
+}
+
+// mul() for the channels of two samples at once
+static inline __m128i mul2( __m128i a, __m128i b ) {
+
+  // 32 bit products, divided by 65535 with rounding
+  __m128i lo = _mm_mullo_epi16( a, b );
+  __m128i hi = _mm_mulhi_epu16( a, b );
+  const __m128i half = _mm_set1_epi32( 32768 );
+  __m128i p0 = _mm_add_epi32( _mm_unpacklo_epi16( lo, hi ), half );
+  __m128i p1 = _mm_add_epi32( _mm_unpackhi_epi16( lo, hi ), half );
+  p0 = _mm_srli_epi32( _mm_add_epi32( p0, _mm_srli_epi32( p0, 16 ) ), 16 );
+  p1 = _mm_srli_epi32( _mm_add_epi32( p1, _mm_srli_epi32( p1, 16 ) ), 16 );
+
+  return pack_u16( p0, p1 );
+}
+
+// alpha of two samples, in all of their channels
+static inline __m128i alpha2( __m128i v ) {
+  return _mm_shufflehi_epi16( _mm_shufflelo_epi16( v, 0xff ), 0xff );
+}
+
+static inline __m128i invert2( __m128i v ) {
+  return _mm_xor_si128( v, _mm_set1_epi32( -1 ) );
+}
+
+// blend() for two samples at once
+static inline __m128i blend2( __m128i dst, __m128i src ) {
+  return _mm_adds_epu16( mul2( dst, invert2( alpha2( src ) ) ), src );
+}
+
+// apply() for two samples at once
+template <int F>
+static inline __m128i apply2( __m128i c, __m128i sa, __m128i da ) {
+  switch ( F ) {
+    case F_ZERO:          return _mm_setzero_si128();
+    case F_ONE:           return c;
+    case F_SRC_ALPHA:     return mul2( c, sa );
+    case F_INV_SRC_ALPHA: return mul2( c, invert2( sa ) );
+    case F_DST_ALPHA:     return mul2( c, da );
+    default:              return mul2( c, invert2( da ) );
+  }
+}
+
+// to_sample() of the channels of a color, truncated after adding a half
+static inline __m128i to_samples1( __m128 c ) {
+  const __m128 scale = _mm_set1_ps( SAMPLE_MAX );
+  c = _mm_add_ps( _mm_mul_ps( c, scale ), _mm_set1_ps( 0.5f ) );
+  return _mm_cvttps_epi32( _mm_min_ps( _mm_max_ps( c, _mm_setzero_ps() ), scale ) );
+}
+
+// two colors as samples
+static inline __m128i to_samples2( const Color* c ) {
+  return pack_u16( to_samples1( _mm_loadu_ps( &c[0].r ) ),
+                   to_samples1( _mm_loadu_ps( &c[1].r ) ) );
+}
+
+// samples at p and p + stride
+static inline __m128i load2( const uint16_t* p, size_t stride ) {
+  return _mm_unpacklo_epi64( _mm_loadl_epi64( (const __m128i*) p ),
+                             _mm_loadl_epi64( (const __m128i*) ( p + stride ) ) );
+}
+
+static inline void store2( uint16_t* p, size_t stride, __m128i v ) {
+  _mm_storel_epi64( (__m128i*) p, v );
+  _mm_storel_epi64( (__m128i*) ( p + stride ), _mm_unpackhi_epi64( v, v ) );
+}
+
+#endif
+
+#ifdef SAMPLE_AVX2
+
+// The kernels above for four samples at once. AVX2 unpacks and packs
+// within 128 bit lanes, so samples 0 and 1 stay in the low lane and
+// samples 2 and 3 in the high lane.
+
+static inline __m256i pack_u16_4( __m256i a, __m256i b ) {
+  const __m256i bias = _mm256_set1_epi32( 32768 );
+  __m256i r = _mm256_packs_epi32( _mm256_sub_epi32( a, bias ), _mm256_sub_epi32( b, bias ) );
+  return _mm256_xor_si256( r, _mm256_set1_epi16( (short) 0x8000 ) );
+}
+
+static inline __m256i mul4( __m256i a, __m256i b ) {
+  __m256i lo = _mm256_mullo_epi16( a, b );
+  __m256i hi = _mm256_mulhi_epu16( a, b );
+  const __m256i half = _mm256_set1_epi32( 32768 );
+  __m256i p0 = _mm256_add_epi32( _mm256_unpacklo_epi16( lo, hi ), half );
+  __m256i p1 = _mm256_add_epi32( _mm256_unpackhi_epi16( lo, hi ), half );
+  p0 = _mm256_srli_epi32( _mm256_add_epi32( p0, _mm256_srli_epi32( p0, 16 ) ), 16 );
+  p1 = _mm256_srli_epi32( _mm256_add_epi32( p1, _mm256_srli_epi32( p1, 16 ) ), 16 );
+
+  return pack_u16_4( p0, p1 );
+}
+
+static inline __m256i alpha4( __m256i v ) {
+  return _mm256_shufflehi_epi16( _mm256_shufflelo_epi16( v, 0xff ), 0xff );
+}
+
+static inline __m256i invert4( __m256i v ) {
+  return _mm256_xor_si256( v, _mm256_set1_epi32( -1 ) );
+}
+
+static inline __m256i blend4( __m256i dst, __m256i src ) {
+  return _mm256_adds_epu16( mul4( dst, invert4( alpha4( src ) ) ), src );
+}
+
+template <int F>
+static inline __m256i apply4( __m256i c, __m256i sa, __m256i da ) {
+  switch ( F ) {
+    case F_ZERO:          return _mm256_setzero_si256();
+    case F_ONE:           return c;
+    case F_SRC_ALPHA:     return mul4( c, sa );
+    case F_INV_SRC_ALPHA: return mul4( c, invert4( sa ) );
+    case F_DST_ALPHA:     return mul4( c, da );
+    default:              return mul4( c, invert4( da ) );
+  }
+}
+
+static inline __m256i to_samples4( const Color* c ) {
+  const __m256 scale = _mm256_set1_ps( SAMPLE_MAX );
+  __m256 c01 = _mm256_add_ps( _mm256_mul_ps( _mm256_loadu_ps( &c[0].r ), scale ), _mm256_set1_ps( 0.5f ) );
+  __m256 c23 = _mm256_add_ps( _mm256_mul_ps( _mm256_loadu_ps( &c[2].r ), scale ), _mm256_set1_ps( 0.5f ) );
+  c01 = _mm256_min_ps( _mm256_max_ps( c01, _mm256_setzero_ps() ), scale );
+  c23 = _mm256_min_ps( _mm256_max_ps( c23, _mm256_setzero_ps() ), scale );
+
+  // the pack leaves the samples in the order 0 2 1 3
+  __m256i r = pack_u16_4( _mm256_cvttps_epi32( c01 ), _mm256_cvttps_epi32( c23 ) );
+  return _mm256_permute4x64_epi64( r, 0xd8 );
+}
+
+// samples at p, p + stride, p + 2 * stride and p + 3 * stride
+static inline __m256i load4( const uint16_t* p, size_t stride ) {
+  return _mm256_inserti128_si256( _mm256_castsi128_si256( load2( p, stride ) ),
+                                  load2( p + 2 * stride, stride ), 1 );
+}
+
+static inline void store4( uint16_t* p, size_t stride, __m256i v ) {
+  store2( p, stride, _mm256_castsi256_si128( v ) );
+  store2( p + 2 * stride, stride, _mm256_extracti128_si256( v, 1 ) );
+}
+
+#endif
+
+// blends one color over count samples stride channels apart
+static void blend_run( uint16_t* p, size_t stride, int count, const Color& color ) {
+
+  uint16_t src[4] = { to_sample( color.r ), to_sample( color.g ),
+                      to_sample( color.b ), to_sample( color.a ) };
+
+  // opaque colors replace the samples
+  if ( src[3] == 65535 ) {
+    for ( int i = 0; i < count; i++, p += stride ) memcpy( p, src, sizeof(src) );
+    return;
+  }
+  if ( src[0] == 0 && src[1] == 0 && src[2] == 0 && src[3] == 0 ) return;
+
+  int i = 0;
+#ifdef SAMPLE_AVX2
+  int64_t packed;
+  memcpy( &packed, src, sizeof(packed) );
+  __m256i s4 = _mm256_set1_epi64x( packed );
+  for ( ; i + 4 <= count; i += 4, p += 4 * stride ) {
+    store4( p, stride, blend4( load4( p, stride ), s4 ) );
+  }
+#endif
+#ifdef SAMPLE_SSE
+  __m128i s = _mm_unpacklo_epi64( _mm_loadl_epi64( (const __m128i*) src ),
+                                  _mm_loadl_epi64( (const __m128i*) src ) );
+  for ( ; i + 2 <= count; i += 2, p += 2 * stride ) {
+    store2( p, stride, blend2( load2( p, stride ), s ) );
+  }
+#endif
+  for ( ; i < count; i++, p += stride ) blend( p, src );
+}
+
+// blends a color per sample over count samples stride channels apart
+static void blend_run( uint16_t* p, size_t stride, int count, const Color* colors ) {
+
+  int i = 0;
+#ifdef SAMPLE_AVX2
+  for ( ; i + 4 <= count; i += 4, p += 4 * stride ) {
+    store4( p, stride, blend4( load4( p, stride ), to_samples4( colors + i ) ) );
+  }
+#endif
+#ifdef SAMPLE_SSE
+  for ( ; i + 2 <= count; i += 2, p += 2 * stride ) {
+    store2( p, stride, blend2( load2( p, stride ), to_samples2( colors + i ) ) );
+  }
+#endif
+  for ( ; i < count; i++, p += stride ) {
+    const Color& c = colors[i];
+    uint16_t src[4] = { to_sample( c.r ), to_sample( c.g ),
+                        to_sample( c.b ), to_sample( c.a ) };
+    blend( p, src );
+  }
+}
+
+// composites count samples of a layer over dst with the operator of
+// factors FA and FB, the layer is scaled by opacity first
+template <int FA, int FB>
+static void composite_run( uint16_t* dst, const uint16_t* src, size_t count,
+                           uint16_t opacity ) {
+
+  size_t i = 0;
+#ifdef SAMPLE_AVX2
+  __m256i o4 = _mm256_set1_epi16( (short) opacity );
+  for ( ; i + 4 <= count; i += 4, dst += 16, src += 16 ) {
+    __m256i s = _mm256_loadu_si256( (const __m256i*) src );
+    __m256i d = _mm256_loadu_si256( (const __m256i*) dst );
+    if ( opacity != 65535 ) s = mul4( s, o4 );
+    __m256i sa = alpha4( s ), da = alpha4( d );
+    d = _mm256_adds_epu16( apply4<FA>( s, sa, da ), apply4<FB>( d, sa, da ) );
+    _mm256_storeu_si256( (__m256i*) dst, d );
+  }
+#endif
+#ifdef SAMPLE_SSE
+  __m128i o = _mm_set1_epi16( (short) opacity );
+  for ( ; i + 2 <= count; i += 2, dst += 8, src += 8 ) {
+    __m128i s = _mm_loadu_si128( (const __m128i*) src );
+    __m128i d = _mm_loadu_si128( (const __m128i*) dst );
+    if ( opacity != 65535 ) s = mul2( s, o );
+    __m128i sa = alpha2( s ), da = alpha2( d );
+    d = _mm_adds_epu16( apply2<FA>( s, sa, da ), apply2<FB>( d, sa, da ) );
+    _mm_storeu_si128( (__m128i*) dst, d );
+  }
+#endif
+  for ( ; i < count; i++, dst += 4, src += 4 ) {
+    uint32_t s[4];
+    for ( int c = 0; c < 4; c++ ) s[c] = mul( src[c], opacity );
+    uint32_t da = dst[3];
+    for ( int c = 0; c < 4; c++ ) {
+      uint32_t v = apply<FA>( s[c], s[3], da ) + apply<FB>( dst[c], s[3], da );
+      dst[c] = v > 65535 ? 65535 : v;
+    }
+  }
+}
+
+typedef void (*CompositeRun)( uint16_t*, const uint16_t*, size_t, uint16_t );
+
+// kernels of the operators, in CompositeOp order
+static const CompositeRun composite_runs[] = {
+  composite_run<F_ONE,           F_INV_SRC_ALPHA>, // src-over
+  composite_run<F_ZERO,          F_ZERO>,          // clear
+  composite_run<F_ONE,           F_ZERO>,          // src
+  composite_run<F_ZERO,          F_ONE>,           // dst
+  composite_run<F_INV_DST_ALPHA, F_ONE>,           // dst-over
+  composite_run<F_DST_ALPHA,     F_ZERO>,          // src-in
+  composite_run<F_ZERO,          F_SRC_ALPHA>,     // dst-in
+  composite_run<F_INV_DST_ALPHA, F_ZERO>,          // src-out
+  composite_run<F_ZERO,          F_INV_SRC_ALPHA>, // dst-out
+  composite_run<F_DST_ALPHA,     F_INV_SRC_ALPHA>, // src-atop
+  composite_run<F_INV_DST_ALPHA, F_SRC_ALPHA>,     // dst-atop
+  composite_run<F_INV_DST_ALPHA, F_INV_SRC_ALPHA>, // xor
+  composite_run<F_ONE,           F_ONE>            // plus
+};
+
+void SampleBuffer::resize( size_t width, size_t height, size_t samples ) {
+  this->x0 = 0;
+  this->y0 = 0;
+  this->width = width;
+  this->height = height;
+  this->samples = samples;
+  data.resize( 4 * width * height * samples );
+  clear();
+}
+
+void SampleBuffer::clear() {
+  if ( !data.empty() ) memset( &data[0], 0xff, data.size() * sizeof(uint16_t) );
+}
+
+void SampleBuffer::reset( int x0, int y0, size_t width, size_t height,
+                          size_t samples ) {
+  this->x0 = x0;
+  this->y0 = y0;
+  this->width = width;
+  this->height = height;
+  this->samples = samples;
+  data.resize( 4 * width * height * samples );
+  if ( !data.empty() ) memset( &data[0], 0, data.size() * sizeof(uint16_t) );
+}
+
+void SampleBuffer::blend_span( int x, int y, int s, int count, const Color& color ) {
+  if ( count > 0 ) blend_run( sample( x, y, s ), 4 * samples, count, color );
+}
+
+void SampleBuffer::blend_span( int x, int y, int s, int count, const Color* colors ) {
+  if ( count > 0 ) blend_run( sample( x, y, s ), 4 * samples, count, colors );
+}
+
+void SampleBuffer::blend_mask( int x, int y, const Color& color,
+                               const float* coverage ) {
+  if ( !coverage ) {
+    blend_run( sample( x, y, 0 ), 4, samples, color );
+    return;
+  }
+
+  scratch.resize( samples );
+  for ( size_t s = 0; s < samples; s++ ) scratch[s] = color * coverage[s];
+  blend_run( sample( x, y, 0 ), 4, samples, &scratch[0] );
+}
+
+void SampleBuffer::composite( const SampleBuffer& layer, float opacity,
+                              CompositeOp op ) {
+
+  if ( !layer.width || !layer.height ) return;
+
+  // rows of the layer are contiguous in both buffers
+  CompositeRun run = composite_runs[op];
+  uint16_t o = to_sample( opacity );
+  size_t count = layer.width * layer.samples;
+  for ( size_t y = 0; y < layer.height; y++ ) {
+    run( sample( layer.x0, layer.y0 + y, 0 ), &layer.data[4 * y * count], count, o );
+  }
+}
+
+bool SampleBuffer::bounded( CompositeOp op ) {
+  switch ( op ) {
+    case COMP_SRC_OVER:
+    case COMP_DST:
+    case COMP_DST_OVER:
+    case COMP_DST_OUT:
+    case COMP_SRC_ATOP:
+    case COMP_XOR:
+    case COMP_PLUS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+void SampleBuffer::resolve( const vector<float>& weights,
+                            unsigned char* target ) const {
+
+  const float scale = 255.0f / SAMPLE_MAX;
+  const uint16_t* p = data.empty() ? NULL : &data[0];
+  for ( size_t i = 0; i < width * height; i++, target += 4 ) {
+
+#ifdef SAMPLE_SSE
+    __m128 sum = _mm_setzero_ps();
+    for ( size_t s = 0; s < samples; s++, p += 4 ) {
+      __m128i v = _mm_unpacklo_epi16( _mm_loadl_epi64( (const __m128i*) p ),
+                                      _mm_setzero_si128() );
+      sum = _mm_add_ps( sum, _mm_mul_ps( _mm_cvtepi32_ps( v ),
+                                         _mm_set1_ps( weights[s] ) ) );
+    }
+    sum = _mm_add_ps( _mm_mul_ps( sum, _mm_set1_ps( scale ) ), _mm_set1_ps( 0.5f ) );
+    sum = _mm_min_ps( _mm_max_ps( sum, _mm_setzero_ps() ), _mm_set1_ps( 255.0f ) );
+    __m128i c = _mm_cvttps_epi32( sum );
+    c = _mm_packs_epi32( c, c );
+    c = _mm_packus_epi16( c, c );
+    int rgba = _mm_cvtsi128_si32( c );
+    memcpy( target, &rgba, 4 );
+#else
+    float sum[4] = { 0, 0, 0, 0 };
+    for ( size_t s = 0; s < samples; s++, p += 4 ) {
+      for ( int c = 0; c < 4; c++ ) sum[c] += weights[s] * p[c];
+    }
+    for ( int c = 0; c < 4; c++ ) {
+      target[c] = (unsigned char) min( sum[c] * scale + 0.5f, 255.0f );
+    }
+#endif
+  }
+}
+
+} // namespace CMU462
@@ -0,0 +1,83 @@
+#ifndef CMU462_SAMPLE_BUFFER_H
+#define CMU462_SAMPLE_BUFFER_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "CMU462.h"
+#include "svg.h"
+
+namespace CMU462 {
+
+/**
+ * Supersample buffer holding premultiplied RGBA samples with 16 bits per
+ * channel, the samples of a pixel are stored next to each other. Colors
+ * passed in are premultiplied and are blended over the samples with
+ * source-over, four samples per AVX2 instruction or two per SSE2
+ * instruction where available.
+ *
+ * A buffer covers the pixels from (x0, y0) on and is addressed with
+ * screen coordinates. Spans address sample s of count consecutive pixels
+ * of a row, they must lie inside the buffer.
+ */
+class SampleBuffer {
+ public:
+
+  SampleBuffer() : x0 ( 0 ), y0 ( 0 ), width ( 0 ), height ( 0 ), samples ( 0 ) { }
+
+  // resizes the buffer to cover the screen from (0, 0) and clears it
+  void resize( size_t width, size_t height, size_t samples );
+
+  // clears all samples to opaque white
+  void clear();
+
+  // moves the buffer to cover the given pixels and clears it to
+  // transparent, for drawing a layer. The storage is kept when the
+  // buffer shrinks so that reused layers do not reallocate
+  void reset( int x0, int y0, size_t width, size_t height, size_t samples );
+
+  // blends one color over a span
+  void blend_span( int x, int y, int s, int count, const Color& color );
+
+  // blends a color per sample over a span
+  void blend_span( int x, int y, int s, int count, const Color* colors );
+
+  // blends a color over all samples of a pixel, each sample scaled by its
+  // coverage. NULL coverage covers all samples
+  void blend_mask( int x, int y, const Color& color,
+                   const float* coverage = NULL );
+
+  // composites a layer inside the buffer over its samples with an operator,
+  // the layer is scaled by opacity first
+  void composite( const SampleBuffer& layer, float opacity, CompositeOp op );
+
+  // whether an operator leaves the samples under the transparent parts of
+  // a layer unchanged, layers composited with other operators must cover
+  // the whole buffer
+  static bool bounded( CompositeOp op );
+
+  // writes the weighted sum of the samples of every pixel as 8 bit RGBA
+  void resolve( const std::vector<float>& weights,
+                unsigned char* target ) const;
+
+  inline bool contains( int x, int y ) const {
+    return x >= x0 && y >= y0 && x < x0 + (int) width && y < y0 + (int) height;
+  }
+
+  inline uint16_t* sample( int x, int y, int s ) {
+    return &data[4 * ( ( ( x - x0 ) + ( y - y0 ) * width ) * samples + s )];
+  }
+
+  int x0, y0;
+  size_t width, height, samples;
+
+ private:
+
+  std::vector<uint16_t> data;
+  std::vector<Color> scratch;
+
+}; // class SampleBuffer
+
+} // namespace CMU462
+
+#endif // CMU462_SAMPLE_BUFFER_H
@@ -2,24 +2,267 @@
 
 #include <cmath>
 #include <vector>
+#include <random>
 #include <iostream>
 #include <algorithm>
 
 #include "triangulation.h"
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define GRADIENT_SSE
+#endif
+
 using namespace std;
 
 namespace CMU462 {
 
 
+// Sample Patterns //
+
+SamplePattern SamplePattern::grid( size_t rate ) {
+
+  SamplePattern pattern;
+  for (size_t j = 0; j < rate; j++) {
+    for (size_t i = 0; i < rate; i++) {
+      pattern.positions.push_back(Vector2D((i + 0.5) / rate, (j + 0.5) / rate));
+      pattern.weights.push_back(1.0f / (rate * rate));
+    }
+  }
+  return pattern;
+}
+
+SamplePattern SamplePattern::sparse( size_t count ) {
+
+  // standard multisample positions in 1/16th of a pixel from the center
+  static const int sparse_2[]  = { 4,4, -4,-4 };
+  static const int sparse_4[]  = { -2,-6, 6,-2, -6,2, 2,6 };
+  static const int sparse_8[]  = { 1,-3, -1,3, 5,1, -3,-5,
+                                   -5,5, -7,-1, 3,7, 7,-7 };
+  static const int sparse_16[] = { 1,1, -1,-3, -3,2, 4,-1,
+                                   -5,-2, 2,5, 5,3, 3,-5,
+                                   -2,6, 0,-7, -4,-6, -6,4,
+                                   -8,0, 7,-4, 6,7, -7,-8 };
+
+  const int* table;
+  switch (count) {
+    case 2:  table = sparse_2;  break;
+    case 4:  table = sparse_4;  break;
+    case 8:  table = sparse_8;  break;
+    case 16: table = sparse_16; break;
+    default: return grid(1);
+  }
+
+  SamplePattern pattern;
+  for (size_t i = 0; i < count; i++) {
+    pattern.positions.push_back(Vector2D(0.5 + table[2 * i]     / 16.0,
+                                         0.5 + table[2 * i + 1] / 16.0));
+    pattern.weights.push_back(1.0f / count);
+  }
+  return pattern;
+}
+
+SamplePattern SamplePattern::jittered( size_t count ) {
+
+  if (count <= 1) return grid(1);
+
+  // one sample per row and per column of a count x count grid
+  std::mt19937 gen(462);
+  std::uniform_real_distribution<double> jitter(0.0, 1.0);
+  vector<size_t> rows(count);
+  for (size_t i = 0; i < count; i++) rows[i] = i;
+  shuffle(rows.begin(), rows.end(), gen);
+
+  SamplePattern pattern;
+  for (size_t i = 0; i < count; i++) {
+    pattern.positions.push_back(Vector2D((i       + jitter(gen)) / count,
+                                         (rows[i] + jitter(gen)) / count));
+    pattern.weights.push_back(1.0f / count);
+  }
+  return pattern;
+}
+
+SamplePattern SamplePattern::create( SamplePatternType type, size_t sample_rate ) {
+
+  // sparse and jittered patterns place every sample on its own row and
+  // column, so half the samples of a rate x rate grid give about the same
+  // edge quality: 2, 4 and 8 samples for rates 2, 3 and 4 against the
+  // grid's 4, 9 and 16
+  size_t count = sample_rate <= 1 ? 1 : (size_t) 1 << (sample_rate - 1);
+
+  switch (type) {
+    case SAMPLE_SPARSE:
+      return sparse(count);
+    case SAMPLE_JITTERED:
+      return jittered(count);
+    case SAMPLE_GRID:
+    default:
+      return grid(sample_rate);
+  }
+}
+
+
+// Gradient Shader //
+
+// color table size, entries are interpolated between
+static const int GRADIENT_TABLE_SIZE = 256;
+
+GradientShader::GradientShader( const Gradient& gradient,
+                                const Matrix3x3& gradient_2_screen,
+                                float opacity )
+  : type( gradient.type ), spread( gradient.spread ) {
+
+  Matrix3x3 m = gradient_2_screen.inv();
+  float m00 = m(0,0), m01 = m(0,1), m02 = m(0,2);
+  float m10 = m(1,0), m11 = m(1,1), m12 = m(1,2);
+
+  if (type == LINEAR_GRADIENT) {
+
+    // project onto the gradient vector
+    Vector2D d = gradient.p1 - gradient.p0;
+    double len2 = d.norm2();
+    if (len2 > 0) d /= len2;
+    ux = d.x * m00 + d.y * m10;
+    uy = d.x * m01 + d.y * m11;
+    uc = d.x * (m02 - gradient.p0.x) + d.y * (m12 - gradient.p0.y);
+    vx = vy = vc = 0;
+
+  } else {
+
+    // offset from the center in units of the radius
+    float r = gradient.r > 0 ? 1.0f / gradient.r : 0;
+    ux = r * m00; uy = r * m01; uc = r * (m02 - gradient.p0.x);
+    vx = r * m10; vy = r * m11; vc = r * (m12 - gradient.p0.y);
+  }
+
+  // bake the stops, colors are interpolated unpremultiplied. The last
+  // entry is repeated so t = 1 can be looked up without clamping
+  const vector<GradientStop>& stops = gradient.stops;
+  table.resize(GRADIENT_TABLE_SIZE + 2);
+  size_t k = 0;
+  for (int i = 0; i <= GRADIENT_TABLE_SIZE; i++) {
+    float t = (float) i / GRADIENT_TABLE_SIZE;
+    while (k < stops.size() && stops[k].offset < t) k++;
+
+    Color c;
+    if (k == 0) {
+      c = stops.front().color;
+    } else if (k == stops.size()) {
+      c = stops.back().color;
+    } else {
+      const GradientStop& s0 = stops[k - 1];
+      const GradientStop& s1 = stops[k];
+      float w = (t - s0.offset) / (s1.offset - s0.offset);
+      c = s0.color * (1 - w) + s1.color * w;
+    }
+
+    float a = c.a * opacity;
+    table[i] = Color(c.r * a, c.g * a, c.b * a, a);
+  }
+  table[GRADIENT_TABLE_SIZE + 1] = table[GRADIENT_TABLE_SIZE];
+}
+
+void GradientShader::shade_span( float x, float y, int count, Color* out ) const {
+
+  // gradient parameters at the span start, stepping by one sample
+  float u = ux * x + uy * y + uc, du = ux;
+  float v = vx * x + vy * y + vc, dv = vx;
+  int i = 0;
+
+#ifdef GRADIENT_SSE
+  const float* colors = &table[0].r;
+  const __m128 size = _mm_set1_ps( (float) GRADIENT_TABLE_SIZE );
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one  = _mm_set1_ps( 1.0f );
+  const __m128 two  = _mm_set1_ps( 2.0f );
+  const __m128 half = _mm_set1_ps( 0.5f );
+  const __m128 lane = _mm_set_ps( 3, 2, 1, 0 );
+  __m128 u4  = _mm_add_ps( _mm_set1_ps( u ), _mm_mul_ps( lane, _mm_set1_ps( du ) ) );
+  __m128 v4  = _mm_add_ps( _mm_set1_ps( v ), _mm_mul_ps( lane, _mm_set1_ps( dv ) ) );
+  __m128 du4 = _mm_set1_ps( 4 * du );
+  __m128 dv4 = _mm_set1_ps( 4 * dv );
+
+  for (; i + 4 <= count; i += 4) {
+
+    __m128 t = u4;
+    if (type == RADIAL_GRADIENT) {
+      t = _mm_sqrt_ps( _mm_add_ps( _mm_mul_ps( u4, u4 ), _mm_mul_ps( v4, v4 ) ) );
+    }
+    u4 = _mm_add_ps( u4, du4 );
+    v4 = _mm_add_ps( v4, dv4 );
+
+    // spread, floor is truncation corrected for negative values
+    if (spread != SPREAD_PAD) {
+      __m128 p = spread == SPREAD_REFLECT ? _mm_mul_ps( t, half ) : t;
+      __m128 f = _mm_cvtepi32_ps( _mm_cvttps_epi32( p ) );
+      f = _mm_sub_ps( f, _mm_and_ps( _mm_cmpgt_ps( f, p ), one ) );
+      t = _mm_sub_ps( p, f );
+      if (spread == SPREAD_REFLECT) {
+        // 1 - |2 * frac - 1|
+        __m128 r = _mm_sub_ps( _mm_mul_ps( t, two ), one );
+        r = _mm_max_ps( r, _mm_sub_ps( zero, r ) );
+        t = _mm_sub_ps( one, r );
+      }
+    }
+    t = _mm_min_ps( _mm_max_ps( t, zero ), one );
+
+    // table lookups, lerp between neighbouring entries
+    __m128 f = _mm_mul_ps( t, size );
+    __m128i idx = _mm_cvttps_epi32( f );
+    __m128 w = _mm_sub_ps( f, _mm_cvtepi32_ps( idx ) );
+
+    int   index [4]; _mm_storeu_si128( (__m128i*) index, idx );
+    float weight[4]; _mm_storeu_ps( weight, w );
+    for (int j = 0; j < 4; j++) {
+      __m128 c0 = _mm_loadu_ps( colors + 4 * index[j] );
+      __m128 c1 = _mm_loadu_ps( colors + 4 * index[j] + 4 );
+      __m128 c  = _mm_add_ps( c0, _mm_mul_ps( _mm_set1_ps( weight[j] ), 
+                                              _mm_sub_ps( c1, c0 ) ) );
+      _mm_storeu_ps( &out[i + j].r, c );
+    }
+  }
+
+  u += i * du;
+  v += i * dv;
+#endif
+
+  // remaining samples
+  for (; i < count; i++, u += du, v += dv) {
+
+    float t = type == RADIAL_GRADIENT ? sqrtf( u * u + v * v ) : u;
+    if (spread == SPREAD_REPEAT) {
+      t = t - floorf( t );
+    } else if (spread == SPREAD_REFLECT) {
+      t = 1 - fabsf( 2 * (t * 0.5f - floorf( t * 0.5f )) - 1 );
+    }
+    t = min( max( t, 0.0f ), 1.0f );
+
+    float f = t * GRADIENT_TABLE_SIZE;
+    int index = min( (int) f, GRADIENT_TABLE_SIZE - 1 );
+    float w = f - index;
+    out[i] = table[index] * (1 - w) + table[index + 1] * w;
+  }
+}
+
+
 // Implements SoftwareRenderer //
 
+// samples are blended premultiplied, style colors and texels are not
+static inline Color premultiply( const Color& c ) {
+  return Color( c.r * c.a, c.g * c.a, c.b * c.a, c.a );
+}
+
 void SoftwareRendererImp::draw_svg( SVG& svg ) {
 
 	// set top level transformation
 	transformation = svg_2_screen;
+	current_svg = &svg;
   // draw all elements
   for ( size_t i = 0; i < svg.elements.size(); ++i ) {
+    if ( cancel && *cancel ) {
+      samples.clear();
+      return;
+    }
     draw_element(svg.elements[i]);
   }
 
@@ -44,12 +287,14 @@ void SoftwareRendererImp::set_sample_rate( size_t sample_rate ) {
   // Task 4: 
   // You may want to modify this for supersampling support
   this->sample_rate = sample_rate;
-  if (this->supersample_target != nullptr)
-  {
-	  delete[] this->supersample_target;
-  }
-  this->supersample_target = new unsigned char[4 * this->target_w * sample_rate * this->target_h * sample_rate];
-  memset(supersample_target, 255, 4 * target_w * target_h * sample_rate * sample_rate);
+  set_sample_pattern(SamplePattern::grid(sample_rate));
+
+}
+
+void SoftwareRendererImp::set_sample_pattern( const SamplePattern& pattern ) {
+
+  this->pattern = pattern;
+  samples.resize( target_w, target_h, pattern.size() );
 
 }
 
@@ -61,20 +306,21 @@ void SoftwareRendererImp::set_render_target( unsigned char* render_target,
 	  this->render_target = render_target;
 	  this->target_w = width;
 	  this->target_h = height;
-	  if (this->supersample_target != nullptr)
-	  {
-		  delete[] this->supersample_target;
-	  }
-	  this->supersample_target = new unsigned char[4 * this->target_w * sample_rate * this->target_h * sample_rate];
-	  memset(supersample_target, 255, 4 * target_w * target_h * sample_rate * sample_rate);
+	  samples.resize( width, height, pattern.size() );
 }
 
 void SoftwareRendererImp::draw_element( SVGElement* element ) {
 
   // Task 5 (part 1):
   // Modify this to implement the transformation stack
+	if (profiler) profiler->enter(element);
 	Matrix3x3 temp_transformation = transformation;
 	transformation = transformation * element->transform;
+	if (draw_lod(element)) {
+		transformation = temp_transformation;
+		if (profiler) profiler->leave();
+		return;
+	}
   switch(element->type) {
     case POINT:
       draw_point(static_cast<Point&>(*element));
@@ -97,13 +343,154 @@ void SoftwareRendererImp::draw_element( SVGElement* element ) {
     case IMAGE:
       draw_image(static_cast<Image&>(*element));
       break;
-    case GROUP:
+    case GROUP: {
+      // elements of a group inherit the styles the group sets instead of
+      // those of the instance
+      int saved_mask = override_mask;
+      override_mask = overrides(*element);
       draw_group(static_cast<Group&>(*element));
+      override_mask = saved_mask;
+      break;
+    }
+    case USE:
+      draw_use(static_cast<Use&>(*element));
+      break;
+    case PATH:
+      draw_path(static_cast<Path&>(*element));
       break;
     default:
       break;
   }
   transformation = temp_transformation;
+  if (profiler) profiler->leave();
+}
+
+bool SoftwareRendererImp::draw_lod( SVGElement* element ) {
+
+  if (lod_threshold <= 0) return false;
+
+  // outline of the element, transformed on the fly so that elements
+  // drawn in full are not transformed twice
+  const Vector2D* points = NULL;
+  size_t n = 0;
+  Vector2D corners[4];
+  bool closed = true;
+  switch(element->type) {
+    case POLYLINE: {
+      Polyline& polyline = static_cast<Polyline&>(*element);
+      points = polyline.points.data();
+      n = polyline.points.size();
+      closed = false;
+      break;
+    }
+    case POLYGON: {
+      Polygon& polygon = static_cast<Polygon&>(*element);
+      points = polygon.points.data();
+      n = polygon.points.size();
+      break;
+    }
+    case PATH: {
+      // the control points bound the curves
+      Path& path = static_cast<Path&>(*element);
+      points = path.points.data();
+      n = path.points.size();
+      break;
+    }
+    case RECT: {
+      Rect& rect = static_cast<Rect&>(*element);
+      Vector2D p = rect.position, d = rect.dimension;
+      corners[0] = p;
+      corners[1] = Vector2D(p.x + d.x, p.y);
+      corners[2] = p + d;
+      corners[3] = Vector2D(p.x, p.y + d.y);
+      points = corners;
+      n = 4;
+      break;
+    }
+    default:
+      return false;
+  }
+  if (n == 0) return true;
+
+  // screen space bounds
+  Vector2D lo = transform(points[0]), hi = lo;
+  for (size_t i = 1; i < n; i++) {
+    Vector2D p = transform(points[i]);
+    lo.x = min(lo.x, p.x); lo.y = min(lo.y, p.y);
+    hi.x = max(hi.x, p.x); hi.y = max(hi.y, p.y);
+  }
+
+  // nothing to draw for elements entirely off screen (lines may touch
+  // the pixel next to them)
+  if (hi.x < -1 || hi.y < -1 || lo.x > target_w + 1 || lo.y > target_h + 1) {
+    return true;
+  }
+
+  if (max(hi.x - lo.x, hi.y - lo.y) >= lod_threshold) return false;
+
+  // sub-pixel element: splat a single pixel with the fill weighted by
+  // the covered area and the stroke weighted by its length
+  float area = 0, length = 0;
+  if (element->type == PATH) {
+
+    // subpaths are filled as if closed but only stroked around if closed
+    Path& path = static_cast<Path&>(*element);
+    Vector2D first, p0;
+    bool open = false;
+    for (size_t i = 0, j = 0; i < path.commands.size(); i++) {
+      switch (path.commands[i]) {
+        case PATH_MOVE:
+          if (open) area += cross(p0, first);
+          first = p0 = transform(points[j++]);
+          open = false;
+          break;
+        case PATH_CLOSE:
+          area += cross(p0, first);
+          length += (first - p0).norm();
+          p0 = first;
+          open = false;
+          break;
+        default: {
+          size_t k = path.commands[i] == PATH_LINE ? 1 : 
+                     path.commands[i] == PATH_QUAD ? 2 : 3;
+          for (; k > 0; k--) {
+            Vector2D p1 = transform(points[j++]);
+            area += cross(p0, p1);
+            length += (p1 - p0).norm();
+            p0 = p1;
+          }
+          open = true;
+          break;
+        }
+      }
+    }
+    if (open) area += cross(p0, first);
+  } else {
+    size_t edges = closed ? n : n - 1;
+    Vector2D first = transform(points[0]), p0 = first;
+    for (size_t i = 0; i < edges; i++) {
+      Vector2D p1 = i + 1 < n ? transform(points[i + 1]) : first;
+      area += cross(p0, p1);
+      length += (p1 - p0).norm();
+      p0 = p1;
+    }
+  }
+  area = fabs(area) / 2;
+
+  int x = (int)floor((lo.x + hi.x) / 2);
+  int y = (int)floor((lo.y + hi.y) / 2);
+
+  Color c = premultiply(fill_color(*element));
+  if (closed && c.a != 0) {
+    fill_pixel(x, y, c * min(area, 1.0f));
+  }
+
+  c = premultiply(stroke_color(*element));
+  if (c.a != 0) {
+    fill_pixel(x, y, c * min(length, 1.0f));
+  }
+
+  return true;
 }
 
 
@@ -112,7 +499,7 @@ void SoftwareRendererImp::draw_element( SVGElement* element ) {
 void SoftwareRendererImp::draw_point( Point& point ) {
 
   Vector2D p = transform(point.position);
-  rasterize_point( p.x, p.y, point.style.fillColor );
+  rasterize_point( p.x, p.y, premultiply(fill_color(point)) );
 
 }
 
@@ -120,20 +507,26 @@ void SoftwareRendererImp::draw_line( Line& line ) {
 
   Vector2D p0 = transform(line.from);
   Vector2D p1 = transform(line.to);
-  rasterize_line( p0.x, p0.y, p1.x, p1.y, line.style.strokeColor );
+  rasterize_line( p0.x, p0.y, p1.x, p1.y, stroke_color(line) );
 
 }
 
 void SoftwareRendererImp::draw_polyline( Polyline& polyline ) {
 
-  Color c = polyline.style.strokeColor;
+  Color c = stroke_color(polyline);
 
-  if( c.a != 0 ) {
+  if( c.a != 0 && polyline.points.size() > 1 ) {
+
+    // decimate: skip vertices closer than the LOD tolerance to the last
+    // vertex drawn, the last vertex is always kept
+    float tolerance2 = lod_tolerance * lod_tolerance;
     int nPoints = polyline.points.size();
-    for( int i = 0; i < nPoints - 1; i++ ) {
-      Vector2D p0 = transform(polyline.points[(i+0) % nPoints]);
-      Vector2D p1 = transform(polyline.points[(i+1) % nPoints]);
+    Vector2D p0 = transform(polyline.points[0]);
+    for( int i = 1; i < nPoints; i++ ) {
+      Vector2D p1 = transform(polyline.points[i]);
+      if( i < nPoints - 1 && (p1 - p0).norm2() < tolerance2 ) continue;
       rasterize_line( p0.x, p0.y, p1.x, p1.y, c );
+      p0 = p1;
     }
   }
 }
@@ -154,14 +547,16 @@ void SoftwareRendererImp::draw_rect( Rect& rect ) {
   Vector2D p3 = transform(Vector2D( x + w , y + h ));
   
   // draw fill
-  c = rect.style.fillColor;
+  c = fill_color(rect);
   if (c.a != 0 ) {
-    rasterize_triangle( p0.x, p0.y, p1.x, p1.y, p2.x, p2.y, c );
-    rasterize_triangle( p2.x, p2.y, p1.x, p1.y, p3.x, p3.y, c );
+    const GradientShader* s = fill_shader( &rect, rect.position,
+                                           rect.position + rect.dimension );
+    rasterize_triangle( p0.x, p0.y, p1.x, p1.y, p2.x, p2.y, c, s );
+    rasterize_triangle( p2.x, p2.y, p1.x, p1.y, p3.x, p3.y, c, s );
   }
 
   // draw outline
-  c = rect.style.strokeColor;
+  c = stroke_color(rect);
   if( c.a != 0 ) {
     rasterize_line( p0.x, p0.y, p1.x, p1.y, c );
     rasterize_line( p1.x, p1.y, p3.x, p3.y, c );
@@ -177,24 +572,33 @@ void SoftwareRendererImp::draw_polygon( Polygon& polygon ) {
 
   // draw fill
   
-	c = polygon.style.fillColor;
+	c = fill_color(polygon);
   if( c.a != 0 ) {
 
-    // triangulate
-    vector<Vector2D> triangles;
-    triangulate( polygon, triangles );
+    const vector<Vector2D>& triangles = polygon.triangles;
+
+    // gradient fills span the bounds of the polygon
+    const GradientShader* s = nullptr;
+    if (!triangles.empty()) {
+      Vector2D lo = polygon.points[0], hi = polygon.points[0];
+      for (size_t i = 1; i < polygon.points.size(); i++) {
+        lo.x = min(lo.x, polygon.points[i].x); lo.y = min(lo.y, polygon.points[i].y);
+        hi.x = max(hi.x, polygon.points[i].x); hi.y = max(hi.y, polygon.points[i].y);
+      }
+      s = fill_shader( &polygon, lo, hi );
+    }
 
     // draw as triangles
     for (size_t i = 0; i < triangles.size(); i += 3) {
       Vector2D p0 = transform(triangles[i + 0]);
       Vector2D p1 = transform(triangles[i + 1]);
       Vector2D p2 = transform(triangles[i + 2]);
-      rasterize_triangle( p0.x, p0.y, p1.x, p1.y, p2.x, p2.y, c );
+      rasterize_triangle( p0.x, p0.y, p1.x, p1.y, p2.x, p2.y, c, s );
     }
   }
 
   // draw outline
-  c = polygon.style.strokeColor;
+  c = stroke_color(polygon);
   if( c.a != 0 ) {
     int nPoints = polygon.points.size();
     for( int i = 0; i < nPoints; i++ ) {
@@ -216,15 +620,235 @@ void SoftwareRendererImp::draw_image( Image& image ) {
   Vector2D p0 = transform(image.position);
   Vector2D p1 = transform(image.position + image.dimension);
 
-  rasterize_image( p0.x, p0.y, p1.x, p1.y, image.tex );
+  rasterize_image( p0.x, p0.y, p1.x, p1.y, image.texture() );
+}
+
+// extends lo and hi by the screen space points of an element, whose
+// parent is drawn with transformation m
+static void screen_bounds( const SVGElement* element, const Matrix3x3& m,
+                           Vector2D& lo, Vector2D& hi ) {
+
+  if (!element) return;
+  Matrix3x3 t = m * element->transform;
+  auto add = [&](Vector2D p) {
+    Vector3D u = t * Vector3D(p.x, p.y, 1);
+    p = Vector2D(u.x / u.z, u.y / u.z);
+    lo.x = min(lo.x, p.x); lo.y = min(lo.y, p.y);
+    hi.x = max(hi.x, p.x); hi.y = max(hi.y, p.y);
+  };
+  auto add_box = [&](Vector2D p, Vector2D d) {
+    add(p); add(p + d);
+    add(Vector2D(p.x + d.x, p.y)); add(Vector2D(p.x, p.y + d.y));
+  };
+
+  switch(element->type) {
+    case POINT:
+      add(static_cast<const Point*>(element)->position);
+      break;
+    case LINE:
+      add(static_cast<const Line*>(element)->from);
+      add(static_cast<const Line*>(element)->to);
+      break;
+    case POLYLINE: {
+      const vector<Vector2D>& points = static_cast<const Polyline*>(element)->points;
+      for (size_t i = 0; i < points.size(); i++) add(points[i]);
+      break;
+    }
+    case POLYGON: {
+      const vector<Vector2D>& points = static_cast<const Polygon*>(element)->points;
+      for (size_t i = 0; i < points.size(); i++) add(points[i]);
+      break;
+    }
+    case PATH: {
+      // the control points bound the curves
+      const vector<Vector2D>& points = static_cast<const Path*>(element)->points;
+      for (size_t i = 0; i < points.size(); i++) add(points[i]);
+      break;
+    }
+    case RECT: {
+      const Rect* rect = static_cast<const Rect*>(element);
+      add_box(rect->position, rect->dimension);
+      break;
+    }
+    case ELLIPSE: {
+      const Ellipse* ellipse = static_cast<const Ellipse*>(element);
+      add_box(ellipse->center - ellipse->radius, ellipse->radius * 2);
+      break;
+    }
+    case IMAGE: {
+      const Image* image = static_cast<const Image*>(element);
+      add_box(image->position, image->dimension);
+      break;
+    }
+    case GROUP: {
+      const vector<SVGElement*>& elements = static_cast<const Group*>(element)->elements;
+      for (size_t i = 0; i < elements.size(); i++) screen_bounds(elements[i], t, lo, hi);
+      break;
+    }
+    case USE:
+      screen_bounds(static_cast<const Use*>(element)->symbol, t, lo, hi);
+      break;
+    default:
+      break;
+  }
 }
 
 void SoftwareRendererImp::draw_group( Group& group ) {
 
+  // opaque source-over groups are drawn in place
+  if (group.opacity >= 1 && group.comp_op == COMP_SRC_OVER) {
+    for ( size_t i = 0; i < group.elements.size(); ++i ) {
+      draw_element(group.elements[i]);
+    }
+    return;
+  }
+
+  // The layer covers the group rounded out to tiles, operators that also
+  // change what is outside the group need the whole parent layer
+  int x0 = layer->x0, y0 = layer->y0;
+  int x1 = x0 + (int)layer->width, y1 = y0 + (int)layer->height;
+  if (SampleBuffer::bounded(group.comp_op)) {
+    if (group.opacity <= 0) return;
+
+    Vector2D lo(INFINITY, INFINITY), hi(-INFINITY, -INFINITY);
+    for (size_t i = 0; i < group.elements.size(); i++) {
+      screen_bounds(group.elements[i], transformation, lo, hi);
+    }
+    if (lo.x > hi.x) return;
+
+    // antialiased lines reach into the pixels next to their ends
+    const float tile = 16;
+    auto clamp = [](float v, int a, int b) {
+      return (int)min(max(v, (float)a), (float)b);
+    };
+    int tx0 = clamp(floorf((lo.x - 2) / tile) * tile, x0, x1);
+    int ty0 = clamp(floorf((lo.y - 2) / tile) * tile, y0, y1);
+    x1 = clamp(ceilf((hi.x + 2) / tile) * tile, x0, x1);
+    y1 = clamp(ceilf((hi.y + 2) / tile) * tile, y0, y1);
+    x0 = tx0; y0 = ty0;
+    if (x0 >= x1 || y0 >= y1) return;
+  }
+
+  // draw the group into the layer of its depth, then composite it
+  if (layers.size() <= layer_depth) layers.emplace_back(new SampleBuffer());
+  SampleBuffer* parent = layer;
+  layer = layers[layer_depth++].get();
+  layer->reset(x0, y0, x1 - x0, y1 - y0, pattern.size());
+
   for ( size_t i = 0; i < group.elements.size(); ++i ) {
     draw_element(group.elements[i]);
   }
 
+  parent->composite(*layer, group.opacity, group.comp_op);
+  if (profiler) {
+    for (int y = y0; y < y1; y++) profiler->span(x0, y, x1 - x0, pattern.size());
+  }
+  layer = parent;
+  layer_depth--;
+}
+
+void SoftwareRendererImp::draw_path( Path& path ) {
+
+  Path::Flattening& f = path.flatten(transformation);
+  if (f.subpaths.empty()) return;
+
+  // draw fill, every subpath is closed and all are filled at once so that
+  // inner outlines cut holes by the fill rule
+  Color c = fill_color(path);
+  if( c.a != 0 ) {
+
+    const GradientShader* s = nullptr;
+    if (current_svg && current_svg->fill_gradients.size()) {
+      Vector2D lo = f.subpaths[0].points[0], hi = lo;
+      for (size_t i = 0; i < f.subpaths.size(); i++) {
+        const vector<Vector2D>& points = f.subpaths[i].points;
+        for (size_t j = 0; j < points.size(); j++) {
+          lo.x = min(lo.x, points[j].x); lo.y = min(lo.y, points[j].y);
+          hi.x = max(hi.x, points[j].x); hi.y = max(hi.y, points[j].y);
+        }
+      }
+      s = fill_shader( &path, lo, hi );
+    }
+
+    path_edges.clear();
+    for (size_t i = 0; i < f.subpaths.size(); i++) {
+      const vector<Vector2D>& points = f.subpaths[i].points;
+      if (points.size() < 3) continue;
+      Vector2D first = transform(points[0]), p0 = first;
+      for (size_t j = 1; j <= points.size(); j++) {
+        Vector2D p1 = j < points.size() ? transform(points[j]) : first;
+        path_edges.push_back(p0);
+        path_edges.push_back(p1);
+        p0 = p1;
+      }
+    }
+    rasterize_path( path_edges, path.evenodd, c, s );
+  }
+
+  // draw outline
+  c = stroke_color(path);
+  if( c.a != 0 ) {
+    for (size_t i = 0; i < f.subpaths.size(); i++) {
+      const vector<Vector2D>& points = f.subpaths[i].points;
+      int nPoints = points.size();
+      int nEdges = f.closed[i] ? nPoints : nPoints - 1;
+      for( int j = 0; j < nEdges; j++ ) {
+        Vector2D p0 = transform(points[(j+0) % nPoints]);
+        Vector2D p1 = transform(points[(j+1) % nPoints]);
+        rasterize_line( p0.x, p0.y, p1.x, p1.y, c );
+      }
+    }
+  }
+}
+
+void SoftwareRendererImp::draw_use( Use& use ) {
+
+  // unresolved reference
+  if (!use.symbol) return;
+
+  // styles of nested instances take precedence over outer ones
+  Style saved_style = override_style;
+  int saved_mask = override_mask;
+  SVGElement* saved_fill = override_fill;
+
+  if (use.overrides & OVERRIDE_FILL) {
+    override_style.fillColor = use.style.fillColor;
+    override_fill = &use;
+  }
+  if (use.overrides & OVERRIDE_STROKE) {
+    override_style.strokeColor = use.style.strokeColor;
+  }
+  override_mask |= use.overrides;
+
+  draw_element(use.symbol);
+
+  override_style = saved_style;
+  override_mask = saved_mask;
+  override_fill = saved_fill;
+}
+
+const GradientShader* SoftwareRendererImp::fill_shader( SVGElement* element,
+                                                       Vector2D lo, Vector2D hi ) {
+
+  if (!current_svg) return nullptr;
+  if (overrides(*element) & OVERRIDE_FILL) element = override_fill;
+  map<const SVGElement*, const Gradient*>::const_iterator it;
+  it = current_svg->fill_gradients.find(element);
+  if (it == current_svg->fill_gradients.end()) return nullptr;
+  const Gradient& gradient = *it->second;
+
+  // objectBoundingBox units map the unit square to the element bounds
+  Matrix3x3 bbox = Matrix3x3::identity();
+  if (!gradient.userSpace) {
+    bbox(0,0) = hi.x - lo.x; bbox(0,2) = lo.x;
+    bbox(1,1) = hi.y - lo.y; bbox(1,2) = lo.y;
+  }
+
+  Matrix3x3 gradient_2_screen = transformation * bbox * gradient.transform;
+  if (gradient_2_screen.det() == 0) return nullptr;
+
+  shader = GradientShader(gradient, gradient_2_screen, fill_color(*element).a);
+  return &shader;
 }
 
 // Rasterization //
@@ -235,25 +859,17 @@ void SoftwareRendererImp::draw_group( Group& group ) {
 void SoftwareRendererImp::rasterize_point( float x, float y, Color color ) {
 
 	// fill in the nearest pixel
-	int sx = (int)floor(x * sample_rate);
-	int sy = (int)floor(y * sample_rate);
-	int width = target_w * sample_rate;
-	int height = target_h * sample_rate;
-	if (color.r==1&& color.g == 1&& color.b == 1)
-	{
-		cout << color.a << endl;
-	}
+	fill_pixel((int)floor(x), (int)floor(y), color);
+
+}
+
+void SoftwareRendererImp::fill_pixel( int x, int y, const Color& color ) {
+
 	// check bounds
-	if ( sx < 0 || sx >= width) return;
-	if ( sy < 0 || sy >= height) return;
-	float Er = color.r, Eg = color.g, Eb = color.b, Ea = color.a;
-	float Cr = supersample_target[4 * (sx + sy * width)] / 255.0f, Cg = supersample_target[4 * (sx + sy * width) + 1] / 255.0f, Cb = supersample_target[4 * (sx + sy * width) + 2] / 255.0f, Ca = supersample_target[4 * (sx + sy * width) + 3] / 255.0f;
+	if (!layer->contains(x, y)) return;
+	if (profiler) profiler->span(x, y, 1, pattern.size());
 
-	// fill sample - NOT doing alpha blending!
-	supersample_target[4 * (sx + sy * width)] = (uint8_t)(min(((1 - Ea) * Cr + Er) ,1.0f) * 255);
-	supersample_target[4 * (sx + sy * width) + 1] = (uint8_t)(min(((1 - Ea) * Cg + Eg),1.0f) * 255);
-	supersample_target[4 * (sx + sy * width) + 2] = (uint8_t)(min(((1 - Ea) * Cb + Eb),1.0f) *255);
-	supersample_target[4 * (sx + sy * width) + 3] = (uint8_t)(min(((1 - Ea) * Ca + Ea) ,1.0f) * 255);
+	layer->blend_mask(x, y, color);
 
 }
 
@@ -278,6 +894,7 @@ void SoftwareRendererImp::rasterize_line( float x0, float y0,
 
   // Task 2: 
   // Implement line rasterization
+	color = premultiply(color);
 	bool steep = abs(y1 - y0) > abs(x1 - x0);
 
 	if (steep)
@@ -435,10 +1052,12 @@ void SoftwareRendererImp::rasterize_line( float x0, float y0,
 void SoftwareRendererImp::rasterize_triangle( float x0, float y0,
                                               float x1, float y1,
                                               float x2, float y2,
-                                              Color color ) {
+                                              Color color,
+                                              const GradientShader* shader ) {
   // Task 3: 
   // Implement triangle rasterization
-	bool flag = true;
+	if (profiler) profiler->triangle();
+	color = premultiply(color);
 	float left = min(min(x0,x1),x2);
 	float right = max(max(x0, x1), x2);
 	float bottom = min(min(y0, y1), y2);
@@ -448,54 +1067,180 @@ void SoftwareRendererImp::rasterize_triangle( float x0, float y0,
 		A1 = y2 - y1, B1 = x1 - x2, C1 = y1 * (x2 - x1) - x1 * (y2 - y1),
 		A2 = y0 - y2, B2 = x2 - x0, C2 = y2 * (x0 - x2) - x2 * (y0 - y2);
 
-	float interval = 1 / (float)sample_rate;
-	for (float x = (float)floor(left)+ interval/2; x <= right; x+= interval)
+	// pixels covered by the bounding box, clipped to the layer
+	int px0 = max((int)floor(left), layer->x0);
+	int px1 = min((int)floor(right), layer->x0 + (int)layer->width - 1);
+	int py0 = max((int)floor(bottom), layer->y0);
+	int py1 = min((int)floor(top), layer->y0 + (int)layer->height - 1);
+
+	// sample (x, y) is inside, samples exactly on an edge belong to the
+	// triangle for top and left edges only
+	auto inside = [&](float x, float y) {
+		float E0 = A0 * x + B0 * y + C0;
+		float E1 = A1 * x + B1 * y + C1;
+		float E2 = A2 * x + B2 * y + C2;
+
+		if ((E0 < 0 && E1 < 0 && E2 < 0)|| (E0 > 0 && E1 > 0 && E2 > 0))
+			return true;
+		if (E0 == 0 && ((y0 == y1 && y0== top)|| x0 == left || x1 == left))
+			return true;
+		if (E1 == 0 && ((y1 == y2 && y1 == top) || x1 == left || x2 == left))
+			return true;
+		if (E2 == 0 && ((y2 == y0 && y2 == top) || x2 == left || x0 == left))
+			return true;
+		return false;
+	};
+
+	// the covered samples of a row form a single span, shade it at once
+	for (int py = py0; py <= py1; py++)
 	{
-		for (float y = (float)floor(bottom) + interval/2; y <= top; y+= interval)
+		for (size_t s = 0; s < pattern.size(); s++)
 		{
-			float E0 = A0 * x + B0 * y + C0;
-			float E1 = A1 * x + B1 * y + C1;
-			float E2 = A2 * x + B2 * y + C2;
+			float sx = pattern.positions[s].x;
+			float y = py + pattern.positions[s].y;
 
-			if ((E0 < 0 && E1 < 0 && E2 < 0)|| (E0 > 0 && E1 > 0 && E2 > 0))
-			{
-				rasterize_point(x, y, color);
-			}
-			else if (E0 == 0 && ((y0 == y1 && y0== top)|| x0 == left || x1 == left))
-			{
-				rasterize_point(x, y, color);
-			}
-			else if (E1 == 0 && ((y1 == y2 && y1 == top) || x1 == left || x2 == left))
+			int start = px0;
+			while (start <= px1 && !inside(start + sx, y)) start++;
+			int end = start;
+			while (end <= px1 && inside(end + sx, y)) end++;
+			if (start == end) continue;
+			if (profiler) profiler->span(start, py, end - start);
+
+			if (shader)
 			{
-				rasterize_point(x, y, color);
+				if (span.size() < (size_t)(end - start)) span.resize(end - start);
+				shader->shade_span(start + sx, y, end - start, &span[0]);
+				layer->blend_span(start, py, s, end - start, &span[0]);
 			}
-			else if (E2 == 0 && ((y2 == y0 && y2 == top) || x2 == left || x0 == left))
+			else
 			{
-				rasterize_point(x, y, color);
+				layer->blend_span(start, py, s, end - start, color);
 			}
 		}
 	}
 	
 }
 
+void SoftwareRendererImp::rasterize_path( const vector<Vector2D>& edges,
+                                          bool evenodd, Color color,
+                                          const GradientShader* shader ) {
+
+  size_t n = edges.size() / 2;
+  if (n == 0) return;
+  color = premultiply(color);
+
+  // edges sorted by their top, each row only looks at the edges it spans
+  double top = edges[0].y, bottom = top;
+  edge_order.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    edge_order[i] = i;
+    top = min(top, min(edges[2 * i].y, edges[2 * i + 1].y));
+    bottom = max(bottom, max(edges[2 * i].y, edges[2 * i + 1].y));
+  }
+  sort(edge_order.begin(), edge_order.end(), [&](size_t a, size_t b) {
+    return min(edges[2 * a].y, edges[2 * a + 1].y) < 
+           min(edges[2 * b].y, edges[2 * b + 1].y);
+  });
+
+  int px0 = layer->x0, px1 = layer->x0 + (int)layer->width;
+  int py0 = max((int)floor(top), layer->y0);
+  int py1 = min((int)floor(bottom), layer->y0 + (int)layer->height - 1);
+
+  active_edges.clear();
+  size_t next = 0;
+  for (int py = py0; py <= py1; py++) {
+
+    // edges crossing the row
+    while (next < n && min(edges[2 * edge_order[next]].y, 
+                           edges[2 * edge_order[next] + 1].y) < py + 1) {
+      active_edges.push_back(edge_order[next++]);
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < active_edges.size(); i++) {
+      size_t e = active_edges[i];
+      if (max(edges[2 * e].y, edges[2 * e + 1].y) > py) active_edges[kept++] = e;
+    }
+    active_edges.resize(kept);
+
+    for (size_t s = 0; s < pattern.size(); s++) {
+      float sx = pattern.positions[s].x;
+      float y = py + pattern.positions[s].y;
+
+      // crossings of the sample row, edges own their top end point only,
+      // and wind up or down
+      crossings.clear();
+      for (size_t i = 0; i < active_edges.size(); i++) {
+        const Vector2D& a = edges[2 * active_edges[i]];
+        const Vector2D& b = edges[2 * active_edges[i] + 1];
+        if (y < min(a.y, b.y) || y >= max(a.y, b.y)) continue;
+        float x = a.x + (y - a.y) * (b.x - a.x) / (b.y - a.y);
+        crossings.push_back(make_pair(x, b.y > a.y ? 1 : -1));
+      }
+      sort(crossings.begin(), crossings.end());
+
+      // samples between a crossing and the next are inside if the
+      // winding number there passes the fill rule
+      int winding = 0;
+      for (size_t i = 0; i + 1 < crossings.size(); i++) {
+        winding += crossings[i].second;
+        if (evenodd ? !(winding & 1) : winding == 0) continue;
+
+        int start = max((int)ceil(crossings[i].first - sx), px0);
+        int end = min((int)ceil(crossings[i + 1].first - sx), px1);
+        if (start >= end) continue;
+        if (profiler) profiler->span(start, py, end - start);
+
+        if (shader) {
+          if (span.size() < (size_t)(end - start)) span.resize(end - start);
+          shader->shade_span(start + sx, y, end - start, &span[0]);
+          layer->blend_span(start, py, s, end - start, &span[0]);
+        } else {
+          layer->blend_span(start, py, s, end - start, color);
+        }
+      }
+    }
+  }
+}
+
 void SoftwareRendererImp::rasterize_image( float x0, float y0,
                                            float x1, float y1,
                                            Texture& tex ) {
   // Task 6: 
   // Implement image rasterization
 	Sampler2DImp sampler(BILINEAR);
-	float interval = 1 / (float)sample_rate;
+	float interval = 1 / sqrtf((float)pattern.size());
 	float dx = x1 - x0, dy = y1 - y0;
+	float u_scale = (interval / dx);
+	float v_scale = (interval / dy);
+
+	int px0 = max((int)floor(x0), layer->x0);
+	int px1 = min((int)floor(x1), layer->x0 + (int)layer->width - 1);
+	int py0 = max((int)floor(y0), layer->y0);
+	int py1 = min((int)floor(y1), layer->y0 + (int)layer->height - 1);
 
-	for (float x = (float)floor(x0) + interval / 2; x <= x1; x += interval)
+	// the samples of a row inside the image form a span, sample s of
+	// pixel px is inside for x0 <= px + sx <= x1
+	for (int py = py0; py <= py1; py++)
 	{
-		for (float y = (float)floor(y0) + interval / 2; y <= y1; y += interval)
+		for (size_t s = 0; s < pattern.size(); s++)
 		{
-			float u_scale = (interval / dx);
-			float v_scale = (interval / dy);
-			//Color color(sampler.sample_bilinear(tex, (x - x0) / dx, (y - y0) / dy, 0));
-			Color color(sampler.sample_trilinear(tex, (x - x0) / dx, (y - y0) / dy, u_scale, v_scale));
-			rasterize_point(x, y, color);
+			float sx = pattern.positions[s].x;
+			float y = py + pattern.positions[s].y;
+			if (y < y0 || y > y1) continue;
+
+			int start = max((int)ceil(x0 - sx), px0);
+			int end = min((int)floor(x1 - sx), px1) + 1;
+			if (start >= end) continue;
+			if (profiler) profiler->span(start, py, end - start);
+
+			if (span.size() < (size_t)(end - start)) span.resize(end - start);
+			for (int px = start; px < end; px++)
+			{
+				float x = px + sx;
+				//Color color(sampler.sample_bilinear(tex, (x - x0) / dx, (y - y0) / dy, 0));
+				span[px - start] = premultiply(sampler.sample_trilinear(tex, (x - x0) / dx, (y - y0) / dy, u_scale, v_scale));
+			}
+			layer->blend_span(start, py, s, end - start, &span[0]);
 		}
 	}
 }
@@ -506,32 +1251,9 @@ void SoftwareRendererImp::resolve( void ) {
   // Task 4: 
   // Implement supersampling
   // You may also need to modify other functions marked with "Task 4".
-	int supersample_rate_square = sample_rate * sample_rate;
-
-	for (int sx = 0; sx < target_w; sx++)
-	{
-		for (int sy = 0; sy < target_h; sy++)
-		{
-			unsigned int temp_r = 0, temp_g = 0, temp_b = 0, temp_a = 0;
-			for (int i = 0; i < sample_rate; i++)
-			{
-				for (int j = 0; j < sample_rate; j++)
-				{
-					unsigned int pos = 4 * (sx * sample_rate + i + (sy * sample_rate + j) * target_w * sample_rate);
-					temp_r += supersample_target[pos];
-					temp_g += supersample_target[pos + 1];
-					temp_b += supersample_target[pos + 2];
-					temp_a += supersample_target[pos + 3];
-				}
-			}
-			render_target[4 * (sx + sy * target_w)] = (uint8_t)(temp_r / supersample_rate_square);
-			render_target[4 * (sx + sy * target_w) + 1] = (uint8_t)(temp_g / supersample_rate_square);
-			render_target[4 * (sx + sy * target_w) + 2] = (uint8_t)(temp_b / supersample_rate_square);
-			render_target[4 * (sx + sy * target_w) + 3] = (uint8_t)(temp_a / supersample_rate_square);
-		}
-	}
-	memset(supersample_target, 255, 4 * target_w * target_h * supersample_rate_square);
-	return;
+	// weighted sum of the samples of each pixel
+	samples.resolve(pattern.weights, render_target);
+	samples.clear();
 
 }
 
@@ -2,14 +2,87 @@
 #define CMU462_SOFTWARE_RENDERER_H
 
 #include <stdio.h>
+#include <atomic>
+#include <memory>
 #include <vector>
 
 #include "CMU462.h"
 #include "texture.h"
 #include "svg_renderer.h"
+#include "render_profiler.h"
+#include "sample_buffer.h"
 
 namespace CMU462 { // CMU462
 
+/**
+ * Layouts of the per-pixel sample positions used for supersampling.
+ */
+typedef enum e_SamplePatternType {
+  SAMPLE_GRID,     // regular sample_rate x sample_rate grid
+  SAMPLE_SPARSE,   // standard sparse (rotated grid) 1/2/4/8/16x positions
+  SAMPLE_JITTERED  // n-rooks jittered positions
+} SamplePatternType;
+
+/**
+ * A table of sample positions inside a pixel. Positions are offsets in
+ * the unit pixel square (0.5, 0.5 is the pixel center) and weights are
+ * the resolve filter weights of each sample, they sum up to one.
+ */
+struct SamplePattern {
+
+  std::vector<Vector2D> positions;
+  std::vector<float> weights;
+
+  inline size_t size() const { return positions.size(); }
+
+  // regular rate x rate grid (rate * rate samples)
+  static SamplePattern grid( size_t rate );
+
+  // standard sparse positions, count must be 1, 2, 4, 8 or 16
+  static SamplePattern sparse( size_t count );
+
+  // n-rooks jittered positions (fixed seed so frames are stable)
+  static SamplePattern jittered( size_t count );
+
+  // pattern of the given type with the quality of a rate x rate grid
+  static SamplePattern create( SamplePatternType type, size_t sample_rate );
+
+};
+
+/**
+ * Evaluates a gradient paint for runs of samples along a scanline. The
+ * gradient is baked into a color table once per element, spans then step
+ * the gradient parameter incrementally and look up colors (4 samples at a 
+ * time where SSE2 is available). Colors are premultiplied by alpha.
+ */
+class GradientShader {
+ public:
+
+  GradientShader() : type( LINEAR_GRADIENT ), spread( SPREAD_PAD ) { }
+
+  // gradient_2_screen maps gradient space (after gradientTransform and
+  // the bounding box mapping) to screen space, opacity scales all stops
+  GradientShader( const Gradient& gradient,
+                  const Matrix3x3& gradient_2_screen, float opacity );
+
+  // shade count samples at (x, y), (x + 1, y), ... into out
+  void shade_span( float x, float y, int count, Color* out ) const;
+
+ private:
+
+  GradientType type;
+  GradientSpread spread;
+
+  // screen position to gradient parameter: linear gradients use
+  // t = u, radial gradients t = |(u, v)|, with u and v affine in x, y
+  float ux, uy, uc;
+  float vx, vy, vc;
+
+  // colors at t = i / (table size - 1)
+  std::vector<Color> table;
+
+}; // class GradientShader
+
 class SoftwareRenderer : public SVGRenderer {
  public:
 
@@ -66,22 +139,137 @@ class SoftwareRenderer : public SVGRenderer {
 class SoftwareRendererImp : public SoftwareRenderer {
  public:
 
-	 SoftwareRendererImp() : SoftwareRenderer() { supersample_target = nullptr; }
+	 SoftwareRendererImp() : SoftwareRenderer(), pattern( SamplePattern::grid(1) ),
+	   lod_threshold( 1.0f ), lod_tolerance( 0.5f ), current_svg( nullptr ),
+	   override_mask( 0 ), override_fill( nullptr ), cancel( nullptr ), profiler( nullptr ),
+	   layer( &samples ), layer_depth( 0 ) { }
 
   // draw an svg input to render target
   void draw_svg( SVG& svg );
 
-  // set sample rate
+  // set sample rate (uses a regular grid sample pattern)
   void set_sample_rate( size_t sample_rate );
+
+  // set per-pixel sample positions
+  void set_sample_pattern( const SamplePattern& pattern );
+
+  // get per-pixel sample positions
+  inline const SamplePattern& get_sample_pattern() const {
+    return pattern;
+  }
   
   // set render target
   void set_render_target( unsigned char* target_buffer,
                           size_t width, size_t height );
 
+  // Set level of detail: elements with screen bounds smaller than 
+  // threshold pixels are drawn as a single splat, and polylines are
+  // decimated to tolerance pixels. A threshold of 0 disables LOD.
+  inline void set_lod( float threshold, float tolerance ) {
+    lod_threshold = threshold;
+    lod_tolerance = tolerance;
+  }
+
+  inline float get_lod_threshold() const {
+    return lod_threshold;
+  }
+
+  inline float get_lod_tolerance() const {
+    return lod_tolerance;
+  }
+
+  // Set a flag that abandons the frame being drawn once it is raised,
+  // the render target is then left as it was. NULL never cancels.
+  inline void set_cancel_flag( const std::atomic<bool>* flag ) {
+    cancel = flag;
+  }
+
+  // Set a profiler that records the cost of every element drawn, NULL
+  // draws without profiling
+  inline void set_profiler( RenderProfiler* profiler ) {
+    this->profiler = profiler;
+  }
+
  private:
 
+  // Sample buffer, premultiplied //
+  SampleBuffer samples;
+
+  // Sample positions within a pixel
+  SamplePattern pattern;
+
+  // Level of detail //
+  float lod_threshold;
+  float lod_tolerance;
+
+  // Draws an element that is off screen or below the LOD threshold,
+  // returns false if the element needs to be drawn in full
+  bool draw_lod( SVGElement* element );
+
+  // Paint servers //
+
+  // svg being drawn, holds the gradient of each element
+  SVG* current_svg;
+
+  // shader of the element being filled and its span colors
+  GradientShader shader;
+  std::vector<Color> span;
+
+  // path fill storage, kept from path to path
+  std::vector<Vector2D> path_edges;
+  std::vector<size_t> edge_order, active_edges;
+  std::vector< std::pair<float, int> > crossings;
+
+  // Sets up the gradient shader for an element filled with a gradient,
+  // lo and hi are its bounds in element space. Returns NULL for flat fills
+  const GradientShader* fill_shader( SVGElement* element,
+                                     Vector2D lo, Vector2D hi );
+
+  // Instancing //
+
+  // styles set by the <use> instances being drawn (StyleOverride flags),
+  // and the instance whose fill is used
+  Style override_style;
+  int override_mask;
+  SVGElement* override_fill;
+
+  // cancellation flag of the frame being drawn
+  const std::atomic<bool>* cancel;
+
+  // profiler of the frame being drawn, if any
+  RenderProfiler* profiler;
+
+  // Group compositing //
+
+  // buffer being drawn into, the sample buffer or the layer of a group
+  SampleBuffer* layer;
+
+  // layers of the groups being drawn, one per nesting depth. They are
+  // kept from frame to frame so that groups reuse their storage
+  std::vector< std::unique_ptr<SampleBuffer> > layers;
+  size_t layer_depth;
+
+  // StyleOverride flags of the instance styles that apply to an element,
+  // those it does not set itself
+  inline int overrides( const SVGElement& element ) const {
+    if (!override_mask || !current_svg) return override_mask;
+    std::map<const SVGElement*, int>::const_iterator it;
+    it = current_svg->symbol_styles.find(&element);
+    return it == current_svg->symbol_styles.end() ? override_mask 
+                                                  : override_mask & ~it->second;
+  }
+
+  // fill and stroke color of an element, after instance overrides
+  inline const Color& fill_color( const SVGElement& element ) const {
+    return overrides(element) & OVERRIDE_FILL ? override_style.fillColor 
+                                              : element.style.fillColor;
+  }
+  inline const Color& stroke_color( const SVGElement& element ) const {
+    return overrides(element) & OVERRIDE_STROKE ? override_style.strokeColor 
+                                                : element.style.strokeColor;
+  }
+
   // Primitive Drawing //
-	 unsigned char* supersample_target;
 
   // Draws an SVG element
   void draw_element( SVGElement* element );
@@ -110,6 +298,12 @@ class SoftwareRendererImp : public SoftwareRenderer {
   // Draw a group
   void draw_group( Group& group );
 
+  // Draw an instance of a shared element
+  void draw_use( Use& use );
+
+  // Draw a path
+  void draw_path( Path& path );
+
   // Rasterization //
 
   // rasterize a point
@@ -120,11 +314,18 @@ class SoftwareRendererImp : public SoftwareRenderer {
                        float x1, float y1,
                        Color color);
 
-  // rasterize a triangle
+  // rasterize a triangle, filled by the shader if one is given
   void rasterize_triangle( float x0, float y0,
                            float x1, float y1,
                            float x2, float y2,
-                           Color color );
+                           Color color,
+                           const GradientShader* shader = nullptr );
+
+  // rasterize closed outlines given as pairs of edge end points, filled
+  // with the nonzero or even-odd rule and by the shader if one is given
+  void rasterize_path( const std::vector<Vector2D>& edges, bool evenodd,
+                       Color color,
+                       const GradientShader* shader = nullptr );
 
   // rasterize an image
   void rasterize_image( float x0, float y0,
@@ -134,6 +335,11 @@ class SoftwareRendererImp : public SoftwareRenderer {
   // resolve samples to render target
   void resolve( void );
 
+  // Helpers //
+
+  // blend premultiplied color into all samples of pixel (x, y)
+  void fill_pixel( int x, int y, const Color& color );
+
 }; // class SoftwareRendererImp
 
 
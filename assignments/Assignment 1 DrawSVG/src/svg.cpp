@@ -1,12 +1,17 @@
 #include "svg.h"
 #include "png.h"
 #include "base64.h"
+#include "svg_cache.h"
+#include "triangulation.h"
 
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
 
 using namespace std;
 
@@ -22,10 +27,123 @@ SVG::~SVG() {
   for (size_t i = 0; i < elements.size(); i++) {
     delete elements[i];
   } elements.clear();
+
+  map<string, Gradient*>::iterator it;
+  for (it = gradients.begin(); it != gradients.end(); ++it) {
+    delete it->second;
+  } gradients.clear();
+
+  map<string, SVGElement*>::iterator sym;
+  for (sym = symbols.begin(); sym != symbols.end(); ++sym) {
+    delete sym->second;
+  } symbols.clear();
+}
+
+// Paths //
+
+// flattening tolerance in pixels
+static const float PATH_TOLERANCE = 0.25f;
+
+// cached zoom buckets per path
+static const size_t PATH_MAX_BUCKETS = 16;
+
+Path::Flattening& Path::flatten( const Matrix3x3& path_2_screen ) {
+
+  // largest stretch of the transformation, rounded up to half an octave
+  double sx = sqrt( path_2_screen(0,0) * path_2_screen(0,0) + 
+                    path_2_screen(1,0) * path_2_screen(1,0) );
+  double sy = sqrt( path_2_screen(0,1) * path_2_screen(0,1) + 
+                    path_2_screen(1,1) * path_2_screen(1,1) );
+  double scale = max( max( sx, sy ), 1e-6 );
+  int bucket = (int) ceil( 2 * log2( scale ) );
+
+  map<int, Flattening>::iterator it = flattenings.find( bucket );
+  if ( it != flattenings.end() ) return it->second;
+  if ( flattenings.size() >= PATH_MAX_BUCKETS ) flattenings.clear();
+
+  // tolerance in path space
+  double tolerance = PATH_TOLERANCE / pow( 2.0, bucket / 2.0 );
+
+  Flattening& f = flattenings[ bucket ];
+  vector<Vector2D>* subpath = NULL;
+  Vector2D start, current;
+  size_t p = 0;
+
+  // appends a point to the current subpath, dropping repeated points
+  auto emit = [&]( const Vector2D& v ) {
+    if ( !subpath ) {
+      f.subpaths.push_back( Polygon() );
+      f.closed.push_back( false );
+      subpath = &f.subpaths.back().points;
+      subpath->push_back( current );
+    }
+    if ( v.x != subpath->back().x || v.y != subpath->back().y ) {
+      subpath->push_back( v );
+    }
+  };
+
+  for ( size_t i = 0; i < commands.size(); i++ ) {
+    switch ( commands[i] ) {
+      case PATH_MOVE:
+        start = current = points[p++];
+        subpath = NULL;
+        break;
+      case PATH_LINE:
+        emit( points[p] );
+        current = points[p++];
+        break;
+      case PATH_QUAD:
+      case PATH_CUBIC: {
+
+        // uniform subdivision with just enough segments for the
+        // tolerance, bounded by the second differences of the controls
+        const Vector2D& p0 = current;
+        const Vector2D* c = &points[p];
+        bool cubic = commands[i] == PATH_CUBIC;
+        double dd = cubic ? max( ( p0 - 2 * c[0] + c[1] ).norm(), 
+                                 ( c[0] - 2 * c[1] + c[2] ).norm() )
+                          : ( p0 - 2 * c[0] + c[1] ).norm();
+        double k = cubic ? 0.75 : 0.25;
+        int n = max( 1, (int) ceil( sqrt( k * dd / tolerance ) ) );
+        n = min( n, 1024 );
+
+        for ( int j = 1; j <= n; j++ ) {
+          double t = (double) j / n, u = 1 - t;
+          if ( cubic ) {
+            emit( u * u * u * p0 + 3 * u * u * t * c[0] + 
+                  3 * u * t * t * c[1] + t * t * t * c[2] );
+          } else {
+            emit( u * u * p0 + 2 * u * t * c[0] + t * t * c[1] );
+          }
+        }
+        current = c[cubic ? 2 : 1];
+        p += cubic ? 3 : 2;
+        break;
+      }
+      case PATH_CLOSE:
+        if ( subpath ) {
+          // the closing edge is implied
+          if ( subpath->size() > 1 && subpath->back().x == start.x &&
+                                      subpath->back().y == start.y ) {
+            subpath->pop_back();
+          }
+          f.closed.back() = true;
+        }
+        current = start;
+        subpath = NULL;
+        break;
+    }
+  }
+
+  return f;
 }
 
+
 // Parser //
 
+map<string, XMLElement*> SVGParser::ids;
+int SVGParser::symbol_depth = 0;
+
 int SVGParser::load( const char* filename, SVG* svg ) {
 
   ifstream in( filename );
@@ -50,8 +168,13 @@ int SVGParser::load( const char* filename, SVG* svg ) {
   root->QueryFloatAttribute( "width",  &svg->width  );
   root->QueryFloatAttribute( "height", &svg->height );
 
+  ids.clear();
+  indexIds( root );
+
+  parseGradients( svg );
   parseSVG( root, svg );
 
+  ids.clear();
   return 0;
 }
 
@@ -68,88 +191,279 @@ void SVGParser::parseSVG( XMLElement* xml, SVG* svg ) {
   XMLElement* elem = xml->FirstChildElement();
   while( elem ) {
 
-    string elementType ( elem->Value() );
-    if( elementType == "line" ) {
+    SVGElement* element = parseChild( elem, svg );
+    if( element ) svg->elements.push_back( element );
+
+    elem = elem->NextSiblingElement();
+  }
+}
 
-      Line* line = new Line();
-      parseElement(elem, line );
-      parseLine( elem, line );
-      svg->elements.push_back( line );
+SVGElement* SVGParser::parseChild( XMLElement* elem, SVG* svg ) {
 
-    } else if( elementType == "polyline" ) {
+  string elementType ( elem->Value() );
+  if( elementType == "line" ) {
 
-      Polyline* polyline = new Polyline();
-      parseElement(elem, polyline );
-      parsePolyline( elem, polyline );
-      svg->elements.push_back( polyline );
+    Line* line = new Line();
+    parseElement( elem, line, svg );
+    parseLine( elem, line );
+    return line;
 
-    } else if( elementType == "rect" ) {
+  } else if( elementType == "polyline" ) {
 
-      float w = elem->FloatAttribute("width" );
-      float h = elem->FloatAttribute("height");
+    Polyline* polyline = new Polyline();
+    parseElement( elem, polyline, svg );
+    parsePolyline( elem, polyline );
+    return polyline;
 
-      // treat zero-size rectangles as points
-      if (w == 0 && h == 0) {
-        Point* point = new Point();
-        parseElement(elem, point );
-        parsePoint( elem, point );
-        svg->elements.push_back( point );
-      } else {
-        Rect* rect = new Rect();
-        parseElement( elem, rect );
-        parseRect( elem, rect );
-        svg->elements.push_back( rect );
+  } else if( elementType == "rect" ) {
+
+    float w = elem->FloatAttribute("width" );
+    float h = elem->FloatAttribute("height");
+
+    // treat zero-size rectangles as points
+    if (w == 0 && h == 0) {
+      Point* point = new Point();
+      parseElement( elem, point, svg );
+      parsePoint( elem, point );
+      return point;
+    } else {
+      Rect* rect = new Rect();
+      parseElement( elem, rect, svg );
+      parseRect( elem, rect );
+      return rect;
+    }
+
+  } else if( elementType == "polygon" ) {
+
+    Polygon* polygon = new Polygon();
+    parseElement( elem, polygon, svg );
+    parsePolygon( elem, polygon );
+    return polygon;
+
+  } else if( elementType == "ellipse" ) {
+
+    Ellipse* ellipse = new Ellipse();
+    parseElement( elem, ellipse, svg );
+    parseEllipse( elem, ellipse );
+    return ellipse;
+
+  } else if ( elementType == "image" ) {
+
+    Image* image = new Image();
+    parseElement( elem, image, svg );
+    parseImage( elem, image );
+    return image;
+
+  } else if( elementType == "g" ) {
+
+    Group* group = new Group();
+    parseElement( elem, group, svg );
+    parseGroup( elem, group, svg );
+    return group;
+
+  } else if( elementType == "path" ) {
+
+    Path* path = new Path();
+    parseElement( elem, path, svg );
+    parsePath( elem, path );
+    return path;
+
+  } else if( elementType == "use" ) {
+
+    Use* use = new Use();
+    parseElement( elem, use, svg );
+    parseUse( elem, use, svg );
+    if ( use->symbol ) return use;
+    delete use;
+
+  }
+
+  // unknown element type --- include default handler here if desired
+  return NULL;
+}
+
+// parse a length that may be given as a percentage
+static float parseLength( const char* value ) {
+  float v = atof( value );
+  return strchr( value, '%' ) ? v / 100.0f : v;
+}
+
+// id referenced by a "#id" or "url(#id)" string, empty if none
+static string parseReference( const char* value ) {
+  string ref = value;
+  size_t hash = ref.find_first_of('#');
+  if ( hash == string::npos ) return "";
+  ref = ref.substr( hash + 1 );
+  size_t paren_r = ref.find_first_of(')');
+  if ( paren_r != string::npos ) ref = ref.substr( 0, paren_r );
+  return ref;
+}
+
+// look up a property in either an attribute or the style attribute
+static string parseProperty( XMLElement* xml, const char* name ) {
+  const char* attr = xml->Attribute( name );
+  if ( attr ) return attr;
+
+  const char* style = xml->Attribute( "style" );
+  if ( !style ) return "";
+
+  string style_str = style;
+  // the name must not be the end of a longer one (opacity, fill-opacity),
+  // so it starts the style or follows a separator or whitespace
+  size_t pos = style_str.find( string(name) + ":" );
+  while ( pos != string::npos && pos > 0 && style_str[pos - 1] != ';' &&
+          !isspace( (unsigned char) style_str[pos - 1] ) ) {
+    pos = style_str.find( string(name) + ":", pos + 1 );
+  }
+  if ( pos == string::npos ) return "";
+  pos += strlen( name ) + 1;
+  size_t end = style_str.find_first_of( ';', pos );
+  string value = style_str.substr( pos, end == string::npos ? end : end - pos );
+  value.erase(remove(value.begin(), value.end(), ' '), value.end());
+  return value;
+}
+
+static bool isGradient( XMLElement* xml ) {
+  return !strcmp( xml->Value(), "linearGradient" ) || 
+         !strcmp( xml->Value(), "radialGradient" );
+}
+
+void SVGParser::parseGradients( SVG* svg ) {
+
+  // Gradients may live anywhere in the document and may be referenced
+  // before they are defined, so they are all parsed before any element
+  // that uses them. Elements may already point to a gradient parsed from
+  // an earlier chunk (streaming), so the first definition of an id stays.
+  map<string, XMLElement*>::iterator it;
+  for ( it = ids.begin(); it != ids.end(); ++it ) {
+    if ( !isGradient( it->second ) || svg->gradients.count( it->first ) ) continue;
+
+    // follow xlink:href templates, applying the farthest one first
+    vector<XMLElement*> chain (1, it->second);
+    while ( chain.size() < 16 ) {
+      const char* href = chain.back()->Attribute( "xlink:href" );
+      if ( !href ) break;
+      map<string, XMLElement*>::iterator ref = ids.find( parseReference( href ) );
+      if ( ref == ids.end() || !isGradient( ref->second ) ) break;
+      chain.push_back( ref->second );
+    }
+
+    string elementType ( it->second->Value() );
+    GradientType type = elementType == "linearGradient" ? 
+                        LINEAR_GRADIENT : RADIAL_GRADIENT;
+    Gradient* gradient = new Gradient( type );
+
+    // the chain may end at a gradient parsed earlier (streaming)
+    const char* href = chain.back()->Attribute( "xlink:href" );
+    if ( href ) {
+      map<string, Gradient*>::iterator ref = svg->gradients.find( parseReference( href ) );
+      if ( ref != svg->gradients.end() ) {
+        const Gradient& base = *ref->second;
+        gradient->spread    = base.spread;
+        gradient->userSpace = base.userSpace;
+        gradient->transform = base.transform;
+        gradient->stops     = base.stops;
+        if ( base.type == type ) {
+          gradient->p0 = base.p0; gradient->p1 = base.p1; gradient->r = base.r;
+        }
       }
+    }
 
-    } else if( elementType == "polygon" ) {
+    for ( size_t i = chain.size(); i > 0; i-- ) {
+      parseGradient( chain[i - 1], gradient );
+    }
+    
+    svg->gradients[ it->first ] = gradient;
+  }
+}
 
-      Polygon* polygon = new Polygon();
-      parseElement( elem, polygon);
-      parsePolygon( elem, polygon );
-      svg->elements.push_back( polygon );
+void SVGParser::parseGradient( XMLElement* xml, Gradient* gradient ) {
 
-    } else if( elementType == "ellipse" ) {
+  const char* units = xml->Attribute( "gradientUnits" );
+  if ( units ) gradient->userSpace = !strcmp( units, "userSpaceOnUse" );
 
-      Ellipse* ellipse = new Ellipse();
-      parseElement( elem, ellipse);
-      parseEllipse( elem, ellipse );
-      svg->elements.push_back( ellipse );
+  const char* spread = xml->Attribute( "spreadMethod" );
+  if ( spread ) {
+    if      ( !strcmp( spread, "reflect" ) ) gradient->spread = SPREAD_REFLECT;
+    else if ( !strcmp( spread, "repeat"  ) ) gradient->spread = SPREAD_REPEAT;
+    else                                     gradient->spread = SPREAD_PAD;
+  }
 
-    } else if ( elementType == "image" ) {
+  const char* trans = xml->Attribute( "gradientTransform" );
+  if ( trans ) gradient->transform = parseTransform( trans );
 
-      Image* image = new Image();
-      parseElement( elem, image);
-      parseImage( elem, image);
-      svg->elements.push_back( image ); 
+  const char* value;
+  if ( gradient->type == LINEAR_GRADIENT ) {
+    if ( (value = xml->Attribute( "x1" )) ) gradient->p0.x = parseLength( value );
+    if ( (value = xml->Attribute( "y1" )) ) gradient->p0.y = parseLength( value );
+    if ( (value = xml->Attribute( "x2" )) ) gradient->p1.x = parseLength( value );
+    if ( (value = xml->Attribute( "y2" )) ) gradient->p1.y = parseLength( value );
+  } else {
+    if ( (value = xml->Attribute( "cx" )) ) gradient->p0.x = parseLength( value );
+    if ( (value = xml->Attribute( "cy" )) ) gradient->p0.y = parseLength( value );
+    if ( (value = xml->Attribute( "r"  )) ) gradient->r    = parseLength( value );
+  }
 
-    } else if( elementType == "g" ) {
+  // stops replace any inherited from a template
+  XMLElement* stop = xml->FirstChildElement( "stop" );
+  if ( stop ) gradient->stops.clear();
+  for ( ; stop; stop = stop->NextSiblingElement( "stop" ) ) {
 
-       Group* group = new Group();
-       parseElement( elem, group);
-       parseGroup( elem, group );
-       svg->elements.push_back( group );
+    GradientStop s;
+    string offset = parseProperty( stop, "offset" );
+    s.offset = offset.empty() ? 0 : parseLength( offset.c_str() );
+    s.offset = max( 0.0f, min( 1.0f, s.offset ) );
 
-    } else {
-       // unknown element type --- include default handler here if desired
+    // offsets never decrease
+    if ( !gradient->stops.empty() ) {
+      s.offset = max( s.offset, gradient->stops.back().offset );
     }
 
-    elem = elem->NextSiblingElement();
+    string color = parseProperty( stop, "stop-color" );
+    s.color = color.empty() ? Color::Black : Color::fromHex( color.c_str() );
+
+    string opacity = parseProperty( stop, "stop-opacity" );
+    s.color.a = opacity.empty() ? 1 : atof( opacity.c_str() );
+
+    gradient->stops.push_back( s );
   }
 }
 
-void SVGParser::parseElement( XMLElement* xml, SVGElement* element ) {
+// gradient fill. Elements also get the average stop color so renderers
+// without gradient support still draw something close
+static void setFillGradient( SVGElement* element, const Gradient* gradient, SVG* svg ) {
+  const vector<GradientStop>& stops = gradient->stops;
+  if ( stops.empty() ) return;
+
+  Color c (0, 0, 0, 0);
+  for ( size_t i = 0; i < stops.size(); i++ ) c += stops[i].color;
+  element->style.fillColor = c * (1.0f / stops.size());
+  element->style.fillColor.a = 1;
+  svg->fill_gradients[ element ] = gradient;
+}
+
+void SVGParser::parseElement( XMLElement* xml, SVGElement* element, SVG* svg ) {
 
   // parse style
   Style* style = &element->style;
   const char* fill = xml->Attribute( "fill" );
-  if( fill ) style->fillColor = Color::fromHex( fill );
+  if( fill && !strncmp( fill, "url(", 4 ) ) {
+
+    map<string, Gradient*>::iterator it = svg->gradients.find( parseReference( fill ) );
+    if ( it != svg->gradients.end() ) setFillGradient( element, it->second, svg );
+
+  } else if( fill && !strcmp( fill, "none" ) ) {
+    style->fillColor = Color( 0, 0, 0, 0 );
+  } else if( fill ) style->fillColor = Color::fromHex( fill );
 
   const char* fill_opacity = xml->Attribute( "fill-opacity" );
-  if( fill_opacity ) style->fillColor.a = atof( fill_opacity );
+  if( fill_opacity && !( fill && !strcmp( fill, "none" ) ) ) {
+    style->fillColor.a = atof( fill_opacity );
+  }
 
   const char* stroke = xml->Attribute( "stroke" );
   const char* stroke_opacity = xml->Attribute( "stroke-opacity" );
-  if( stroke ) {
+  if( stroke && strcmp( stroke, "none" ) ) {
     style->strokeColor = Color::fromHex( stroke );
     if( stroke_opacity ) style->strokeColor.a = atof( stroke_opacity );
   } else {
@@ -161,130 +475,138 @@ void SVGParser::parseElement( XMLElement* xml, SVGElement* element ) {
   xml->QueryFloatAttribute( "stroke-width",      &style->strokeWidth );
   xml->QueryFloatAttribute( "stroke-miterlimit", &style->miterLimit  );
 
+  // an instance of a symbol only restyles what its elements leave unset
+  if ( symbol_depth ) {
+    int styles = ( fill ? OVERRIDE_FILL : 0 ) | ( stroke ? OVERRIDE_STROKE : 0 );
+    if ( styles ) svg->symbol_styles[ element ] = styles;
+  }
+
   // parse transformation
   const char* trans = xml->Attribute( "transform" );
-  if ( trans ) {
-    
-    // NOTE (sky):
-    // This implements the SVG transformation specification. All the SVG 
-    // transformations are supported as documented in the link below:
-    // https://developer.mozilla.org/en-US/docs/Web/SVG/Attribute/transform
-
-    // consolidate transformation
-    Matrix3x3 transform = Matrix3x3::identity();
+  if ( trans ) element->transform = parseTransform( trans );
+}
 
-    string trans_str = trans; size_t paren_l, paren_r;
-    while ( trans_str.find_first_of('(') != string::npos ) {
+Matrix3x3 SVGParser::parseTransform( const char* trans ) {
+    
+  // NOTE (sky):
+  // This implements the SVG transformation specification. All the SVG 
+  // transformations are supported as documented in the link below:
+  // https://developer.mozilla.org/en-US/docs/Web/SVG/Attribute/transform
 
-      paren_l = trans_str.find_first_of('(');
-      paren_r = trans_str.find_first_of(')');
+  // consolidate transformation
+  Matrix3x3 transform = Matrix3x3::identity();
 
-      string type = trans_str.substr(0, paren_l);
-      string data = trans_str.substr(paren_l + 1, paren_r - paren_l - 1);
+  string trans_str = trans; size_t paren_l, paren_r;
+  while ( trans_str.find_first_of('(') != string::npos ) {
 
-      if ( type == "matrix" ) {
-        
-        string matrix_str = data;
-        replace( matrix_str.begin(), matrix_str.end(), ',', ' ');
+    paren_l = trans_str.find_first_of('(');
+    paren_r = trans_str.find_first_of(')');
 
-        stringstream ss (matrix_str);
-        float a; float b; float c; float d; float e; float f;
-        ss >> a; ss >> b; ss >> c; ss >> d; ss >> e; ss >> f;
+    string type = trans_str.substr(0, paren_l);
+    string data = trans_str.substr(paren_l + 1, paren_r - paren_l - 1);
 
-        Matrix3x3 m;
-        m(0,0) = a; m(0,1) = c; m(0,2) = e;
-        m(1,0) = b; m(1,1) = d; m(1,2) = f;
-        m(2,0) = 0; m(2,1) = 0; m(2,2) = 1;        
-        transform = transform * m;
+    if ( type == "matrix" ) {
       
-      } else if ( type == "translate" ) {
-        
-        stringstream ss (data);
-        float x; if (!(ss >> x)) x = 0;
-        float y; if (!(ss >> y)) y = 0;
+      string matrix_str = data;
+      replace( matrix_str.begin(), matrix_str.end(), ',', ' ');
+
+      stringstream ss (matrix_str);
+      float a; float b; float c; float d; float e; float f;
+      ss >> a; ss >> b; ss >> c; ss >> d; ss >> e; ss >> f;
+
+      Matrix3x3 m;
+      m(0,0) = a; m(0,1) = c; m(0,2) = e;
+      m(1,0) = b; m(1,1) = d; m(1,2) = f;
+      m(2,0) = 0; m(2,1) = 0; m(2,2) = 1;        
+      transform = transform * m;
+    
+    } else if ( type == "translate" ) {
+      
+      stringstream ss (data);
+      float x; if (!(ss >> x)) x = 0;
+      float y; if (!(ss >> y)) y = 0;
 
-        Matrix3x3 m = Matrix3x3::identity();
-        
-        m(0,2) = x;
-        m(1,2) = y;
-        
-        transform = transform * m;
+      Matrix3x3 m = Matrix3x3::identity();
+      
+      m(0,2) = x;
+      m(1,2) = y;
+      
+      transform = transform * m;
 
-      } else if (type == "scale" ) {
+    } else if (type == "scale" ) {
 
-        stringstream ss (data);
-        float x; if (!(ss >> x)) x = 1;
-        float y; if (!(ss >> y)) y = 1;
+      stringstream ss (data);
+      float x; if (!(ss >> x)) x = 1;
+      float y; if (!(ss >> y)) y = 1;
 
-        Matrix3x3 m = Matrix3x3::identity();
-        
-        m(0,0) = x;
-        m(1,1) = y;
+      Matrix3x3 m = Matrix3x3::identity();
+      
+      m(0,0) = x;
+      m(1,1) = y;
 
-        transform = transform * m;
+      transform = transform * m;
 
-      } else if (type == "rotate") {
+    } else if (type == "rotate") {
 
-        stringstream ss (data);
-        float a; if (!(ss >> a)) a = 0;
-        float x; if (!(ss >> x)) x = 0;
-        float y; if (!(ss >> y)) y = 0;
+      stringstream ss (data);
+      float a; if (!(ss >> a)) a = 0;
+      float x; if (!(ss >> x)) x = 0;
+      float y; if (!(ss >> y)) y = 0;
 
-        if ( x != 0 || y != 0 ) {
+      if ( x != 0 || y != 0 ) {
 
-          Matrix3x3 m = Matrix3x3::identity();
+        Matrix3x3 m = Matrix3x3::identity();
 
-          m(0,0) = cos(a*PI/180.0f); m(0,1) = -sin(a*PI/180.0f);
-          m(1,0) = sin(a*PI/180.0f); m(1,1) =  cos(a*PI/180.0f);
+        m(0,0) = cos(a*PI/180.0f); m(0,1) = -sin(a*PI/180.0f);
+        m(1,0) = sin(a*PI/180.0f); m(1,1) =  cos(a*PI/180.0f);
 
-          m(0,2) = -x * cos(a*PI/180.0f) + y * sin(a*PI/180.0f) + x;
-          m(1,2) = -x * sin(a*PI/180.0f) - y * cos(a*PI/180.0f) + y;
+        m(0,2) = -x * cos(a*PI/180.0f) + y * sin(a*PI/180.0f) + x;
+        m(1,2) = -x * sin(a*PI/180.0f) - y * cos(a*PI/180.0f) + y;
 
-          transform = transform * m;
+        transform = transform * m;
 
-        } else {
-          
-          Matrix3x3 m = Matrix3x3::identity();
-          
-          m(0,0) = cos(a*PI/180.0f); m(0,1) = -sin(a*PI/180.0f);
-          m(1,0) = sin(a*PI/180.0f); m(1,1) =  cos(a*PI/180.0f);
-          
-          transform = transform * m;
-        }
+      } else {
         
-      } else if (type == "skewX" ) {
-
-        stringstream ss (data);
-        float a; ss >> a;
-
         Matrix3x3 m = Matrix3x3::identity();
         
-        m(0,1) = tan(a*PI/180.0f);
-
+        m(0,0) = cos(a*PI/180.0f); m(0,1) = -sin(a*PI/180.0f);
+        m(1,0) = sin(a*PI/180.0f); m(1,1) =  cos(a*PI/180.0f);
+        
         transform = transform * m;
+      }
+      
+    } else if (type == "skewX" ) {
 
-      } else if (type == "skewY" ) {
+      stringstream ss (data);
+      float a; ss >> a;
 
-        stringstream ss (data);
-        float a; ss >> a;
+      Matrix3x3 m = Matrix3x3::identity();
+      
+      m(0,1) = tan(a*PI/180.0f);
 
-        Matrix3x3 m = Matrix3x3::identity();
-        
-        m(1,0) = tan(a*PI/180.0f);
+      transform = transform * m;
 
-        transform = transform * m;
+    } else if (type == "skewY" ) {
 
-      } else {
-        cerr << "unknown transformation type: " << type << endl;
-      }
+      stringstream ss (data);
+      float a; ss >> a;
+
+      Matrix3x3 m = Matrix3x3::identity();
+      
+      m(1,0) = tan(a*PI/180.0f);
+
+      transform = transform * m;
 
-      size_t end = paren_r + 2;
-      trans_str.erase(0, end);
+    } else {
+      cerr << "unknown transformation type: " << type << endl;
     }
 
-    element->transform = transform;
+    size_t end = paren_r + 2;
+    trans_str.erase(0, end);
   }
-}   
+
+  return transform;
+}
 
 
 void SVGParser::parsePoint( XMLElement* xml, Point* point ) {
@@ -328,6 +650,9 @@ void SVGParser::parsePolygon( XMLElement* xml, Polygon* polygon ) {
   while( points >> x >> c >> y ) {
      polygon->points.push_back( Vector2D( x, y ) );
   }
+
+  // triangulated once, instances of the polygon share the triangles
+  if ( polygon->points.size() >= 3 ) triangulate( *polygon, polygon->triangles );
 }
 
 void SVGParser::parseEllipse( XMLElement* xml, Ellipse* ellipse ) {
@@ -353,6 +678,12 @@ void SVGParser::parseImage( XMLElement* xml, Image* image ) {
   encoded.erase(remove(encoded.begin(), encoded.end(), ' ' ), encoded.end());
   encoded.erase(remove(encoded.begin(), encoded.end(), '\t'), encoded.end());
   encoded.erase(remove(encoded.begin(), encoded.end(), '\n'), encoded.end());
+
+  // images with the same data share one decoded texture
+  image->tex_key = SVGCache::hash( encoded.data(), encoded.size() );
+  image->shared_tex = TextureCache::find( image->tex_key );
+  if ( image->shared_tex ) return;
+
   string decoded = base64_decode(encoded);
 
   // load decoded data into buffer
@@ -369,12 +700,20 @@ void SVGParser::parseImage( XMLElement* xml, Image* image ) {
   mip_start.texels = png.pixels;
 
   // add to svg
-  image->tex.width  = mip_start.width;
-  image->tex.height = mip_start.height;
-  image->tex.mipmap.push_back(mip_start);
+  shared_ptr<Texture> tex = make_shared<Texture>();
+  tex->width  = mip_start.width;
+  tex->height = mip_start.height;
+  tex->mipmap.push_back(mip_start);
+
+  // textures that will be block compressed keep their encoded image
+  if ( tex->width * tex->height >= TextureCompression::kMinTexels ) {
+    tex->source.assign( buffer, buffer + size );
+  }
+
+  image->shared_tex = TextureCache::insert( image->tex_key, tex );
 }
 
-void SVGParser::parseGroup( XMLElement* xml, Group* group ) {
+void SVGParser::parseGroup( XMLElement* xml, Group* group, SVG* svg ) {
 
   /* NOTE (sky):
    * A group contains a list of elements, and optionally a transformation
@@ -386,75 +725,607 @@ void SVGParser::parseGroup( XMLElement* xml, Group* group ) {
    * transformation, and keep in mind that transformation is accumulative.
    * Groups can also be nested.  
    */
+  parseGroupStyle( xml, group );
+
   XMLElement* elem = xml->FirstChildElement();
   while( elem ) {
 
-    string elementType ( elem->Value() );
-    if( elementType == "line" ) {
+    SVGElement* element = parseChild( elem, svg );
+    if( element ) group->elements.push_back( element );
 
-      Line* line = new Line();
-      parseElement( elem, line );
-      parseLine( elem, line );
-      group->elements.push_back( line );
-    
-    } else if( elementType == "polyline" ) {
+    elem = elem->NextSiblingElement();
+  }
+}
+
+void SVGParser::parseGroupStyle( XMLElement* xml, Group* group ) {
+
+  string opacity = parseProperty( xml, "opacity" );
+  if ( !opacity.empty() ) {
+    group->opacity = min( max( (float) atof( opacity.c_str() ), 0.0f ), 1.0f );
+  }
 
-      Polyline* polyline = new Polyline();
-      parseElement( elem, polyline );
-      parsePolyline( elem, polyline );
-      group->elements.push_back( polyline );
+  static const char* ops[] = { "src-over", "clear", "src", "dst", "dst-over",
+                               "src-in", "dst-in", "src-out", "dst-out",
+                               "src-atop", "dst-atop", "xor", "plus" };
+  string op = parseProperty( xml, "comp-op" );
+  if ( op.empty() ) return;
+  for ( int i = 0; i <= COMP_PLUS; i++ ) {
+    if ( op == ops[i] ) {
+      group->comp_op = (CompositeOp) i;
+      return;
+    }
+  }
+  cerr << "unsupported comp-op: " << op << endl;
+}
 
-    } else if( elementType == "rect" ) {
+// reads the next number of a path, skipping separators
+static bool parsePathNumber( const char*& s, double& value ) {
+  while ( *s == ' ' || *s == ',' || *s == '\t' || *s == '\n' || *s == '\r' ) s++;
+  char* end;
+  value = strtod( s, &end );
+  if ( end == s ) return false;
+  s = end;
+  return true;
+}
 
-      float w = elem->FloatAttribute("width" );
-      float h = elem->FloatAttribute("height");
+// reads an arc flag, flags need not be separated ("a1 1 0 00 1 1")
+static bool parsePathFlag( const char*& s, bool& flag ) {
+  while ( *s == ' ' || *s == ',' || *s == '\t' || *s == '\n' || *s == '\r' ) s++;
+  if ( *s != '0' && *s != '1' ) return false;
+  flag = *s++ == '1';
+  return true;
+}
 
-      // treat zero-size rectangles as points
-      if (w == 0 && h == 0) {
-        Point* point = new Point();
-        parseElement( elem, point );
-        parsePoint( elem, point );
-        group->elements.push_back( point );
-      } else {
-        Rect* rect = new Rect();
-        parseElement( elem, rect );
-        parseRect( elem, rect );
-        group->elements.push_back( rect );
+// appends an elliptical arc from p0 to p1 as cubic curves, following
+// the endpoint to center conversion of the SVG implementation notes
+static void parsePathArc( Path* path, Vector2D p0, Vector2D p1, 
+                          double rx, double ry, double angle, 
+                          bool large_arc, bool sweep ) {
+
+  rx = fabs( rx ); ry = fabs( ry );
+  if ( rx == 0 || ry == 0 ) {
+    path->commands.push_back( PATH_LINE );
+    path->points.push_back( p1 );
+    return;
+  }
+  if ( p0.x == p1.x && p0.y == p1.y ) return;
+
+  double phi = angle * PI / 180.0;
+  double cos_phi = cos( phi ), sin_phi = sin( phi );
+
+  // midpoint in the ellipse frame
+  double dx = ( p0.x - p1.x ) / 2, dy = ( p0.y - p1.y ) / 2;
+  double x1 =  cos_phi * dx + sin_phi * dy;
+  double y1 = -sin_phi * dx + cos_phi * dy;
+
+  // scale up radii that are too small to reach
+  double lambda = ( x1 * x1 ) / ( rx * rx ) + ( y1 * y1 ) / ( ry * ry );
+  if ( lambda > 1 ) { rx *= sqrt( lambda ); ry *= sqrt( lambda ); }
+
+  double num = rx * rx * ry * ry - rx * rx * y1 * y1 - ry * ry * x1 * x1;
+  double den = rx * rx * y1 * y1 + ry * ry * x1 * x1;
+  double coef = sqrt( max( 0.0, num / den ) );
+  if ( large_arc == sweep ) coef = -coef;
+  double cx1 =  coef * rx * y1 / ry;
+  double cy1 = -coef * ry * x1 / rx;
+
+  double cx = cos_phi * cx1 - sin_phi * cy1 + ( p0.x + p1.x ) / 2;
+  double cy = sin_phi * cx1 + cos_phi * cy1 + ( p0.y + p1.y ) / 2;
+
+  double theta = atan2( ( y1 - cy1 ) / ry, ( x1 - cx1 ) / rx );
+  double delta = atan2( ( -y1 - cy1 ) / ry, ( -x1 - cx1 ) / rx ) - theta;
+  if (  sweep && delta < 0 ) delta += 2 * PI;
+  if ( !sweep && delta > 0 ) delta -= 2 * PI;
+
+  // at most a quarter turn per cubic
+  int n = (int) ceil( fabs( delta ) / ( PI / 2 ) - 1e-6 );
+  double step = delta / n;
+  double k = 4.0 / 3.0 * tan( step / 4 );
+
+  // point and tangent of the ellipse at angle t
+  auto point = [&]( double t ) {
+    double u = rx * cos( t ), v = ry * sin( t );
+    return Vector2D( cx + cos_phi * u - sin_phi * v, 
+                     cy + sin_phi * u + cos_phi * v );
+  };
+  auto tangent = [&]( double t ) {
+    double u = -rx * sin( t ), v = ry * cos( t );
+    return Vector2D( cos_phi * u - sin_phi * v, 
+                     sin_phi * u + cos_phi * v );
+  };
+
+  for ( int i = 0; i < n; i++ ) {
+    double t0 = theta + i * step, t1 = t0 + step;
+    Vector2D end = i == n - 1 ? p1 : point( t1 );
+    path->commands.push_back( PATH_CUBIC );
+    path->points.push_back( point( t0 ) + k * tangent( t0 ) );
+    path->points.push_back( end - k * tangent( t1 ) );
+    path->points.push_back( end );
+  }
+}
+
+void SVGParser::parsePath( XMLElement* xml, Path* path ) {
+
+  path->evenodd = parseProperty( xml, "fill-rule" ) == "evenodd";
+
+  const char* s = xml->Attribute( "d" );
+  if ( !s ) return;
+
+  Vector2D current, start, control;
+  char command = 0, last = 0;
+  while ( *s ) {
+
+    // commands may be repeated by giving more coordinates
+    while ( *s == ' ' || *s == ',' || *s == '\t' || *s == '\n' || *s == '\r' ) s++;
+    if ( !*s ) break;
+    if ( isalpha( *s ) ) command = *s++;
+    else if ( !command ) break;
+
+    bool relative = islower( command );
+    Vector2D base = relative ? current : Vector2D( 0, 0 );
+    double x, y, x1, y1, x2, y2, rx, ry, angle;
+    bool large_arc, sweep;
+
+    switch ( toupper( command ) ) {
+      case 'M':
+        if ( !parsePathNumber( s, x ) || !parsePathNumber( s, y ) ) return;
+        current = start = base + Vector2D( x, y );
+        path->commands.push_back( PATH_MOVE );
+        path->points.push_back( current );
+        // further coordinates are line segments
+        command = relative ? 'l' : 'L';
+        break;
+      case 'L':
+        if ( !parsePathNumber( s, x ) || !parsePathNumber( s, y ) ) return;
+        current = base + Vector2D( x, y );
+        path->commands.push_back( PATH_LINE );
+        path->points.push_back( current );
+        break;
+      case 'H':
+        if ( !parsePathNumber( s, x ) ) return;
+        current.x = base.x + x;
+        path->commands.push_back( PATH_LINE );
+        path->points.push_back( current );
+        break;
+      case 'V':
+        if ( !parsePathNumber( s, y ) ) return;
+        current.y = base.y + y;
+        path->commands.push_back( PATH_LINE );
+        path->points.push_back( current );
+        break;
+      case 'C':
+      case 'S':
+        if ( toupper( command ) == 'C' ) {
+          if ( !parsePathNumber( s, x1 ) || !parsePathNumber( s, y1 ) ) return;
+          control = base + Vector2D( x1, y1 );
+        } else {
+          // reflection of the previous second control point
+          bool smooth = toupper( last ) == 'C' || toupper( last ) == 'S';
+          control = smooth ? 2 * current - control : current;
+        }
+        if ( !parsePathNumber( s, x2 ) || !parsePathNumber( s, y2 ) ||
+             !parsePathNumber( s, x  ) || !parsePathNumber( s, y  ) ) return;
+        path->commands.push_back( PATH_CUBIC );
+        path->points.push_back( control );
+        control = base + Vector2D( x2, y2 );
+        current = base + Vector2D( x, y );
+        path->points.push_back( control );
+        path->points.push_back( current );
+        break;
+      case 'Q':
+      case 'T':
+        if ( toupper( command ) == 'Q' ) {
+          if ( !parsePathNumber( s, x1 ) || !parsePathNumber( s, y1 ) ) return;
+          control = base + Vector2D( x1, y1 );
+        } else {
+          bool smooth = toupper( last ) == 'Q' || toupper( last ) == 'T';
+          control = smooth ? 2 * current - control : current;
+        }
+        if ( !parsePathNumber( s, x ) || !parsePathNumber( s, y ) ) return;
+        current = base + Vector2D( x, y );
+        path->commands.push_back( PATH_QUAD );
+        path->points.push_back( control );
+        path->points.push_back( current );
+        break;
+      case 'A':
+        if ( !parsePathNumber( s, rx ) || !parsePathNumber( s, ry ) ||
+             !parsePathNumber( s, angle ) || 
+             !parsePathFlag( s, large_arc ) || !parsePathFlag( s, sweep ) ||
+             !parsePathNumber( s, x ) || !parsePathNumber( s, y ) ) return;
+        parsePathArc( path, current, base + Vector2D( x, y ), 
+                      rx, ry, angle, large_arc, sweep );
+        current = base + Vector2D( x, y );
+        break;
+      case 'Z':
+        path->commands.push_back( PATH_CLOSE );
+        current = start;
+        last = command;
+        // takes no coordinates
+        command = 0;
+        continue;
+      default:
+        cerr << "unknown path command: " << command << endl;
+        return;
+    }
+    last = command;
+  }
+}
+
+// instance properties of a <use>, id of the element it references
+static string parseUseInstance( XMLElement* xml, Use* use ) {
+
+  if ( xml->Attribute( "fill"   ) ) use->overrides |= OVERRIDE_FILL;
+  if ( xml->Attribute( "stroke" ) ) use->overrides |= OVERRIDE_STROKE;
+
+  // x and y are applied after the transform attribute
+  Matrix3x3 m = Matrix3x3::identity();
+  m(0,2) = xml->FloatAttribute( "x" );
+  m(1,2) = xml->FloatAttribute( "y" );
+  use->transform = use->transform * m;
+
+  const char* href = xml->Attribute( "xlink:href" );
+  if ( !href ) href = xml->Attribute( "href" );
+  return href ? parseReference( href ) : "";
+}
+
+void SVGParser::parseUse( XMLElement* xml, Use* use, SVG* svg ) {
+
+  string id = parseUseInstance( xml, use );
+  if ( id.empty() ) return;
+
+  map<string, SVGElement*>::iterator it = svg->symbols.find( id );
+  if ( it != svg->symbols.end() ) {
+    // a symbol that is still being parsed references itself
+    use->symbol = it->second;
+    return;
+  }
+
+  use->symbol = parseSymbol( id, svg );
+}
+
+void SVGParser::indexIds( XMLElement* xml ) {
+  const char* id = xml->Attribute( "id" );
+  if ( id ) ids.insert( make_pair( string( id ), xml ) );
+  for ( XMLElement* elem = xml->FirstChildElement(); elem;
+        elem = elem->NextSiblingElement() ) {
+    indexIds( elem );
+  }
+}
+
+SVGElement* SVGParser::parseSymbol( const string& id, SVG* svg ) {
+
+  map<string, XMLElement*>::iterator it = ids.find( id );
+  if ( it == ids.end() ) {
+    cerr << "undefined reference: " << id << endl;
+    return NULL;
+  }
+  XMLElement* def = it->second;
+
+  // mark the symbol as in progress so cyclic references are dropped
+  svg->symbols[ id ] = NULL;
+  symbol_depth++;
+
+  SVGElement* symbol;
+  if ( string( def->Value() ) == "symbol" ) {
+    Group* group = new Group();
+    parseElement( def, group, svg );
+    parseGroup( def, group, svg );
+    symbol = group;
+  } else {
+    symbol = parseChild( def, svg );
+  }
+
+  symbol_depth--;
+  svg->symbols[ id ] = symbol;
+  return symbol;
+}
+
+// Streaming Parser //
+
+namespace {
+
+// a start, end or empty element tag
+struct XMLTag {
+  enum Kind { START, END, EMPTY } kind;
+  string name;
+  vector< pair<string, string> > attributes;
+};
+
+/**
+ * Reads the tags of a XML file in chunks. Text, comments, CDATA sections,
+ * processing instructions and doctypes are skipped.
+ */
+class XMLTagReader {
+ public:
+
+  XMLTagReader( FILE* file ) : file( file ), begin( 0 ), end( 0 ) { 
+    buffer.resize( CHUNK_SIZE );
+  }
+
+  // reads the next tag, false at the end of the file
+  bool next( XMLTag& tag ) {
+
+    while ( true ) {
+
+      // start of the next markup
+      size_t lt = find( "<", begin );
+      if ( lt == string::npos ) return false;
+      begin = lt;
+
+      const char* close = ">";
+      if      ( starts( "<!--"      ) ) close = "-->";
+      else if ( starts( "<![CDATA[" ) ) close = "]]>";
+      else if ( starts( "<?"        ) ) close = "?>";
+
+      size_t gt = find( close, begin + 1, close[1] == 0 );
+      if ( gt == string::npos ) return false;
+      size_t tag_end = gt + strlen( close );
+
+      if ( buffer[begin + 1] != '!' && buffer[begin + 1] != '?' ) {
+        parse( &buffer[begin + 1], &buffer[gt], tag );
+        begin = tag_end;
+        return true;
       }
+      begin = tag_end;
+    }
+  }
 
-    } else if( elementType == "polygon" ) {
-    
-      Polygon* polygon = new Polygon();
-      parseElement( elem, polygon );
-      parsePolygon( elem, polygon );
-      group->elements.push_back( polygon );
-    
-    } else if( elementType == "ellipse" ) {
-    
-      Ellipse* ellipse = new Ellipse();
-      parseElement( elem, ellipse );
-      parseEllipse( elem, ellipse );
-      group->elements.push_back( ellipse );
+ private:
+
+  static const size_t CHUNK_SIZE = 1 << 16;
+
+  FILE* file;
+  vector<char> buffer;
+  size_t begin, end;
+
+  // reads another chunk, keeping the unread data
+  bool fill() {
+    if ( begin > 0 ) {
+      memmove( &buffer[0], &buffer[begin], end - begin );
+      end -= begin; begin = 0;
+    }
+    if ( buffer.size() - end < CHUNK_SIZE ) buffer.resize( end + CHUNK_SIZE );
+    size_t n = fread( &buffer[end], 1, buffer.size() - end, file );
+    end += n;
+    return n > 0;
+  }
+
+  bool starts( const char* prefix ) {
+    size_t n = strlen( prefix );
+    while ( end - begin < n ) if ( !fill() ) return false;
+    return !memcmp( &buffer[begin], prefix, n );
+  }
+
+  // offset of str at or after from (relative offsets survive refills),
+  // optionally skipping quoted attribute values
+  size_t find( const char* str, size_t from, bool quotes = false ) {
+    size_t n = strlen( str ), offset = from - begin;
+    char quote = 0;
+    while ( true ) {
+      for ( ; begin + offset + n <= end; offset++ ) {
+        char c = buffer[begin + offset];
+        if ( quote ) { if ( c == quote ) quote = 0; continue; }
+        if ( quotes && ( c == '"' || c == '\'' ) ) { quote = c; continue; }
+        if ( !memcmp( &buffer[begin + offset], str, n ) ) return begin + offset;
+      }
+      if ( !fill() ) return string::npos;
+    }
+  }
+
+  // parses the inside of a tag, between < and >
+  static void parse( const char* s, const char* e, XMLTag& tag ) {
+
+    tag.attributes.clear();
+    tag.kind = XMLTag::START;
+    if ( *s == '/' ) { tag.kind = XMLTag::END; s++; }
+    if ( e > s && e[-1] == '/' ) { tag.kind = XMLTag::EMPTY; e--; }
+
+    const char* name = s;
+    while ( s < e && !isspace( *s ) ) s++;
+    tag.name.assign( name, s );
+
+    while ( s < e ) {
+      while ( s < e && isspace( *s ) ) s++;
+      const char* key = s;
+      while ( s < e && *s != '=' && !isspace( *s ) ) s++;
+      string k ( key, s );
+      while ( s < e && *s != '"' && *s != '\'' ) s++;
+      if ( s == e ) break;
+      char quote = *s++;
+      const char* value = s;
+      while ( s < e && *s != quote ) s++;
+      tag.attributes.push_back( make_pair( k, unescape( value, s ) ) );
+      s++;
+    }
+  }
+
+  static string unescape( const char* s, const char* e ) {
+    static const char* entities[][2] = { 
+      { "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" },
+      { "&quot;", "\"" }, { "&apos;", "'" } 
+    };
+    string value;
+    value.reserve( e - s );
+    while ( s < e ) {
+      bool replaced = false;
+      if ( *s == '&' ) {
+        for ( size_t i = 0; i < 5 && !replaced; i++ ) {
+          size_t n = strlen( entities[i][0] );
+          if ( (size_t) (e - s) >= n && !strncmp( s, entities[i][0], n ) ) {
+            value += entities[i][1]; s += n; replaced = true;
+          }
+        }
+      }
+      if ( !replaced ) value += *s++;
+    }
+    return value;
+  }
+
+}; // class XMLTagReader
+
+} // namespace
+
+int SVGParser::stream( const char* filename, SVG* svg ) {
+
+  FILE* file = fopen( filename, "rb" );
+  if ( !file ) return -1;
+
+  /* Tags are turned into elements of a scratch document one at a time
+   * so the regular element parsers can be reused. Only definitions that
+   * need their children (gradients, symbols and defs) are kept as a
+   * subtree until they are closed. Memory is bounded by the largest
+   * definition instead of the whole document.
+   */
+  XMLTagReader reader ( file );
+  XMLDocument doc;
+  XMLTag tag;
+
+  // elements of the svg or the groups currently open
+  vector< vector<SVGElement*>* > containers;
+
+  // open definition subtree, its parent in the scratch document
+  XMLElement* scratch = doc.NewElement( "defs" );
+  doc.InsertEndChild( scratch );
+  XMLElement* def = NULL;
+
+  // nesting of unsupported elements being skipped
+  int skip = 0;
+
+  // references to definitions that come later in the document
+  vector< pair<Use*, string> > pending_uses;
+  vector< pair<SVGElement*, string> > pending_fills;
+
+  // parses a closed definition subtree, then drops it
+  auto define = [&]() {
+    ids.clear();
+    indexIds( def );
+    parseGradients( svg );
+    map<string, XMLElement*>::iterator it;
+    for ( it = ids.begin(); it != ids.end(); ++it ) {
+      if ( isGradient( it->second ) || svg->symbols.count( it->first ) ) continue;
+      parseSymbol( it->first, svg );
+    }
+    ids.clear();
+    doc.DeleteNode( def );
+    def = NULL;
+  };
+
+  bool root = false;
+  while ( reader.next( tag ) ) {
+
+    if ( skip ) {
+      if      ( tag.kind == XMLTag::START ) skip++;
+      else if ( tag.kind == XMLTag::END   ) skip--;
+      continue;
+    }
+
+    if ( tag.kind == XMLTag::END ) {
+      if ( def ) {
+        XMLNode* parent = def->Parent();
+        if ( parent != scratch ) def = parent->ToElement();
+        else define();
+      } else if ( tag.name == "g" && containers.size() > 1 ) {
+        containers.pop_back();
+      }
+      continue;
+    }
+
+    XMLElement* xml = doc.NewElement( tag.name.c_str() );
+    for ( size_t i = 0; i < tag.attributes.size(); i++ ) {
+      xml->SetAttribute( tag.attributes[i].first.c_str(),
+                         tag.attributes[i].second.c_str() );
+    }
+    ( def ? def : scratch )->InsertEndChild( xml );
+
+    // inside a definition, or starting one
+    if ( def || tag.name == "defs" || tag.name == "symbol" ||
+         tag.name == "linearGradient" || tag.name == "radialGradient" ) {
+      if ( tag.kind == XMLTag::START ) def = xml;
+      else if ( !def ) { def = xml; define(); }
+      continue;
+    }
+
+    if ( !root ) {
+      if ( tag.name != "svg" ) {
+        cerr << "Error: not an SVG file!" << endl;
+        fclose( file );
+        return -1;
+      }
+      xml->QueryFloatAttribute( "width",  &svg->width  );
+      xml->QueryFloatAttribute( "height", &svg->height );
+      containers.push_back( &svg->elements );
+      root = true;
+      doc.DeleteNode( xml );
+      continue;
+    }
+
+    SVGElement* element = NULL;
+    if ( tag.name == "g" ) {
+
+      Group* group = new Group();
+      parseElement( xml, group, svg );
+      parseGroupStyle( xml, group );
+      element = group;
+
+    } else if ( tag.name == "use" ) {
+
+      Use* use = new Use();
+      parseElement( xml, use, svg );
+      string id = parseUseInstance( xml, use );
+      map<string, SVGElement*>::iterator it = svg->symbols.find( id );
+      if ( it != svg->symbols.end() ) use->symbol = it->second;
+      else pending_uses.push_back( make_pair( use, id ) );
+      element = use;
 
-    } else if ( elementType == "image" ) {
-    
-      Image* image = new Image();
-      parseElement( elem, image );
-      parseImage( elem, image);
-      group->elements.push_back( image ); 
-    
-    } else if( elementType == "g" ) {
-    
-       Group* sub_group = new Group();
-       parseElement( elem, sub_group );
-       parseGroup( elem, sub_group );
-       group->elements.push_back( sub_group );
-    
     } else {
-       // unknown element type --- include default handler here if desired
-    }    
-    elem = elem->NextSiblingElement();
+      element = parseChild( xml, svg );
+    }
+
+    // gradient defined later
+    const char* fill = xml->Attribute( "fill" );
+    if ( element && fill && !strncmp( fill, "url(", 4 ) && 
+         !svg->fill_gradients.count( element ) ) {
+      pending_fills.push_back( make_pair( element, parseReference( fill ) ) );
+    }
+
+    doc.DeleteNode( xml );
+
+    if ( !element ) {
+      if ( tag.kind == XMLTag::START ) skip = 1;
+      continue;
+    }
+
+    containers.back()->push_back( element );
+    if ( element->type == GROUP && tag.kind == XMLTag::START ) {
+      containers.push_back( &static_cast<Group*>( element )->elements );
+    } else if ( tag.kind == XMLTag::START ) {
+      // children of other elements (titles etc.) are ignored
+      skip = 1;
+    }
   }
+
+  fclose( file );
+  if ( !root ) {
+    cerr << "Error: not an SVG file!" << endl;
+    return -1;
+  }
+
+  // resolve forward references
+  for ( size_t i = 0; i < pending_uses.size(); i++ ) {
+    map<string, SVGElement*>::iterator it = svg->symbols.find( pending_uses[i].second );
+    if ( it != svg->symbols.end() ) pending_uses[i].first->symbol = it->second;
+    else cerr << "undefined reference: " << pending_uses[i].second << endl;
+  }
+  for ( size_t i = 0; i < pending_fills.size(); i++ ) {
+    map<string, Gradient*>::iterator it = svg->gradients.find( pending_fills[i].second );
+    if ( it == svg->gradients.end() ) continue;
+    SVGElement* element = pending_fills[i].first;
+    float opacity = element->style.fillColor.a;
+    setFillGradient( element, it->second, svg );
+    element->style.fillColor.a = opacity;
+  }
+
+  return 0;
 }
 
 } // namespace CMU462
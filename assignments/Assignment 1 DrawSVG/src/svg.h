@@ -2,6 +2,7 @@
 #define CMU462_SVG_H
 
 #include <map>
+#include <string>
 #include <vector>
 
 #include "color.h"
@@ -23,7 +24,9 @@ typedef enum e_SVGElementType {
   POLYGON,
   ELLIPSE,
   IMAGE,
-  GROUP
+  GROUP,
+  USE,
+  PATH
 } SVGElementType;
 
 struct Style {
@@ -33,6 +36,52 @@ struct Style {
   float miterLimit;
 };
 
+typedef enum e_GradientType {
+  LINEAR_GRADIENT,
+  RADIAL_GRADIENT
+} GradientType;
+
+typedef enum e_GradientSpread {
+  SPREAD_PAD,
+  SPREAD_REFLECT,
+  SPREAD_REPEAT
+} GradientSpread;
+
+struct GradientStop {
+  float offset;
+  Color color;
+};
+
+/**
+ * A linear or radial gradient paint server. Linear gradients run from p0
+ * to p1, radial gradients are centered at p0 with radius r. Coordinates
+ * are in the element's bounding box space (0 to 1) unless userSpace is set,
+ * and default to a left to right gradient or one centered in the box.
+ */
+struct Gradient {
+
+  Gradient( GradientType _type ) 
+    : type( _type ), spread( SPREAD_PAD ), userSpace( false ),
+      p0( _type == RADIAL_GRADIENT ? Vector2D( 0.5, 0.5 ) : Vector2D( 0, 0 ) ),
+      p1( 1, 0 ), r( 0.5 ),
+      transform( Matrix3x3::identity() ) { }
+
+  GradientType type;
+  GradientSpread spread;
+  bool userSpace;
+
+  Vector2D p0;
+  Vector2D p1;
+  float r;
+
+  // gradientTransform
+  Matrix3x3 transform;
+
+  // color stops ordered by offset
+  std::vector<GradientStop> stops;
+
+};
+
 struct SVGElement {
 
   SVGElement( SVGElementType _type ) 
@@ -51,13 +100,36 @@ struct SVGElement {
   
 };
 
+// Porter-Duff operators compositing a group over what is drawn below it,
+// set with the comp-op property of SVG 1.2
+typedef enum e_CompositeOp {
+  COMP_SRC_OVER = 0,
+  COMP_CLEAR,
+  COMP_SRC,
+  COMP_DST,
+  COMP_DST_OVER,
+  COMP_SRC_IN,
+  COMP_DST_IN,
+  COMP_SRC_OUT,
+  COMP_DST_OUT,
+  COMP_SRC_ATOP,
+  COMP_DST_ATOP,
+  COMP_XOR,
+  COMP_PLUS
+} CompositeOp;
+
 struct Group : SVGElement {
 
-  Group() : SVGElement  ( GROUP ) { }
+  Group() : SVGElement  ( GROUP ), opacity ( 1 ), comp_op ( COMP_SRC_OVER ) { }
   std::vector<SVGElement*> elements;
 
   ~Group();
 
+  // the group is drawn on its own and then composited with its opacity
+  // and operator, unless it is opaque and drawn source-over
+  float opacity;
+  CompositeOp comp_op;
+
 };
 
 struct Point : SVGElement {
@@ -95,6 +167,9 @@ struct Polygon : SVGElement {
   Polygon() : SVGElement  ( POLYGON ) { }
   std::vector<Vector2D> points;
 
+  // triangulation of the points, computed when the polygon is parsed
+  std::vector<Vector2D> triangles;
+
 };
 
 struct Ellipse : SVGElement {
@@ -107,19 +182,104 @@ struct Ellipse : SVGElement {
 
 struct Image : SVGElement {
 
-  Image() : SVGElement  ( IMAGE ) { }
+  Image() : SVGElement  ( IMAGE ), tex_key ( 0 ) { }
   Vector2D position;
   Vector2D dimension;
   Texture tex;
+
+  // decoded texture shared through the TextureCache and the hash of its
+  // encoded data. tex only holds a copy for the reference renderer
+  std::shared_ptr<Texture> shared_tex;
+  uint64_t tex_key;
+
+  inline Texture& texture() { return shared_tex ? *shared_tex : tex; }
+  inline const Texture& texture() const { return shared_tex ? *shared_tex : tex; }
   
 };
 
+// style properties of a <use> that replace those its symbol leaves unset
+typedef enum e_StyleOverride {
+  OVERRIDE_FILL   = 1,
+  OVERRIDE_STROKE = 2
+} StyleOverride;
+
+/**
+ * An instance of a <symbol> (or any other element with an id). The 
+ * symbol is parsed once and shared by all its instances, an instance only
+ * holds its transformation (including x and y) and style overrides.
+ */
+struct Use : SVGElement {
+
+  Use() : SVGElement ( USE ), symbol( NULL ), overrides( 0 ) { }
+
+  // shared element, owned by the svg
+  SVGElement* symbol;
+
+  // StyleOverride flags of the properties set on the instance
+  int overrides;
+
+};
+
+// path commands, arcs are converted to cubic curves when parsed
+typedef enum e_PathCommand {
+  PATH_MOVE,   // 1 point
+  PATH_LINE,   // 1 point
+  PATH_QUAD,   // 2 points: control, end
+  PATH_CUBIC,  // 3 points: control, control, end
+  PATH_CLOSE   // no point
+} PathCommand;
+
+/**
+ * A <path>, stored as a command buffer with absolute coordinates. Curves 
+ * are flattened for the scale they are drawn at; flattenings are cached 
+ * per zoom bucket (half an octave of scale) so each zoom level only pays
+ * for the segments it needs.
+ */
+struct Path : SVGElement {
+
+  Path() : SVGElement ( PATH ), evenodd ( false ) { }
+
+  // one PathCommand per byte
+  std::vector<unsigned char> commands;
+  std::vector<Vector2D> points;
+
+  // fill-rule of the subpaths filled together, nonzero unless evenodd
+  bool evenodd;
+
+  // flattened subpaths. Each caches its triangulation for the hardware
+  // renderer, which fills subpaths on their own
+  struct Flattening {
+    std::vector<Polygon> subpaths;
+    std::vector<bool> closed;
+  };
+
+  // flattening accurate to a fraction of a pixel when drawn with the
+  // given path to screen transformation
+  Flattening& flatten( const Matrix3x3& path_2_screen );
+
+  // cached flattenings by zoom bucket
+  std::map<int, Flattening> flattenings;
+
+};
+
 struct SVG {
 
   ~SVG();
   float width, height;
   std::vector<SVGElement*> elements;
 
+  // Gradients by id, and the gradient filling each element. These are
+  // kept out of Style so the element structs (shared with the reference
+  // renderer) keep their layout; elements filled with a gradient also
+  // get the average stop color as their fillColor.
+  std::map<std::string, Gradient*> gradients;
+  std::map<const SVGElement*, const Gradient*> fill_gradients;
+
+  // Shared elements referenced by <use>, by id, and the StyleOverride
+  // flags of the properties that elements inside them set themselves
+  std::map<std::string, SVGElement*> symbols;
+  std::map<const SVGElement*, int> symbol_styles;
+
 };
 
 class SVGParser {
@@ -127,14 +287,30 @@ class SVGParser {
 
   static int load( const char* filename, SVG* svg );
   static int save( const char* filename, const SVG* svg );
+
+  // Loads a svg without building the XML document, reading the file in
+  // chunks and creating elements as their tags are read. Supports the
+  // same elements as load, except that <use> may only reference symbols
+  // and elements inside <defs>, and gradient templates must come first.
+  static int stream( const char* filename, SVG* svg );
  
  private:
   
   // parse a svg file
   static void parseSVG       ( XMLElement* xml, SVG* svg );
 
+  // parse a child element of a svg or group, NULL if unsupported
+  static SVGElement* parseChild( XMLElement* xml, SVG* svg );
+
   // parse shared properties of svg elements
-  static void parseElement   ( XMLElement* xml, SVGElement* element );
+  static void parseElement   ( XMLElement* xml, SVGElement* element, SVG* svg );
+
+  // parse a transform attribute
+  static Matrix3x3 parseTransform( const char* trans );
+
+  // parse the gradient definitions in the id index
+  static void parseGradients ( SVG* svg );
+  static void parseGradient  ( XMLElement* xml, Gradient* gradient );
   
   // parse type specific properties
   static void parsePoint     ( XMLElement* xml, Point*    point       );
@@ -144,8 +320,22 @@ class SVGParser {
   static void parsePolygon   ( XMLElement* xml, Polygon*  polygon     );
   static void parseEllipse   ( XMLElement* xml, Ellipse*  ellipse     );
   static void parseImage     ( XMLElement* xml, Image*    image       );
-  static void parseGroup     ( XMLElement* xml, Group*    group       );
-
+  static void parseGroup     ( XMLElement* xml, Group*    group, SVG* svg );
+  static void parseGroupStyle( XMLElement* xml, Group*    group       );
+  static void parseUse       ( XMLElement* xml, Use*      use,   SVG* svg );
+  static void parsePath      ( XMLElement* xml, Path*     path        );
+
+  // parse the shared element with the given id
+  static SVGElement* parseSymbol( const std::string& id, SVG* svg );
+
+  // elements with an id in the document being parsed, the first element
+  // with an id wins
+  static std::map<std::string, XMLElement*> ids;
+  static void indexIds( XMLElement* xml );
+
+  // number of symbols being parsed, their elements record the style
+  // properties they set
+  static int symbol_depth;
 
 }; // class SVGParser
 
@@ -0,0 +1,714 @@
+#include "svg_cache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <iostream>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+namespace CMU462 {
+
+// Mapped File //
+
+MappedFile::MappedFile( const char* filename )
+  : data( NULL ), size( 0 ), handle( NULL ) {
+
+#ifndef _WIN32
+  int fd = open( filename, O_RDONLY );
+  if ( fd < 0 ) return;
+
+  struct stat st;
+  if ( fstat( fd, &st ) == 0 && st.st_size > 0 ) {
+    void* map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( map != MAP_FAILED ) {
+      handle = map;
+      data = (const unsigned char*) map;
+      size = st.st_size;
+    }
+  }
+  close( fd );
+  if ( handle ) return;
+#endif
+
+  // read the file if it can not be mapped
+  ifstream in( filename, ios::binary );
+  if ( !in.is_open() ) return;
+  stringstream ss; ss << in.rdbuf();
+  buffer = ss.str();
+  data = (const unsigned char*) buffer.data();
+  size = buffer.size();
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+  if ( handle ) munmap( handle, size );
+#endif
+}
+
+
+// Serialization //
+
+namespace {
+
+static const char CACHE_MAGIC[8] = { 'D','S','V','G','C','A','C','H' };
+
+// bump whenever the layout below changes
+static const uint32_t CACHE_VERSION = 6;
+
+// writes a document to a file as it goes, so the cache is never held in
+// memory next to the document
+class CacheWriter {
+ public:
+
+  CacheWriter( const SVG* svg, FILE* file ) : ok( true ), svg( svg ), file( file ) {
+    int index = 0;
+    map<string, Gradient*>::const_iterator g;
+    for ( g = svg->gradients.begin(); g != svg->gradients.end(); ++g ) {
+      gradients[ g->second ] = index++;
+    }
+    index = 0;
+    map<string, SVGElement*>::const_iterator s;
+    for ( s = svg->symbols.begin(); s != svg->symbols.end(); ++s ) {
+      symbols[ s->second ] = index++;
+    }
+  }
+
+  // false once a write failed
+  bool ok;
+
+  void write_bytes( const void* p, size_t n ) {
+    if ( ok && n && fwrite( p, 1, n, file ) != n ) ok = false;
+  }
+
+  template <typename T>
+  void write( const T& value ) {
+    write_bytes( &value, sizeof(T) );
+  }
+
+  void write( const string& str ) {
+    write( (uint64_t) str.size() );
+    write_bytes( str.data(), str.size() );
+  }
+
+  void write( const Vector2D& v ) {
+    write( v.x ); write( v.y );
+  }
+
+  void write( const Color& c ) {
+    write( c.r ); write( c.g ); write( c.b ); write( c.a );
+  }
+
+  void write( const Matrix3x3& m ) {
+    for ( int i = 0; i < 3; i++ ) {
+      for ( int j = 0; j < 3; j++ ) {
+        write( (double) m(i,j) );
+      }
+    }
+  }
+
+  void write( const vector<Vector2D>& points ) {
+    write( (uint64_t) points.size() );
+    for ( size_t i = 0; i < points.size(); i++ ) write( points[i] );
+  }
+
+  void write( const Gradient& gradient ) {
+    write( (uint8_t) gradient.type );
+    write( (uint8_t) gradient.spread );
+    write( (uint8_t) gradient.userSpace );
+    write( gradient.p0 ); write( gradient.p1 ); write( gradient.r );
+    write( gradient.transform );
+    write( (uint64_t) gradient.stops.size() );
+    for ( size_t i = 0; i < gradient.stops.size(); i++ ) {
+      write( gradient.stops[i].offset );
+      write( gradient.stops[i].color );
+    }
+  }
+
+  void write( const Texture& tex ) {
+    write( (uint64_t) tex.width );
+    write( (uint64_t) tex.height );
+    write( (uint64_t) tex.mipmap.size() );
+    for ( size_t i = 0; i < tex.mipmap.size(); i++ ) {
+      const MipLevel& level = tex.mipmap[i];
+      write( (uint64_t) level.width );
+      write( (uint64_t) level.height );
+      write( (uint64_t) level.texels.size() );
+      write_bytes( level.texels.data(), level.texels.size() );
+    }
+    write( (uint8_t) tex.format );
+    write( (uint64_t) tex.source.size() );
+    write_bytes( tex.source.data(), tex.source.size() );
+  }
+
+  void write_element( const SVGElement* element ) {
+
+    if ( !element ) {
+      write( (uint8_t) NONE );
+      return;
+    }
+
+    write( (uint8_t) element->type );
+    write( element->style.strokeColor );
+    write( element->style.fillColor );
+    write( element->style.strokeWidth );
+    write( element->style.miterLimit );
+    write( element->transform );
+
+    map<const SVGElement*, const Gradient*>::const_iterator fill;
+    fill = svg->fill_gradients.find( element );
+    write( (int32_t) ( fill == svg->fill_gradients.end() ?
+                       -1 : index( gradients, fill->second ) ) );
+
+    map<const SVGElement*, int>::const_iterator styles;
+    styles = svg->symbol_styles.find( element );
+    write( (int32_t) ( styles == svg->symbol_styles.end() ? 0 : styles->second ) );
+
+    switch ( element->type ) {
+      case POINT: {
+        const Point& point = static_cast<const Point&>( *element );
+        write( point.position );
+        break;
+      }
+      case LINE: {
+        const Line& line = static_cast<const Line&>( *element );
+        write( line.from ); write( line.to );
+        break;
+      }
+      case POLYLINE: {
+        const Polyline& polyline = static_cast<const Polyline&>( *element );
+        write( polyline.points );
+        break;
+      }
+      case RECT: {
+        const Rect& rect = static_cast<const Rect&>( *element );
+        write( rect.position ); write( rect.dimension );
+        break;
+      }
+      case POLYGON: {
+        const Polygon& polygon = static_cast<const Polygon&>( *element );
+        write( polygon.points ); write( polygon.triangles );
+        break;
+      }
+      case ELLIPSE: {
+        const Ellipse& ellipse = static_cast<const Ellipse&>( *element );
+        write( ellipse.center ); write( ellipse.radius );
+        break;
+      }
+      case IMAGE: {
+        const Image& image = static_cast<const Image&>( *element );
+        write( image.position ); write( image.dimension );
+
+        // shared textures are stored once per file
+        write( image.tex_key );
+        bool data = !image.tex_key || textures.insert( image.tex_key ).second;
+        write( (uint8_t) data );
+        if ( data ) write( image.texture() );
+        break;
+      }
+      case GROUP: {
+        const Group& group = static_cast<const Group&>( *element );
+        write( group.opacity ); write( (int32_t) group.comp_op );
+        write( (uint64_t) group.elements.size() );
+        for ( size_t i = 0; i < group.elements.size(); i++ ) {
+          write_element( group.elements[i] );
+        }
+        break;
+      }
+      case USE: {
+        const Use& use = static_cast<const Use&>( *element );
+        write( (int32_t) index( symbols, use.symbol ) );
+        write( (int32_t) use.overrides );
+        break;
+      }
+      case PATH: {
+        const Path& path = static_cast<const Path&>( *element );
+        write( (uint64_t) path.commands.size() );
+        write_bytes( path.commands.data(), path.commands.size() );
+        write( path.points );
+        write( (uint8_t) path.evenodd );
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+ private:
+
+  const SVG* svg;
+  FILE* file;
+  map<const Gradient*, int> gradients;
+  map<const SVGElement*, int> symbols;
+  set<uint64_t> textures;
+
+  // index of an object in a table, -1 if it is not in the table
+  template <typename T>
+  static int index( const map<const T*, int>& table, const T* object ) {
+    typename map<const T*, int>::const_iterator it = table.find( object );
+    return object && it != table.end() ? it->second : -1;
+  }
+
+}; // class CacheWriter
+
+class CacheReader {
+ public:
+
+  CacheReader( const unsigned char* data, size_t size, SVG* svg )
+    : p( data ), end( data + size ), ok( true ), svg( svg ) { }
+
+  const unsigned char* p;
+  const unsigned char* end;
+  bool ok;
+
+  // index to object tables, filled while reading
+  vector<Gradient*> gradients;
+  vector<SVGElement**> symbol_slots;
+  vector< pair<Use*, int> > uses;
+
+  bool read_bytes( void* dst, size_t n ) {
+    if ( !ok || (size_t) ( end - p ) < n ) { ok = false; return false; }
+    memcpy( dst, p, n ); p += n;
+    return true;
+  }
+
+  template <typename T>
+  T read() {
+    T value = T();
+    read_bytes( &value, sizeof(T) );
+    return value;
+  }
+
+  // element counts are checked against the remaining data
+  uint64_t read_count( size_t element_size ) {
+    uint64_t n = read<uint64_t>();
+    if ( element_size && n > ( end - p ) / element_size ) { ok = false; return 0; }
+    return n;
+  }
+
+  string read_string() {
+    uint64_t n = read_count( 1 );
+    string str ( (const char*) p, ok ? n : 0 );
+    if ( ok ) p += n;
+    return str;
+  }
+
+  Vector2D read_vector() {
+    double x = read<double>(), y = read<double>();
+    return Vector2D( x, y );
+  }
+
+  Color read_color() {
+    float r = read<float>(), g = read<float>(), b = read<float>(), a = read<float>();
+    return Color( r, g, b, a );
+  }
+
+  Matrix3x3 read_matrix() {
+    Matrix3x3 m;
+    for ( int i = 0; i < 3; i++ ) {
+      for ( int j = 0; j < 3; j++ ) {
+        m(i,j) = read<double>();
+      }
+    }
+    return m;
+  }
+
+  void read_points( vector<Vector2D>& points ) {
+    points.resize( read_count( 2 * sizeof(double) ) );
+    for ( size_t i = 0; i < points.size(); i++ ) points[i] = read_vector();
+  }
+
+  Gradient* read_gradient() {
+    Gradient* gradient = new Gradient( (GradientType) read<uint8_t>() );
+    gradient->spread = (GradientSpread) read<uint8_t>();
+    gradient->userSpace = read<uint8_t>() != 0;
+    gradient->p0 = read_vector();
+    gradient->p1 = read_vector();
+    gradient->r = read<float>();
+    gradient->transform = read_matrix();
+    gradient->stops.resize( read_count( 5 * sizeof(float) ) );
+    for ( size_t i = 0; i < gradient->stops.size(); i++ ) {
+      gradient->stops[i].offset = read<float>();
+      gradient->stops[i].color = read_color();
+    }
+    return gradient;
+  }
+
+  void read_texture( Texture& tex ) {
+    tex.width  = read<uint64_t>();
+    tex.height = read<uint64_t>();
+    tex.mipmap.resize( read_count( 3 * sizeof(uint64_t) ) );
+    for ( size_t i = 0; i < tex.mipmap.size() && ok; i++ ) {
+      MipLevel& level = tex.mipmap[i];
+      level.width  = read<uint64_t>();
+      level.height = read<uint64_t>();
+      level.texels.resize( read_count( 1 ) );
+      if ( !level.texels.empty() ) read_bytes( &level.texels[0], level.texels.size() );
+    }
+    tex.format = (TexelFormat) read<uint8_t>();
+    if ( tex.format > TEXELS_BC3 ) ok = false;
+    tex.source.resize( read_count( 1 ) );
+    if ( !tex.source.empty() ) read_bytes( &tex.source[0], tex.source.size() );
+
+    // texels are read in their format, which must match their size
+    for ( size_t i = 0; i < tex.mipmap.size() && ok; i++ ) {
+      const MipLevel& level = tex.mipmap[i];
+      TexelFormat format = TextureCompression::format( tex, i );
+      size_t size = format == TEXELS_RGBA8 ? 4 * level.width * level.height
+                  : TextureCompression::block_size( format ) *
+                    ( ( level.width + 3 ) / 4 ) * ( ( level.height + 3 ) / 4 );
+      if ( level.texels.size() != size ) ok = false;
+    }
+  }
+
+  void skip_texture() {
+    read<uint64_t>(); read<uint64_t>();
+    uint64_t levels = read_count( 3 * sizeof(uint64_t) );
+    for ( uint64_t i = 0; i < levels && ok; i++ ) {
+      read<uint64_t>(); read<uint64_t>();
+      p += read_count( 1 );
+    }
+    read<uint8_t>();
+    p += read_count( 1 );
+  }
+
+  // reads an image texture, textures already in the TextureCache are
+  // shared instead of copied
+  void read_image_texture( Image* image ) {
+    image->tex_key = read<uint64_t>();
+    bool data = read<uint8_t>() != 0;
+    if ( !image->tex_key ) {
+      if ( data ) read_texture( image->tex ); else ok = false;
+      return;
+    }
+
+    image->shared_tex = TextureCache::find( image->tex_key );
+    if ( image->shared_tex ) {
+      if ( data ) skip_texture();
+    } else if ( data ) {
+      shared_ptr<Texture> tex = make_shared<Texture>();
+      read_texture( *tex );
+      if ( ok ) image->shared_tex = TextureCache::insert( image->tex_key, tex );
+    } else {
+      ok = false;
+    }
+  }
+
+  // reads an element, NULL for a missing symbol or on error
+  SVGElement* read_element() {
+
+    SVGElementType type = (SVGElementType) read<uint8_t>();
+    if ( !ok || type == NONE ) return NULL;
+
+    Style style;
+    style.strokeColor = read_color();
+    style.fillColor   = read_color();
+    style.strokeWidth = read<float>();
+    style.miterLimit  = read<float>();
+    Matrix3x3 transform = read_matrix();
+    int32_t fill = read<int32_t>();
+    int32_t styles = read<int32_t>();
+
+    SVGElement* element = NULL;
+    switch ( type ) {
+      case POINT: {
+        Point* point = new Point();
+        point->position = read_vector();
+        element = point;
+        break;
+      }
+      case LINE: {
+        Line* line = new Line();
+        line->from = read_vector(); line->to = read_vector();
+        element = line;
+        break;
+      }
+      case POLYLINE: {
+        Polyline* polyline = new Polyline();
+        read_points( polyline->points );
+        element = polyline;
+        break;
+      }
+      case RECT: {
+        Rect* rect = new Rect();
+        rect->position = read_vector(); rect->dimension = read_vector();
+        element = rect;
+        break;
+      }
+      case POLYGON: {
+        Polygon* polygon = new Polygon();
+        read_points( polygon->points ); read_points( polygon->triangles );
+        element = polygon;
+        break;
+      }
+      case ELLIPSE: {
+        Ellipse* ellipse = new Ellipse();
+        ellipse->center = read_vector(); ellipse->radius = read_vector();
+        element = ellipse;
+        break;
+      }
+      case IMAGE: {
+        Image* image = new Image();
+        image->position = read_vector(); image->dimension = read_vector();
+        read_image_texture( image );
+        element = image;
+        break;
+      }
+      case GROUP: {
+        Group* group = new Group();
+        element = group;
+        group->opacity = read<float>();
+        int32_t op = read<int32_t>();
+        if ( op < COMP_SRC_OVER || op > COMP_PLUS ) ok = false;
+        else group->comp_op = (CompositeOp) op;
+        uint64_t n = read_count( 1 );
+        for ( uint64_t i = 0; i < n && ok; i++ ) {
+          SVGElement* child = read_element();
+          if ( child ) group->elements.push_back( child );
+        }
+        break;
+      }
+      case USE: {
+        Use* use = new Use();
+        uses.push_back( make_pair( use, read<int32_t>() ) );
+        use->overrides = read<int32_t>();
+        element = use;
+        break;
+      }
+      case PATH: {
+        Path* path = new Path();
+        path->commands.resize( read_count( 1 ) );
+        if ( !path->commands.empty() ) {
+          read_bytes( &path->commands[0], path->commands.size() );
+        }
+        read_points( path->points );
+        path->evenodd = read<uint8_t>() != 0;
+        element = path;
+        break;
+      }
+      default:
+        ok = false;
+        return NULL;
+    }
+
+    element->style = style;
+    element->transform = transform;
+    if ( fill >= 0 && fill < (int32_t) gradients.size() ) {
+      svg->fill_gradients[ element ] = gradients[ fill ];
+    }
+    if ( styles ) svg->symbol_styles[ element ] = styles;
+    return element;
+  }
+
+ private:
+
+  SVG* svg;
+
+}; // class CacheReader
+
+// writes a document with its header, false if a write failed
+static bool write_document( FILE* file, uint64_t key, const SVG* svg ) {
+
+  setvbuf( file, NULL, _IOFBF, 1 << 20 );
+
+  CacheWriter out ( svg, file );
+  out.write_bytes( CACHE_MAGIC, 8 );
+  out.write( CACHE_VERSION );
+  out.write( key );
+  out.write( svg->width );
+  out.write( svg->height );
+
+  out.write( (uint64_t) svg->gradients.size() );
+  map<string, Gradient*>::const_iterator g;
+  for ( g = svg->gradients.begin(); g != svg->gradients.end(); ++g ) {
+    out.write( g->first );
+    out.write( *g->second );
+  }
+
+  out.write( (uint64_t) svg->symbols.size() );
+  map<string, SVGElement*>::const_iterator s;
+  for ( s = svg->symbols.begin(); s != svg->symbols.end(); ++s ) {
+    out.write( s->first );
+    out.write_element( s->second );
+  }
+
+  out.write( (uint64_t) svg->elements.size() );
+  for ( size_t i = 0; i < svg->elements.size(); i++ ) {
+    out.write_element( svg->elements[i] );
+  }
+
+  return out.ok && fflush( file ) == 0;
+}
+
+} // namespace
+
+
+// SVG Cache //
+
+uint64_t SVGCache::hash( const void* data, size_t size ) {
+
+  // FNV-1a over 64 bit words, then the remaining bytes
+  const uint64_t prime = 1099511628211ULL;
+  uint64_t h = 14695981039346656037ULL ^ size;
+
+  const unsigned char* p = (const unsigned char*) data;
+  size_t words = size / 8;
+  for ( size_t i = 0; i < words; i++, p += 8 ) {
+    uint64_t w; memcpy( &w, p, 8 );
+    h = ( h ^ w ) * prime;
+    h ^= h >> 29;
+  }
+  for ( size_t i = words * 8; i < size; i++, p++ ) {
+    h = ( h ^ *p ) * prime;
+  }
+
+  // 0 is reserved for "no key"
+  return h ? h : 1;
+}
+
+uint64_t SVGCache::hash_file( const char* filename ) {
+  MappedFile file ( filename );
+  if ( !file.is_open() ) return 0;
+  return hash( file.data, file.size );
+}
+
+string SVGCache::path( uint64_t key ) {
+
+  const char* env = getenv( "DRAWSVG_CACHE" );
+  string dir = env ? env : ".drawsvg_cache";
+  if ( dir.empty() ) return "";
+
+#ifdef _WIN32
+  _mkdir( dir.c_str() );
+#else
+  mkdir( dir.c_str(), 0755 );
+#endif
+
+  char name[32];
+  snprintf( name, sizeof(name), "/%016llx.svgc", (unsigned long long) key );
+  return dir + name;
+}
+
+int SVGCache::load( uint64_t key, SVG* svg ) {
+
+  string filename = path( key );
+  if ( filename.empty() ) return -1;
+
+  MappedFile file ( filename.c_str() );
+  if ( !file.is_open() ) return -1;
+
+  CacheReader in ( file.data, file.size, svg );
+
+  char magic[8];
+  in.read_bytes( magic, 8 );
+  if ( !in.ok || memcmp( magic, CACHE_MAGIC, 8 ) ||
+       in.read<uint32_t>() != CACHE_VERSION ||
+       in.read<uint64_t>() != key ) {
+    return -1;
+  }
+
+  svg->width  = in.read<float>();
+  svg->height = in.read<float>();
+
+  // gradients
+  uint64_t n = in.read_count( 1 );
+  for ( uint64_t i = 0; i < n && in.ok; i++ ) {
+    string id = in.read_string();
+    Gradient* gradient = in.read_gradient();
+    Gradient*& entry = svg->gradients[ id ];
+    if ( entry ) {
+      // ids are unique in a valid cache
+      delete gradient;
+      in.ok = false;
+    } else {
+      entry = gradient;
+      in.gradients.push_back( gradient );
+    }
+  }
+
+  // symbols, uses are linked once they are all read
+  n = in.read_count( 1 );
+  for ( uint64_t i = 0; i < n && in.ok; i++ ) {
+    string id = in.read_string();
+    SVGElement*& entry = svg->symbols[ id ];
+    entry = in.read_element();
+    in.symbol_slots.push_back( &entry );
+  }
+
+  n = in.read_count( 1 );
+  for ( uint64_t i = 0; i < n && in.ok; i++ ) {
+    SVGElement* element = in.read_element();
+    if ( element ) svg->elements.push_back( element );
+  }
+
+  for ( size_t i = 0; i < in.uses.size(); i++ ) {
+    int index = in.uses[i].second;
+    if ( index >= 0 && index < (int) in.symbol_slots.size() ) {
+      in.uses[i].first->symbol = *in.symbol_slots[ index ];
+    }
+  }
+
+  if ( !in.ok || in.p != in.end ) {
+    cerr << "Ignoring corrupt cache file " << filename << endl;
+    return -1;
+  }
+  return 0;
+}
+
+int SVGCache::save( uint64_t key, const SVG* svg ) {
+
+  string filename = path( key );
+  if ( filename.empty() ) return -1;
+
+  // write to a temporary file so readers never see a partial cache
+  string temp = filename + ".tmp";
+  FILE* file = fopen( temp.c_str(), "wb" );
+  if ( !file ) return -1;
+
+  bool ok = write_document( file, key, svg );
+  if ( fclose( file ) != 0 ) ok = false;
+  if ( !ok ) {
+    remove( temp.c_str() );
+    return -1;
+  }
+
+  remove( filename.c_str() );
+  return rename( temp.c_str(), filename.c_str() );
+}
+
+bool SVGCache::equal( const SVG* a, const SVG* b ) {
+
+  FILE* fa = tmpfile();
+  FILE* fb = tmpfile();
+  bool same = fa && fb && write_document( fa, 0, a ) && write_document( fb, 0, b );
+
+  // compare the serialized documents
+  if ( same ) {
+    rewind( fa ); rewind( fb );
+    char ba[1 << 16], bb[1 << 16];
+    while ( same ) {
+      size_t na = fread( ba, 1, sizeof(ba), fa );
+      size_t nb = fread( bb, 1, sizeof(bb), fb );
+      same = na == nb && !memcmp( ba, bb, na );
+      if ( na < sizeof(ba) ) break;
+    }
+  }
+
+  if ( fa ) fclose( fa );
+  if ( fb ) fclose( fb );
+  return same;
+}
+
+} // namespace CMU462
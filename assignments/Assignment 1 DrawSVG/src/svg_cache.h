@@ -0,0 +1,77 @@
+#ifndef CMU462_SVG_CACHE_H
+#define CMU462_SVG_CACHE_H
+
+#include <stdint.h>
+#include <string>
+
+#include "svg.h"
+
+namespace CMU462 {
+
+/**
+ * A read only view of a whole file, memory mapped where possible.
+ */
+class MappedFile {
+ public:
+
+  MappedFile( const char* filename );
+  ~MappedFile();
+
+  inline bool is_open() const { return data != NULL; }
+
+  const unsigned char* data;
+  size_t size;
+
+ private:
+
+  void* handle;
+  std::string buffer;
+
+  // not copyable
+  MappedFile( const MappedFile& );
+  MappedFile& operator=( const MappedFile& );
+
+}; // class MappedFile
+
+/**
+ * Binary cache of parsed documents. A cached document stores its elements
+ * and transformations, symbols and gradients, polygon triangulations and
+ * image mip pyramids, so opening it again only copies data out of the
+ * memory mapped cache file instead of parsing XML, decoding images,
+ * generating mip levels and triangulating polygons.
+ *
+ * Cache files are named by the hash of the source file contents and live
+ * in the directory given by the DRAWSVG_CACHE environment variable, or in
+ * .drawsvg_cache by default. Setting DRAWSVG_CACHE to an empty string
+ * disables the cache.
+ */
+class SVGCache {
+ public:
+
+  // hash of a block of memory
+  static uint64_t hash( const void* data, size_t size );
+
+  // hash of the contents of a file, 0 if it can not be read
+  static uint64_t hash_file( const char* filename );
+
+  // loads the document cached for the key into an empty svg, returns 0
+  // on success. The svg may be partially filled if loading fails
+  static int load( uint64_t key, SVG* svg );
+
+  // caches a document under the key, returns 0 on success
+  static int save( uint64_t key, const SVG* svg );
+
+  // true if two documents hold the same elements, symbols and gradients,
+  // compared through their cached form
+  static bool equal( const SVG* a, const SVG* b );
+
+ private:
+
+  // cache file of a key, empty if caching is disabled
+  static std::string path( uint64_t key );
+
+}; // class SVGCache
+
+} // namespace CMU462
+
+#endif // CMU462_SVG_CACHE_H
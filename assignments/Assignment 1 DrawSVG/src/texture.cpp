@@ -1,14 +1,357 @@
 #include "texture.h"
 #include "color.h"
+#include "png.h"
 
 #include <assert.h>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <algorithm>
+#include <mutex>
 
 using namespace std;
 
 namespace CMU462 {
 
+// cached textures, entries of freed textures are swept as the map grows
+static mutex& texture_cache_lock() {
+  static mutex lock;
+  return lock;
+}
+
+static map<uint64_t, weak_ptr<Texture> >& texture_cache() {
+  static map<uint64_t, weak_ptr<Texture> > textures;
+  return textures;
+}
+
+shared_ptr<Texture> TextureCache::find( uint64_t key ) {
+  lock_guard<mutex> guard( texture_cache_lock() );
+  map<uint64_t, weak_ptr<Texture> >& textures = texture_cache();
+  map<uint64_t, weak_ptr<Texture> >::iterator it = textures.find( key );
+  return it == textures.end() ? shared_ptr<Texture>() : it->second.lock();
+}
+
+shared_ptr<Texture> TextureCache::insert( uint64_t key,
+                                          shared_ptr<Texture> tex ) {
+  lock_guard<mutex> guard( texture_cache_lock() );
+  map<uint64_t, weak_ptr<Texture> >& textures = texture_cache();
+
+  static size_t sweep_size = 64;
+  if ( textures.size() >= sweep_size ) {
+    map<uint64_t, weak_ptr<Texture> >::iterator it = textures.begin();
+    while ( it != textures.end() ) {
+      if ( it->second.expired() ) textures.erase( it++ ); else ++it;
+    }
+    sweep_size = max( (size_t) 64, 2 * textures.size() );
+  }
+
+  weak_ptr<Texture>& entry = textures[key];
+  shared_ptr<Texture> cached = entry.lock();
+  if ( cached ) return cached;
+  entry = tex;
+  return tex;
+}
+
+// Block compression //
+
+static inline size_t blocks( size_t n ) { return ( n + 3 ) / 4; }
+
+static inline uint16_t pack_565( const int rgb[3] ) {
+  return (uint16_t) ( ( rgb[0] * 31 + 127 ) / 255 << 11 |
+                      ( rgb[1] * 63 + 127 ) / 255 << 5  |
+                      ( rgb[2] * 31 + 127 ) / 255 );
+}
+
+static inline void unpack_565( uint16_t c, int rgb[3] ) {
+  int r = ( c >> 11 ) & 31, g = ( c >> 5 ) & 63, b = c & 31;
+  rgb[0] = r << 3 | r >> 2;
+  rgb[1] = g << 2 | g >> 4;
+  rgb[2] = b << 3 | b >> 2;
+}
+
+// texel i of a BC1 color block, the color blocks of BC3 always use the
+// four color mode
+static void decode_color( const unsigned char* block, int i,
+                          bool four_color, unsigned char rgba[4] ) {
+  uint16_t c0 = block[0] | block[1] << 8;
+  uint16_t c1 = block[2] | block[3] << 8;
+  int index = ( block[4 + i / 4] >> ( 2 * ( i % 4 ) ) ) & 3;
+  four_color = four_color || c0 > c1;
+
+  int a[3], b[3];
+  unpack_565( c0, a );
+  unpack_565( c1, b );
+  rgba[3] = 255;
+  for ( int c = 0; c < 3; c++ ) {
+    switch ( index ) {
+      case 0: rgba[c] = a[c]; break;
+      case 1: rgba[c] = b[c]; break;
+      case 2: rgba[c] = four_color ? ( 2 * a[c] + b[c] ) / 3
+                                   : ( a[c] + b[c] ) / 2; break;
+      case 3: rgba[c] = four_color ? ( a[c] + 2 * b[c] ) / 3 : 0; break;
+    }
+  }
+  if ( index == 3 && !four_color ) rgba[3] = 0;
+}
+
+// alpha of texel i of a BC3 alpha block
+static unsigned char decode_alpha( const unsigned char* block, int i ) {
+  int a0 = block[0], a1 = block[1];
+  uint64_t bits = 0;
+  for ( int k = 0; k < 6; k++ ) bits |= (uint64_t) block[2 + k] << ( 8 * k );
+  int index = ( bits >> ( 3 * i ) ) & 7;
+
+  if ( index == 0 ) return a0;
+  if ( index == 1 ) return a1;
+  if ( a0 > a1 ) return ( ( 8 - index ) * a0 + ( index - 1 ) * a1 ) / 7;
+  if ( index == 6 ) return 0;
+  if ( index == 7 ) return 255;
+  return ( ( 6 - index ) * a0 + ( index - 1 ) * a1 ) / 5;
+}
+
+// encodes the colors of 4x4 texels as a four color BC1 block, the end
+// points are the corners of the slightly inset bounding box of the colors
+static void encode_color( const unsigned char texels[16][4],
+                          unsigned char* block ) {
+  int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+  for ( int i = 0; i < 16; i++ ) {
+    for ( int c = 0; c < 3; c++ ) {
+      lo[c] = min( lo[c], (int) texels[i][c] );
+      hi[c] = max( hi[c], (int) texels[i][c] );
+    }
+  }
+  for ( int c = 0; c < 3; c++ ) {
+    int inset = ( hi[c] - lo[c] ) / 16;
+    lo[c] += inset; hi[c] -= inset;
+  }
+
+  // packing is monotonic in every channel so c0 >= c1, equal end points
+  // select the three color mode where index 0 is still c0
+  uint16_t c0 = pack_565( hi ), c1 = pack_565( lo );
+  uint32_t indices = 0;
+  if ( c0 != c1 ) {
+    int palette[4][3];
+    unpack_565( c0, palette[0] );
+    unpack_565( c1, palette[1] );
+    for ( int c = 0; c < 3; c++ ) {
+      palette[2][c] = ( 2 * palette[0][c] + palette[1][c] ) / 3;
+      palette[3][c] = ( palette[0][c] + 2 * palette[1][c] ) / 3;
+    }
+    for ( int i = 0; i < 16; i++ ) {
+      int best = 0, best_error = INT_MAX;
+      for ( int k = 0; k < 4; k++ ) {
+        int error = 0;
+        for ( int c = 0; c < 3; c++ ) {
+          int d = texels[i][c] - palette[k][c];
+          error += d * d;
+        }
+        if ( error < best_error ) { best = k; best_error = error; }
+      }
+      indices |= (uint32_t) best << ( 2 * i );
+    }
+  }
+
+  block[0] = c0 & 0xff; block[1] = c0 >> 8;
+  block[2] = c1 & 0xff; block[3] = c1 >> 8;
+  for ( int k = 0; k < 4; k++ ) block[4 + k] = ( indices >> ( 8 * k ) ) & 0xff;
+}
+
+// encodes the alpha of 4x4 texels as an eight value BC3 alpha block
+static void encode_alpha( const unsigned char texels[16][4],
+                          unsigned char* block ) {
+  int lo = 255, hi = 0;
+  for ( int i = 0; i < 16; i++ ) {
+    lo = min( lo, (int) texels[i][3] );
+    hi = max( hi, (int) texels[i][3] );
+  }
+
+  uint64_t bits = 0;
+  if ( hi > lo ) {
+    for ( int i = 0; i < 16; i++ ) {
+      int best = 0, best_error = INT_MAX;
+      for ( int k = 0; k < 8; k++ ) {
+        int value = k == 0 ? hi : k == 1 ? lo
+                  : ( ( 8 - k ) * hi + ( k - 1 ) * lo ) / 7;
+        int error = abs( texels[i][3] - value );
+        if ( error < best_error ) { best = k; best_error = error; }
+      }
+      bits |= (uint64_t) best << ( 3 * i );
+    }
+  }
+
+  block[0] = hi; block[1] = lo;
+  for ( int k = 0; k < 6; k++ ) block[2 + k] = ( bits >> ( 8 * k ) ) & 0xff;
+}
+
+static void compress_level( MipLevel& level, TexelFormat format ) {
+  size_t bw = blocks( level.width ), bh = blocks( level.height );
+  size_t block_size = TextureCompression::block_size( format );
+  vector<unsigned char> out ( bw * bh * block_size );
+
+  unsigned char texels[16][4];
+  for ( size_t by = 0; by < bh; by++ ) {
+    for ( size_t bx = 0; bx < bw; bx++ ) {
+
+      // edge blocks repeat the last row and column
+      for ( int i = 0; i < 16; i++ ) {
+        size_t x = min( 4 * bx + i % 4, level.width  - 1 );
+        size_t y = min( 4 * by + i / 4, level.height - 1 );
+        memcpy( texels[i], &level.texels[4 * ( x + y * level.width )], 4 );
+      }
+
+      unsigned char* block = &out[( bx + by * bw ) * block_size];
+      if ( format == TEXELS_BC3 ) {
+        encode_alpha( texels, block );
+        block += 8;
+      }
+      encode_color( texels, block );
+    }
+  }
+
+  level.texels.swap( out );
+}
+
+void TextureCompression::compress( Texture& tex ) {
+  if ( tex.mipmap.empty() || tex.format != TEXELS_RGBA8 ) return;
+
+  const vector<unsigned char>& texels = tex.mipmap[0].texels;
+  TexelFormat target = TEXELS_BC1;
+  for ( size_t i = 3; i < texels.size(); i += 4 ) {
+    if ( texels[i] != 255 ) { target = TEXELS_BC3; break; }
+  }
+
+  tex.format = target;
+  for ( size_t i = 0; i < tex.mipmap.size(); i++ ) {
+    if ( format( tex, i ) == target ) compress_level( tex.mipmap[i], target );
+  }
+}
+
+void TextureCompression::decompress( Texture& tex ) {
+  for ( size_t i = 0; i < tex.mipmap.size(); i++ ) {
+    decompress( tex.mipmap[i], format( tex, i ) );
+  }
+  tex.format = TEXELS_RGBA8;
+}
+
+void TextureCompression::decompress( MipLevel& level, TexelFormat format ) {
+  if ( format == TEXELS_RGBA8 ) return;
+
+  vector<unsigned char> out ( 4 * level.width * level.height );
+  for ( size_t y = 0; y < level.height; y++ ) {
+    for ( size_t x = 0; x < level.width; x++ ) {
+      fetch( level, format, x, y, &out[4 * ( x + y * level.width )] );
+    }
+  }
+  level.texels.swap( out );
+}
+
+void TextureCompression::restore( Texture& tex ) {
+  if ( tex.format != TEXELS_RGBA8 && !tex.source.empty() ) {
+    PNG png;
+    if ( !PNGParser::load( &tex.source[0], tex.source.size(), png ) &&
+         png.width == (int) tex.width && png.height == (int) tex.height ) {
+      tex.mipmap.resize( 1 );
+      tex.mipmap[0].width  = png.width;
+      tex.mipmap[0].height = png.height;
+      tex.mipmap[0].texels.swap( png.pixels );
+      tex.format = TEXELS_RGBA8;
+      return;
+    }
+  }
+
+  if ( tex.mipmap.size() > 1 ) tex.mipmap.resize( 1 );
+  decompress( tex );
+}
+
+void TextureCompression::fetch( const MipLevel& level, TexelFormat format,
+                                int x, int y, unsigned char rgba[4] ) {
+  x = max( 0, min( x, (int) level.width  - 1 ) );
+  y = max( 0, min( y, (int) level.height - 1 ) );
+
+  if ( format == TEXELS_RGBA8 ) {
+    memcpy( rgba, &level.texels[4 * ( x + y * level.width )], 4 );
+    return;
+  }
+
+  size_t block = ( x >> 2 ) + ( y >> 2 ) * blocks( level.width );
+  int i = ( y & 3 ) * 4 + ( x & 3 );
+  if ( format == TEXELS_BC1 ) {
+    decode_color( &level.texels[8 * block], i, false, rgba );
+  } else {
+    const unsigned char* data = &level.texels[16 * block];
+    decode_color( data + 8, i, true, rgba );
+    rgba[3] = decode_alpha( data, i );
+  }
+}
+
+void TextureCompression::decode_block( const unsigned char* block,
+                                       TexelFormat format,
+                                       unsigned char texels[16][4] ) {
+
+  // the palettes are decoded once and indexed by every texel, the same
+  // values as decode_color and decode_alpha give
+  const unsigned char* color = format == TEXELS_BC3 ? block + 8 : block;
+  uint16_t c0 = color[0] | color[1] << 8;
+  uint16_t c1 = color[2] | color[3] << 8;
+  bool four_color = format == TEXELS_BC3 || c0 > c1;
+
+  int a[3], b[3];
+  unpack_565( c0, a );
+  unpack_565( c1, b );
+  unsigned char palette[4][4];
+  for ( int c = 0; c < 3; c++ ) {
+    palette[0][c] = a[c];
+    palette[1][c] = b[c];
+    palette[2][c] = four_color ? ( 2 * a[c] + b[c] ) / 3 : ( a[c] + b[c] ) / 2;
+    palette[3][c] = four_color ? ( a[c] + 2 * b[c] ) / 3 : 0;
+  }
+  palette[0][3] = palette[1][3] = palette[2][3] = 255;
+  palette[3][3] = four_color ? 255 : 0;
+
+  uint32_t indices = color[4] | color[5] << 8 | color[6] << 16 |
+                     (uint32_t) color[7] << 24;
+  for ( int i = 0; i < 16; i++ ) {
+    memcpy( texels[i], palette[( indices >> ( 2 * i ) ) & 3], 4 );
+  }
+  if ( format != TEXELS_BC3 ) return;
+
+  int a0 = block[0], a1 = block[1];
+  unsigned char alpha[8] = { (unsigned char) a0, (unsigned char) a1 };
+  for ( int k = 2; k < 8; k++ ) {
+    if ( a0 > a1 ) alpha[k] = ( ( 8 - k ) * a0 + ( k - 1 ) * a1 ) / 7;
+    else alpha[k] = k == 6 ? 0 : k == 7 ? 255
+                  : ( ( 6 - k ) * a0 + ( k - 1 ) * a1 ) / 5;
+  }
+  uint64_t bits = 0;
+  for ( int k = 0; k < 6; k++ ) bits |= (uint64_t) block[2 + k] << ( 8 * k );
+  for ( int i = 0; i < 16; i++ ) texels[i][3] = alpha[( bits >> ( 3 * i ) ) & 7];
+}
+
+void Sampler2DImp::fetch( const MipLevel& mip, int level, TexelFormat format,
+                          int x, int y, unsigned char rgba[4] ) {
+  if ( format == TEXELS_RGBA8 ) {
+    TextureCompression::fetch( mip, format, x, y, rgba );
+    return;
+  }
+
+  x = max( 0, min( x, (int) mip.width  - 1 ) );
+  y = max( 0, min( y, (int) mip.height - 1 ) );
+  size_t bw = blocks( mip.width ), bx = x >> 2, by = y >> 2;
+  const unsigned char* data = &mip.texels[TextureCompression::block_size( format ) *
+                                          ( bx + by * bw )];
+
+  // a block goes in slot bx of the row of its parity, new slots are empty
+  vector<DecodedBlock>& slots = decoded[level & 1];
+  if ( slots.size() < 2 * bw ) slots.resize( 2 * bw );
+  DecodedBlock& block = slots[bx + ( by & 1 ) * bw];
+  if ( block.data != data ) {
+    TextureCompression::decode_block( data, format, block.texels );
+    block.data = data;
+  }
+  memcpy( rgba, block.texels[( y & 3 ) * 4 + ( x & 3 )], 4 );
+}
+
 inline void uint8_to_float( float dst[4], unsigned char* src ) {
   uint8_t* src_uint8 = (uint8_t *)src;
   dst[0] = src_uint8[0] / 255.f;
@@ -35,6 +378,9 @@ void Sampler2DImp::generate_mips(Texture& tex, int startLevel) {
 
   // Task 7: Implement this
 
+  // levels are about to change, forget their decoded blocks
+  clear_blocks();
+
   // check start level
   if ( startLevel >= tex.mipmap.size() ) {
     std::cerr << "Invalid start level"; 
@@ -95,8 +441,8 @@ Color Sampler2DImp::sample_nearest(Texture& tex,
   // Task 6: Implement nearest neighbour interpolation
 	//Image pixels correspond to samples at half-integer coordinates in texture space
 	int tx = floor(u * tex.mipmap[level].width), ty = floor(v * tex.mipmap[level].height);
-	int pos = 4 * (tx + ty * tex.mipmap[level].width);
-	unsigned char uint8_color[4] = { tex.mipmap[level].texels[pos], tex.mipmap[level].texels[pos + 1], tex.mipmap[level].texels[pos + 2], tex.mipmap[level].texels[pos + 3] };
+	unsigned char uint8_color[4];
+	fetch(tex.mipmap[level], level, TextureCompression::format(tex, level), tx, ty, uint8_color);
 	float float_color[4];
 	uint8_to_float(float_color, uint8_color);
 	Color color(float_color[0], float_color[1], float_color[2], float_color[3]);
@@ -112,7 +458,7 @@ Color Sampler2DImp::sample_bilinear(Texture& tex,
 	float float_color[4];
 	float tx = u * tex.mipmap[level].width, ty = v * tex.mipmap[level].height;
 	MipLevel& mip = tex.mipmap[level];
-	std::vector<unsigned char>& texels = mip.texels;
+	TexelFormat format = TextureCompression::format(tex, level);
 
 	//Image pixels correspond to samples at half-integer coordinates in texture space
 	float x1 = roundf(tx) - 0.5, x2 = roundf(tx) + 0.5;
@@ -124,23 +470,23 @@ Color Sampler2DImp::sample_bilinear(Texture& tex,
 	float sy1 = y1 < 0.5 ? 0.5 : y1;
 	float sy2 = y2 > mip.height + 0.5 ? mip.height + 0.5 : y2;
 
-	int pos = 4 * (floor(sx1) + floor(sy1) * mip.width);
-	unsigned char uint8_color11[4] = { texels[pos], texels[pos+1], texels[pos+2], texels[pos+3] };
+	unsigned char uint8_color11[4];
+	fetch(mip, level, format, floor(sx1), floor(sy1), uint8_color11);
 	uint8_to_float(float_color, uint8_color11);
 	Color f11(float_color[0], float_color[1], float_color[2], float_color[3]);
 
-	pos = 4 * (floor(sx2) + floor(sy1) * mip.width);
-	unsigned char uint8_color21[4] = { texels[pos], texels[pos+1], texels[pos+2], texels[pos+3] };
+	unsigned char uint8_color21[4];
+	fetch(mip, level, format, floor(sx2), floor(sy1), uint8_color21);
 	uint8_to_float(float_color, uint8_color21);
 	Color f21(float_color[0], float_color[1], float_color[2], float_color[3]);
 
-	pos = 4 * (floor(sx1) + floor(sy2) * mip.width);
-	unsigned char uint8_color12[4] = { texels[pos], texels[pos+1], texels[pos+2], texels[pos+3] };
+	unsigned char uint8_color12[4];
+	fetch(mip, level, format, floor(sx1), floor(sy2), uint8_color12);
 	uint8_to_float(float_color, uint8_color12);
 	Color f12(float_color[0], float_color[1], float_color[2], float_color[3]);
 
-	pos = 4 * (floor(sx2) + floor(sy2) * mip.width);
-	unsigned char uint8_color22[4] = { texels[pos], texels[pos+1], texels[pos+2], texels[pos+3] };
+	unsigned char uint8_color22[4];
+	fetch(mip, level, format, floor(sx2), floor(sy2), uint8_color22);
 	uint8_to_float(float_color, uint8_color22);
 	Color f22(float_color[0], float_color[1], float_color[2], float_color[3]);
 
@@ -158,9 +504,8 @@ Color Sampler2DImp::sample_trilinear(Texture& tex,
   // Task 7: Implement trilinear filtering
 	float L = sqrt(u_scale * u_scale + v_scale * v_scale);
 	float d = log2f(L)>=0? log2f(L):0;
-	Sampler2DImp sampler_bilinear(BILINEAR);
-	Color color1 = sampler_bilinear.sample_bilinear(tex, u, v, floor(d));
-	Color color2 = sampler_bilinear.sample_bilinear(tex, u, v, floor(d)+1);
+	Color color1 = sample_bilinear(tex, u, v, floor(d));
+	Color color2 = sample_bilinear(tex, u, v, floor(d)+1);
 
 	return color1 * (floor(d) + 1 - d) + color2 * (d - floor(d));
 
@@ -1,7 +1,10 @@
 #ifndef CMU462_TEXTURE_H
 #define CMU462_TEXTURE_H
 
+#include <map>
+#include <memory>
 #include <vector>
+#include <stdint.h>
 #include "CMU462.h"
 
 namespace CMU462 {
@@ -14,6 +17,12 @@ typedef enum SampleMethod{
   TRILINEAR
 } SampleMethod;
 
+typedef enum TexelFormat {
+  TEXELS_RGBA8, // 4 bytes per texel
+  TEXELS_BC1,   // 8 bytes per 4x4 block, opaque texels
+  TEXELS_BC3    // 16 bytes per 4x4 block, texels with alpha
+} TexelFormat;
+
 struct MipLevel {
   size_t width; 
   size_t height;
@@ -21,11 +30,87 @@ struct MipLevel {
 };
 
 struct Texture {
+
+  Texture() : width ( 0 ), height ( 0 ), format ( TEXELS_RGBA8 ) { }
+
   size_t width;
   size_t height;
   std::vector<MipLevel> mipmap;
+
+  // The prebuilt reference library stores MipLevels in vectors itself, so
+  // the compression state lives here rather than in MipLevel.
+
+  // format of the levels of 4x4 texels or more, smaller levels are RGBA8
+  TexelFormat format;
+
+  // encoded image of a texture large enough to be compressed, its mips
+  // are generated again from the image rather than from a lossy level 0
+  std::vector<unsigned char> source;
+
 };
 
+/**
+ * Block compressed texel storage for large textures. Levels of at least
+ * 4x4 texels are stored as 4x4 blocks in the BC1 (DXT1) or BC3 (DXT5)
+ * layout, which cuts their size by 8x or 4x.
+ */
+class TextureCompression {
+ public:
+
+  // textures with at least this many texels at level 0 are compressed
+  static const size_t kMinTexels = 2048 * 2048;
+
+  // format of the given level of a texture
+  static inline TexelFormat format( const Texture& tex, size_t level ) {
+    const MipLevel& mip = tex.mipmap[level];
+    return mip.width >= 4 && mip.height >= 4 ? tex.format : TEXELS_RGBA8;
+  }
+
+  // bytes per 4x4 block of a compressed format
+  static inline size_t block_size( TexelFormat format ) {
+    return format == TEXELS_BC1 ? 8 : 16;
+  }
+
+  // compresses every level of 4x4 texels or more, BC1 if the texture is
+  // opaque and BC3 otherwise
+  static void compress( Texture& tex );
+
+  // restores RGBA8 texels
+  static void decompress( Texture& tex );
+  static void decompress( MipLevel& level, TexelFormat format );
+
+  // leaves only an RGBA8 level 0, decoded from the source image of a
+  // compressed texture if it has one
+  static void restore( Texture& tex );
+
+  // RGBA8 texel of a level in the given format, coordinates are clamped
+  static void fetch( const MipLevel& level, TexelFormat format, int x, int y,
+                     unsigned char rgba[4] );
+
+  // RGBA8 texels of a block of a compressed format, in rows
+  static void decode_block( const unsigned char* block, TexelFormat format,
+                            unsigned char texels[16][4] );
+
+}; // class TextureCompression
+
+/**
+ * Process wide cache of decoded textures, keyed by a hash of their encoded
+ * data. Every image with the same data, in any open document, shares one
+ * texture (and its mip levels), which is freed with the last image using it.
+ */
+class TextureCache {
+ public:
+
+  // texture cached under the key, NULL if there is none
+  static std::shared_ptr<Texture> find( uint64_t key );
+
+  // caches a texture under the key, returns the texture already cached
+  // for the key if there is one and the given texture otherwise
+  static std::shared_ptr<Texture> insert( uint64_t key,
+                                          std::shared_ptr<Texture> tex );
+
+}; // class TextureCache
+
 class Sampler2D {
  public:
 
@@ -75,6 +160,26 @@ class Sampler2DImp : public Sampler2D {
   Color sample_trilinear(Texture& tex, 
                          float u, float v, 
                          float u_scale, float v_scale);
+
+ private:
+
+  // texel of a level in the given format, coordinates are clamped
+  void fetch( const MipLevel& mip, int level, TexelFormat format,
+              int x, int y, unsigned char rgba[4] );
+
+  // Compressed blocks decoded while sampling. Images are sampled row by
+  // row, so two rows of blocks are kept for the levels of either parity
+  // and a block is decoded about once per pass over its texels.
+  struct DecodedBlock {
+    const unsigned char* data;
+    unsigned char texels[16][4];
+  };
+  std::vector<DecodedBlock> decoded[2];
+
+  inline void clear_blocks() {
+    decoded[0].clear();
+    decoded[1].clear();
+  }
   
 }; // class sampler2DImp
 
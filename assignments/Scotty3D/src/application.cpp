@@ -38,7 +38,9 @@ Application::Application(AppConfig config) {
       new PathTracer(config.pathtracer_ns_aa, config.pathtracer_max_ray_depth,
                      config.pathtracer_ns_area_light, config.pathtracer_ns_diff,
                      config.pathtracer_ns_glsy, config.pathtracer_ns_refr,
-                     config.pathtracer_num_threads, config.pathtracer_envmap);
+                     config.pathtracer_num_threads, config.pathtracer_envmap,
+                     config.pathtracer_wavefront, config.pathtracer_split_budget,
+                     config.pathtracer_bvh_cache);
 
   timestep = 0.1;
   damping_factor = 0.0;
@@ -1867,8 +1869,8 @@ void Application::raytrace_video() {
         return;
       }
       pathtracer->stop();
-      pathtracer->clear();
-      set_up_pathtracer();
+      pathtracer->update_scene(
+          scene->get_transformed_static_scene(timeline.getCurrentFrame()));
       pathtracer->start_raytracing();
     }
   } else {
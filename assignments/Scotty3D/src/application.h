@@ -53,6 +53,9 @@ struct AppConfig {
     pathtracer_ns_refr = 1;
 
     pathtracer_num_threads = 1;
+    pathtracer_wavefront = false;
+    pathtracer_split_budget = 0;
+    pathtracer_bvh_cache = "";
     pathtracer_envmap = NULL;
     pathtracer_result_path = "";
   }
@@ -64,6 +67,9 @@ struct AppConfig {
   size_t pathtracer_ns_glsy;
   size_t pathtracer_ns_refr;
   size_t pathtracer_num_threads;
+  bool pathtracer_wavefront;
+  float pathtracer_split_budget;
+  std::string pathtracer_bvh_cache;
   HDRImageBuffer* pathtracer_envmap;
   std::string pathtracer_result_path;
 };
@@ -2,105 +2,1737 @@
 
 #include "CMU462/CMU462.h"
 #include "static_scene/triangle.h"
+#include "GL/glew.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <stack>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
 namespace CMU462 {
 	namespace StaticScene {
 
 
-		BVHAccel::BVHAccel(const std::vector<Primitive*>& _primitives, size_t max_leaf_size)
-			:maxPrimsInNode(max_leaf_size) {
-			this->primitives = _primitives;
+		// The build bins the centroids of a node's primitives into buckets along
+		// each axis and splits between the buckets where the SAH cost is least.
+		// Ranges of more than kChunkSize primitives are binned in chunks and
+		// subtrees of at least kTaskSize primitives are built as OpenMP tasks,
+		// without OpenMP the build runs serially.
+		static const int kBuckets = 12;
+		static const int kChunkSize = 16384;
+		static const int kTaskSize = 4096;
+
+		// Bounds of the primitives of a range and of their centroids
+		struct BVHRangeBounds {
+			BBox bounds;
+			BBox centroidBounds;
+
+			void expand(const BVHRangeBounds& b) {
+				bounds.expand(b.bounds);
+				centroidBounds.expand(b.centroidBounds);
+			}
+		};
+
+		// Primitive counts and bounds of the buckets along each axis
+		struct BVHBins {
+			BVHBins() {
+				for (int dim = 0; dim < 3; dim++)
+					for (int b = 0; b < kBuckets; b++)
+						count[dim][b] = 0;
+			}
+
+			void expand(const BVHBins& bins) {
+				for (int dim = 0; dim < 3; dim++)
+					for (int b = 0; b < kBuckets; b++) {
+						count[dim][b] += bins.count[dim][b];
+						bounds[dim][b].expand(bins.bounds[dim][b]);
+					}
+			}
+
+			int count[3][kBuckets];
+			BBox bounds[3][kBuckets];
+		};
+
+		// Runs body(first, last, partial) over [start, end) and expands result
+		// by the partial results. Large ranges are split into chunks that run
+		// as tasks, each into its own partial result.
+		template <typename T, typename Body>
+		static void reduce_range(int start, int end, T& result, Body body)
+		{
+			int chunks = (end - start + kChunkSize - 1) / kChunkSize;
+			if (chunks <= 1)
+			{
+				body(start, end, result);
+				return;
+			}
+
+			std::vector<T> partial(chunks);
+			for (int c = 0; c < chunks; c++)
+			{
+				#pragma omp task shared(partial)
+				body(start + c * kChunkSize, std::min(end, start + (c + 1) * kChunkSize), partial[c]);
+			}
+			#pragma omp taskwait
+			for (int c = 0; c < chunks; c++)
+			{
+				result.expand(partial[c]);
+			}
+		}
+
+		static inline int bucket(double offset)
+		{
+			int b = kBuckets * offset;
+			return b == kBuckets ? kBuckets - 1 : b;
+		}
+
+		// Finds the axis and bucket to split the range after with the least SAH
+		// cost, which is returned.
+		static float find_split(const BVHPrimitiveInfo* primitiveInfo, int start, int end,
+			const BVHRangeBounds& range, int& dim, int& split)
+		{
+			BVHBins bins;
+			reduce_range(start, end, bins, [=, &range](int first, int last, BVHBins& partial) {
+				for (int i = first; i < last; ++i)
+				{
+					Vector3D offset = range.centroidBounds.Offset(primitiveInfo[i].centroid);
+					for (int d = 0; d < 3; ++d)
+					{
+						int b = bucket(offset[d]);
+						partial.count[d][b]++;
+						partial.bounds[d][b].expand(primitiveInfo[i].bounds);
+					}
+				}
+			});
+
+			// Cost of splitting after each bucket, from a sweep over the buckets
+			// from the left and one from the right
+			float minCost[3];
+			int minCostSplitBucket[3];
+			double area = range.bounds.surface_area();
+			for (int d = 0; d < 3; ++d)
+			{
+				double leftArea[kBuckets - 1];
+				int leftCount[kBuckets - 1];
+				BBox b0;
+				int count0 = 0;
+				for (int i = 0; i < kBuckets - 1; i++)
+				{
+					b0.expand(bins.bounds[d][i]);
+					count0 += bins.count[d][i];
+					leftArea[i] = b0.surface_area();
+					leftCount[i] = count0;
+				}
+
+				float cost[kBuckets - 1];
+				BBox b1;
+				int count1 = 0;
+				for (int i = kBuckets - 1; i > 0; i--)
+				{
+					b1.expand(bins.bounds[d][i]);
+					count1 += bins.count[d][i];
+					cost[i - 1] = .125f + (leftCount[i - 1] * leftArea[i - 1] + count1 * b1.surface_area()) / area;
+				}
+
+				minCost[d] = cost[0];
+				minCostSplitBucket[d] = 0;
+				for (int i = 1; i < kBuckets - 1; i++)
+				{
+					if (cost[i] < minCost[d])
+					{
+						minCost[d] = cost[i];
+						minCostSplitBucket[d] = i;
+					}
+				}
+			}
+
+			if (minCost[0] < minCost[1] && minCost[0] < minCost[2])
+				dim = 0;
+			else if (minCost[1] < minCost[2])
+				dim = 1;
+			else
+				dim = 2;
+			split = minCostSplitBucket[dim];
+			return minCost[dim];
+		}
+
+		BVHNode* BVHAccel::recursiveBuild(BVHPrimitiveInfo* primitiveInfo, int start, int end, int depth)
+		{
+			BVHNode* node = new BVHNode();
+			int nPrimitives = end - start;
+
+			// Compute bounds of all primitives in BVH node and of their centroids
+			BVHRangeBounds range;
+			reduce_range(start, end, range, [=](int first, int last, BVHRangeBounds& partial) {
+				for (int i = first; i < last; ++i)
+				{
+					partial.bounds.expand(primitiveInfo[i].bounds);
+					partial.centroidBounds.expand(primitiveInfo[i].centroid);
+				}
+			});
+
+			int dim, split;
+			if (nPrimitives <= maxPrimsInNode || depth == kMaxDepth ||
+				find_split(primitiveInfo, start, end, range, dim, split) >= nPrimitives)
+			{
+				node->InitLeaf(start, nPrimitives, range.bounds);
+				return node;
+			}
+
+			// Partition primitives at the selected SAH bucket and build children
+			const BBox& centroidBounds = range.centroidBounds;
+			BVHPrimitiveInfo* pmid = std::partition(primitiveInfo + start, primitiveInfo + end,
+				[&](const BVHPrimitiveInfo& pi) {
+					return bucket(centroidBounds.Offset(pi.centroid)[dim]) <= split;
+				});
+			int mid = pmid - primitiveInfo;
+
+			BVHNode* left;
+			BVHNode* right;
+			#pragma omp task shared(left) if(nPrimitives >= kTaskSize)
+			left = recursiveBuild(primitiveInfo, start, mid, depth + 1);
+			right = recursiveBuild(primitiveInfo, mid, end, depth + 1);
+			#pragma omp taskwait
+
+			node->InitInterior(dim, left, right, start, nPrimitives);
+			return node;
+		}
+
+		// Spatial splits are tried where the children of the best object split
+		// overlap by more than this fraction of the root surface area
+		static const double kSplitAlpha = 1e-5;
+
+		struct SpatialBuild {
+			std::vector<const Triangle*> triangles;  ///< triangle of each primitive, null for other primitives
+			std::vector<BVHPrimitiveInfo> ordered;   ///< references of the leaves in order
+			size_t budget;                           ///< references spatial splits may still add
+			double rootArea;                         ///< surface area of the root
+		};
+
+		static BBox intersection(const BBox& a, const BBox& b)
+		{
+			BBox c;
+			c.min = Vector3D(std::max(a.min.x, b.min.x), std::max(a.min.y, b.min.y), std::max(a.min.z, b.min.z));
+			c.max = Vector3D(std::min(a.max.x, b.max.x), std::min(a.max.y, b.max.y), std::min(a.max.z, b.max.z));
+			c.extent = c.max - c.min;
+			return c;
+		}
+
+		// Bounds of the part of a reference between the planes lo and hi along
+		// axis, from the part of its triangle between them if it is one
+		static BBox clip(const BVHPrimitiveInfo& ref, const Triangle* triangle, int axis, double lo, double hi)
+		{
+			BBox slab = ref.bounds;
+			slab.min[axis] = std::max(slab.min[axis], lo);
+			slab.max[axis] = std::min(slab.max[axis], hi);
+			slab.extent = slab.max - slab.min;
+			if (!triangle || slab.empty())
+			{
+				return slab;
+			}
+
+			Vector3D p[3];
+			triangle->get_vertices(p[0], p[1], p[2]);
+			BBox part;
+			for (int i = 0; i < 3; i++)
+			{
+				const Vector3D& a = p[i];
+				const Vector3D& b = p[(i + 1) % 3];
+				if (a[axis] >= lo && a[axis] <= hi)
+				{
+					part.expand(a);
+				}
+				// crossings of the edge with the planes
+				double planes[2] = { lo, hi };
+				for (int j = 0; j < 2; j++)
+				{
+					if ((a[axis] - planes[j]) * (b[axis] - planes[j]) < 0)
+					{
+						Vector3D c = a + (b - a) * ((planes[j] - a[axis]) / (b[axis] - a[axis]));
+						c[axis] = planes[j];
+						part.expand(c);
+					}
+				}
+			}
+			return intersection(part, slab);
+		}
+
+		// Spatial bins along each axis, counting the references that start and
+		// end in each bin and bounding their parts inside it
+		struct SpatialBins {
+			SpatialBins() {
+				for (int dim = 0; dim < 3; dim++)
+					for (int b = 0; b < kBuckets; b++)
+						enter[dim][b] = exit[dim][b] = 0;
+			}
+
+			int enter[3][kBuckets];
+			int exit[3][kBuckets];
+			BBox bounds[3][kBuckets];
+		};
+
+		static inline int spatial_bin(const BBox& bounds, int axis, double x)
+		{
+			double extent = bounds.max[axis] - bounds.min[axis];
+			int b = kBuckets * ((x - bounds.min[axis]) / extent);
+			return std::min(std::max(b, 0), kBuckets - 1);
+		}
+
+		static inline double spatial_plane(const BBox& bounds, int axis, int split)
+		{
+			return bounds.min[axis] + (bounds.max[axis] - bounds.min[axis]) * (split + 1) / kBuckets;
+		}
+
+		BVHNode* BVHAccel::spatialBuild(std::vector<BVHPrimitiveInfo>& refs, SpatialBuild& build, int depth)
+		{
+			BVHNode* node = new BVHNode();
+			int nPrimitives = refs.size();
+
+			BVHRangeBounds range;
+			for (const BVHPrimitiveInfo& ref : refs)
+			{
+				range.bounds.expand(ref.bounds);
+				range.centroidBounds.expand(ref.centroid);
+			}
+
+			if (nPrimitives <= maxPrimsInNode || depth == kMaxDepth)
+			{
+				node->InitLeaf(build.ordered.size(), nPrimitives, range.bounds);
+				build.ordered.insert(build.ordered.end(), refs.begin(), refs.end());
+				return node;
+			}
+
+			// Best object split, and the overlap of its children
+			int dim, split;
+			float objectCost = find_split(refs.data(), 0, nPrimitives, range, dim, split);
+			BBox left, right;
+			for (const BVHPrimitiveInfo& ref : refs)
+			{
+				if (bucket(range.centroidBounds.Offset(ref.centroid)[dim]) <= split)
+					left.expand(ref.bounds);
+				else
+					right.expand(ref.bounds);
+			}
+			BBox overlap = intersection(left, right);
+
+			// Best spatial split, if the object split children overlap and
+			// references may still be added
+			float spatialCost = INFINITY;
+			int spatialDim = 0, spatialSplit = 0;
+			if (build.budget > 0 && !overlap.empty() && overlap.surface_area() > kSplitAlpha * build.rootArea)
+			{
+				SpatialBins bins;
+				for (int d = 0; d < 3; d++)
+				{
+					if (!(range.bounds.max[d] > range.bounds.min[d]))
+					{
+						continue;
+					}
+					for (const BVHPrimitiveInfo& ref : refs)
+					{
+						const Triangle* triangle = build.triangles[ref.primitiveNumber];
+						int first = spatial_bin(range.bounds, d, ref.bounds.min[d]);
+						int last = spatial_bin(range.bounds, d, ref.bounds.max[d]);
+						bins.enter[d][first]++;
+						bins.exit[d][last]++;
+						for (int b = first; b <= last; b++)
+						{
+							double lo = b == 0 ? -INFINITY : spatial_plane(range.bounds, d, b - 1);
+							double hi = b == kBuckets - 1 ? INFINITY : spatial_plane(range.bounds, d, b);
+							bins.bounds[d][b].expand(clip(ref, triangle, d, lo, hi));
+						}
+					}
+
+					double leftArea[kBuckets - 1];
+					int leftCount[kBuckets - 1];
+					BBox b0;
+					int count0 = 0;
+					for (int i = 0; i < kBuckets - 1; i++)
+					{
+						b0.expand(bins.bounds[d][i]);
+						count0 += bins.enter[d][i];
+						leftArea[i] = b0.surface_area();
+						leftCount[i] = count0;
+					}
+					BBox b1;
+					int count1 = 0;
+					for (int i = kBuckets - 1; i > 0; i--)
+					{
+						b1.expand(bins.bounds[d][i]);
+						count1 += bins.exit[d][i];
+						if (leftCount[i - 1] == 0 || count1 == 0)
+						{
+							continue;
+						}
+						float cost = .125f + (leftCount[i - 1] * leftArea[i - 1] + count1 * b1.surface_area()) / range.bounds.surface_area();
+						if (cost < spatialCost && (size_t)(leftCount[i - 1] + count1 - nPrimitives) <= build.budget)
+						{
+							spatialCost = cost;
+							spatialDim = d;
+							spatialSplit = i - 1;
+						}
+					}
+				}
+			}
+
+			if (std::min(objectCost, spatialCost) >= nPrimitives)
+			{
+				node->InitLeaf(build.ordered.size(), nPrimitives, range.bounds);
+				build.ordered.insert(build.ordered.end(), refs.begin(), refs.end());
+				return node;
+			}
+
+			std::vector<BVHPrimitiveInfo> l, r;
+			if (spatialCost < objectCost)
+			{
+				// references straddling the plane go to both sides, clipped
+				dim = spatialDim;
+				double plane = spatial_plane(range.bounds, dim, spatialSplit);
+				for (const BVHPrimitiveInfo& ref : refs)
+				{
+					int first = spatial_bin(range.bounds, dim, ref.bounds.min[dim]);
+					int last = spatial_bin(range.bounds, dim, ref.bounds.max[dim]);
+					if (last <= spatialSplit)
+					{
+						l.push_back(ref);
+					}
+					else if (first > spatialSplit)
+					{
+						r.push_back(ref);
+					}
+					else
+					{
+						const Triangle* triangle = build.triangles[ref.primitiveNumber];
+						BBox a = clip(ref, triangle, dim, -INFINITY, plane);
+						BBox b = clip(ref, triangle, dim, plane, INFINITY);
+						if (!a.empty()) l.push_back(BVHPrimitiveInfo(ref.primitiveNumber, a));
+						if (!b.empty()) r.push_back(BVHPrimitiveInfo(ref.primitiveNumber, b));
+					}
+				}
+			}
+
+			// an object split, or a spatial split that left a side empty
+			if (l.empty() || r.empty())
+			{
+				if (objectCost >= nPrimitives)
+				{
+					node->InitLeaf(build.ordered.size(), nPrimitives, range.bounds);
+					build.ordered.insert(build.ordered.end(), refs.begin(), refs.end());
+					return node;
+				}
+				l.clear();
+				r.clear();
+				for (const BVHPrimitiveInfo& ref : refs)
+				{
+					if (bucket(range.centroidBounds.Offset(ref.centroid)[dim]) <= split)
+						l.push_back(ref);
+					else
+						r.push_back(ref);
+				}
+			}
+
+			else if (spatialCost < objectCost)
+			{
+				build.budget -= std::min(l.size() + r.size() - nPrimitives, build.budget);
+			}
+
+			// the references of the node are not needed by its children
+			std::vector<BVHPrimitiveInfo>().swap(refs);
+			size_t start = build.ordered.size();
+			BVHNode* c0 = spatialBuild(l, build, depth + 1);
+			BVHNode* c1 = spatialBuild(r, build, depth + 1);
+			node->InitInterior(dim, c0, c1, start, build.ordered.size() - start);
+			return node;
+		}
+
+		// SAH cost of a subtree relative to the surface area of its root
+		static void subtree_stats(const BVHNode* node, BVHStats& stats)
+		{
+			stats.nodes++;
+			if (node->isLeaf())
+			{
+				stats.leaves++;
+				stats.references += node->range;
+				stats.sah += node->range * node->bb.surface_area();
+				return;
+			}
+			stats.sah += .125 * node->bb.surface_area();
+			subtree_stats(node->l, stats);
+			subtree_stats(node->r, stats);
+		}
+
+		BVHStats BVHAccel::stats() const
+		{
+			BVHStats stats = BVHStats();
+			subtree_stats(root, stats);
+			double area = root->bb.surface_area();
+			stats.sah = area > 0 ? stats.sah / area : 0;
+			return stats;
+		}
+
+		// The cache stores a header, the primitive order, the packed triangles
+		// of the leaves and the binary tree flattened, in native byte order.
+		// Wide trees are collapsed from the binary tree when loaded, so trees
+		// of all widths share a file.
+		static const char kCacheMagic[8] = { 'B', 'V', 'H', 'C', 'A', 'C', 'H', 'E' };
+		static const uint32_t kCacheVersion = 1;
+
+		struct BVHCacheHeader {
+			char magic[8];
+			uint32_t version;
+			uint32_t reserved;
+			uint64_t key;
+			uint64_t inputs;      // primitives the tree was built from
+			uint64_t references;  // primitive references in leaves
+			uint64_t nodes;       // binary nodes
+			uint64_t blocks;      // packed triangle blocks
+			double cost;          // SAH cost of the tree
+		};
+
+		// Read-only view of a whole file, memory mapped where supported
+		class MappedFile {
+		public:
+			MappedFile(const std::string& path) : data(nullptr), size(0)
+			{
+#ifndef _WIN32
+				int fd = open(path.c_str(), O_RDONLY);
+				if (fd < 0)
+				{
+					return;
+				}
+				struct stat st;
+				if (fstat(fd, &st) == 0 && st.st_size > 0)
+				{
+					void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+					if (map != MAP_FAILED)
+					{
+						data = static_cast<const char*>(map);
+						size = st.st_size;
+					}
+				}
+				close(fd);
+#else
+				std::ifstream in(path.c_str(), std::ios::binary);
+				buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+				if (!buffer.empty())
+				{
+					data = buffer.data();
+					size = buffer.size();
+				}
+#endif
+			}
+
+			~MappedFile()
+			{
+#ifndef _WIN32
+				if (data)
+				{
+					munmap(const_cast<char*>(data), size);
+				}
+#endif
+			}
+
+			const char* data;
+			size_t size;
+
+		private:
+			MappedFile(const MappedFile&);
+			MappedFile& operator=(const MappedFile&);
+#ifdef _WIN32
+			std::vector<char> buffer;
+#endif
+		};
+
+		// FNV-1a over 64-bit words
+		static const uint64_t kHashBasis = 14695981039346656037ull;
+
+		static inline uint64_t hash_word(uint64_t hash, uint64_t word)
+		{
+			return (hash ^ word) * 1099511628211ull;
+		}
+
+		static inline uint64_t hash_doubles(uint64_t hash, const double* values, int count)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				uint64_t word;
+				memcpy(&word, &values[i], sizeof(word));
+				hash = hash_word(hash, word);
+			}
+			return hash;
+		}
+
+		uint64_t BVHAccel::cacheKey(float split_budget) const
+		{
+			// Chunks of primitives are hashed in parallel and their hashes are
+			// combined in order. Triangles are hashed by their vertex positions
+			// and indices, other primitives by their bounds
+			int n = primitives.size();
+			int chunks = (n + kChunkSize - 1) / kChunkSize;
+			std::vector<uint64_t> partial(chunks);
+			#pragma omp parallel for if(n >= kTaskSize)
+			for (int c = 0; c < chunks; c++)
+			{
+				uint64_t hash = kHashBasis;
+				int end = std::min(n, (c + 1) * kChunkSize);
+				for (int i = c * kChunkSize; i < end; i++)
+				{
+					const Triangle* triangle = dynamic_cast<const Triangle*>(primitives[i]);
+					double values[9];
+					if (triangle)
+					{
+						Vector3D p0, p1, p2;
+						triangle->get_vertices(p0, p1, p2);
+						for (int j = 0; j < 3; j++)
+						{
+							values[j] = p0[j];
+							values[3 + j] = p1[j];
+							values[6 + j] = p2[j];
+						}
+						hash = hash_doubles(hash_word(hash, 1), values, 9);
+
+						// the winding and attribute indices of a triangle change
+						// its shading, not its bounds
+						size_t i1, i2, i3;
+						triangle->get_indices(i1, i2, i3);
+						hash = hash_word(hash_word(hash_word(hash, i1), i2), i3);
+					}
+					else
+					{
+						BBox bounds = primitives[i]->get_bbox();
+						for (int j = 0; j < 3; j++)
+						{
+							values[j] = bounds.min[j];
+							values[3 + j] = bounds.max[j];
+						}
+						hash = hash_doubles(hash_word(hash, 2), values, 6);
+					}
+				}
+				partial[c] = hash;
+			}
+
+			uint32_t budget;
+			memcpy(&budget, &split_budget, sizeof(budget));
+			uint64_t hash = hash_word(kHashBasis, kCacheVersion);
+			hash = hash_word(hash, n);
+			hash = hash_word(hash, maxPrimsInNode);
+			hash = hash_word(hash, budget);
+			for (int c = 0; c < chunks; c++)
+			{
+				hash = hash_word(hash, partial[c]);
+			}
+			return hash;
+		}
+
+		BVHNode* BVHAccel::unflatten(const LinearBVHNode* flat, uint32_t count, uint32_t index, size_t references,
+			int depth)
+		{
+			if (index >= count || depth > kMaxDepth)
+			{
+				return nullptr;
+			}
+
+			// Children follow their parent, which rules out cycles
+			const LinearBVHNode& node = flat[index];
+			if (node.count == 0 && node.offset <= index + 1)
+			{
+				return nullptr;
+			}
+			BBox bb(Vector3D(node.min[0], node.min[1], node.min[2]), Vector3D(node.max[0], node.max[1], node.max[2]));
+			if (node.count > 0)
+			{
+				if (node.offset > references || node.count > references - node.offset)
+				{
+					return nullptr;
+				}
+				return new BVHNode(bb, node.offset, node.count);
+			}
+
+			BVHNode* l = unflatten(flat, count, index + 1, references, depth + 1);
+			BVHNode* r = l ? unflatten(flat, count, node.offset, references, depth + 1) : nullptr;
+			if (!r)
+			{
+				if (l)
+				{
+					recursiveDelete(l);
+				}
+				return nullptr;
+			}
+			BVHNode* interior = new BVHNode();
+			interior->InitInterior(node.axis, l, r, l->start, l->range + r->range);
+			return interior;
+		}
+
+		bool BVHAccel::loadCache(const std::string& path, uint64_t key)
+		{
+			MappedFile file(path);
+			BVHCacheHeader header;
+			if (!file.data || file.size < sizeof(header))
+			{
+				return false;
+			}
+			memcpy(&header, file.data, sizeof(header));
+			if (memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 || header.version != kCacheVersion ||
+				header.key != key || header.inputs != primitives.size() ||
+				header.references == 0 || header.references >= (1ull << 30) || header.nodes == 0 ||
+				header.nodes >= (1ull << 32) || header.blocks > header.references)
+			{
+				return false;
+			}
+			// every block packs at least one reference, which also keeps the size below from wrapping
+			size_t references = header.references;
+			size_t size = sizeof(header) + references * (sizeof(uint32_t) + sizeof(LeafTriangles)) +
+				header.blocks * sizeof(TriangleBlock) + header.nodes * sizeof(LinearBVHNode);
+			if (file.size != size)
+			{
+				return false;
+			}
+
+			const char* data = file.data + sizeof(header);
+			const uint32_t* cachedOrder = reinterpret_cast<const uint32_t*>(data);
+			data += references * sizeof(uint32_t);
+			const LeafTriangles* cachedLeaves = reinterpret_cast<const LeafTriangles*>(data);
+			data += references * sizeof(LeafTriangles);
+			const TriangleBlock* cachedBlocks = reinterpret_cast<const TriangleBlock*>(data);
+			data += header.blocks * sizeof(TriangleBlock);
+			const LinearBVHNode* cachedNodes = reinterpret_cast<const LinearBVHNode*>(data);
+
+			// Reject files whose indices are out of range, so that a damaged
+			// cache is rebuilt rather than traversed
+			for (size_t i = 0; i < references; i++)
+			{
+				const LeafTriangles& leaf = cachedLeaves[i];
+				if (cachedOrder[i] >= header.inputs || leaf.triangles > references - i ||
+					leaf.block > header.blocks || (leaf.triangles + 3) / 4 > header.blocks - leaf.block)
+				{
+					return false;
+				}
+				if (leaf.triangles > 0 &&
+					!dynamic_cast<const Triangle*>(primitives[cachedOrder[i]]))
+				{
+					return false;
+				}
+			}
+			for (size_t b = 0; b < header.blocks; b++)
+			{
+				for (int lane = 0; lane < 4; lane++)
+				{
+					if (cachedBlocks[b].primitive[lane] >= references)
+					{
+						return false;
+					}
+				}
+			}
+			BVHNode* cachedRoot = unflatten(cachedNodes, header.nodes, 0, references, 0);
+			if (!cachedRoot)
+			{
+				return false;
+			}
+
+			root = cachedRoot;
+			numInputs = header.inputs;
+			builtCost = header.cost;
+			order.assign(cachedOrder, cachedOrder + references);
+			leafTriangles.assign(cachedLeaves, cachedLeaves + references);
+			blocks.assign(cachedBlocks, cachedBlocks + header.blocks);
+
+			std::vector<Primitive*> inputs;
+			inputs.swap(primitives);
+			primitives.resize(references);
+			#pragma omp parallel for if(references >= kTaskSize)
+			for (int i = 0; i < (int)references; i++)
+			{
+				primitives[i] = inputs[order[i]];
+			}
+
+			if (width == 4)
+			{
+				collapse(root, nodes4);
+			}
+			else if (width == 8)
+			{
+				collapse(root, nodes8);
+			}
+			else
+			{
+				nodes.assign(cachedNodes, cachedNodes + header.nodes);
+			}
+			return true;
+		}
+
+		void BVHAccel::saveCache(const std::string& path, uint64_t key)
+		{
+			// Wide trees keep no binary nodes, which are flattened for the file
+			if (nodes.empty())
+			{
+				flatten(root);
+			}
+
+			BVHCacheHeader header = BVHCacheHeader();
+			memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+			header.version = kCacheVersion;
+			header.key = key;
+			header.inputs = numInputs;
+			header.references = primitives.size();
+			header.nodes = nodes.size();
+			header.blocks = blocks.size();
+			header.cost = builtCost;
+
+			// Write to a temporary file first so that a cache file is always
+			// complete
+			std::string temp = path + ".tmp";
+			std::ofstream out(temp.c_str(), std::ios::binary);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.write(reinterpret_cast<const char*>(order.data()), order.size() * sizeof(uint32_t));
+			out.write(reinterpret_cast<const char*>(leafTriangles.data()), leafTriangles.size() * sizeof(LeafTriangles));
+			out.write(reinterpret_cast<const char*>(blocks.data()), blocks.size() * sizeof(TriangleBlock));
+			out.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(LinearBVHNode));
+			out.close();
+			if (!out || std::rename(temp.c_str(), path.c_str()) != 0)
+			{
+				std::remove(temp.c_str());
+			}
+
+			if (width != 2)
+			{
+				std::vector<LinearBVHNode>().swap(nodes);
+			}
+		}
+
+		BVHAccel::BVHAccel(const std::vector<Primitive*>& _primitives, size_t max_leaf_size, int width,
+			float split_budget, const std::string& cache)
+			:maxPrimsInNode(max_leaf_size), width(width == 4 || width == 8 ? width : 2), cached(false) {
+			this->primitives = _primitives;
+
+			// Trees of the same geometry built with the same settings are
+			// loaded from the cache
+			std::string file;
+			uint64_t key = 0;
+			if (!cache.empty() && !primitives.empty())
+			{
+				key = cacheKey(split_budget);
+				char name[32];
+				snprintf(name, sizeof(name), "/%016llx.bvh", (unsigned long long)key);
+				file = cache + name;
+				if (loadCache(file, key))
+				{
+					cached = true;
+					return;
+				}
+			}
+
+			// (PathTracer):
+			// Construct a BVH from the given vector of primitives and maximum leaf
+			// size configuration. The starter code build a BVH aggregate with a
+			// single leaf node (which is also the root) that encloses all the
+			// primitives.
+
+			// Initialize primitiveInfo array for primitives
+			int n = primitives.size();
+			std::vector<BVHPrimitiveInfo> primitiveInfo(n);
+			#pragma omp parallel for if(n >= kTaskSize)
+			for (int i = 0; i < n; i++)
+			{
+				primitiveInfo[i] = BVHPrimitiveInfo(i, primitives[i]->get_bbox());
+			}
+
+			if (split_budget > 0 && n > 0)
+			{
+				// The spatial split build duplicates references, the leaves
+				// list them in order
+				SpatialBuild build;
+				build.triangles.resize(n);
+				for (int i = 0; i < n; i++)
+				{
+					build.triangles[i] = dynamic_cast<const Triangle*>(primitives[i]);
+				}
+				build.budget = (size_t)(split_budget * n);
+				BBox bounds;
+				for (int i = 0; i < n; i++)
+				{
+					bounds.expand(primitiveInfo[i].bounds);
+				}
+				build.rootArea = bounds.surface_area();
+				build.ordered.reserve(n + build.budget);
+				root = spatialBuild(primitiveInfo, build, 0);
+				primitiveInfo.swap(build.ordered);
+				n = primitiveInfo.size();
+			}
+			else
+			{
+				// Build BVH tree for primitives using primitiveInfo, subtrees are
+				// built as tasks by the threads of this region
+				#pragma omp parallel if(n >= kTaskSize)
+				#pragma omp single
+				root = recursiveBuild(primitiveInfo.data(), 0, n, 0);
+			}
+
+			// Put the primitives in the order of the partitioned primitiveInfo,
+			// the order is kept to refit the tree to other primitives
+			std::vector<Primitive*> inputs;
+			inputs.swap(primitives);
+			numInputs = inputs.size();
+			order.resize(n);
+			#pragma omp parallel for if(n >= kTaskSize)
+			for (int i = 0; i < n; i++)
+			{
+				order[i] = primitiveInfo[i].primitiveNumber;
+			}
+			primitives.resize(n);
+
+			// Flatten the tree for traversal, an empty tree has no nodes
+			if (primitives.empty())
+			{
+				return;
+			}
+			leafTriangles.resize(primitives.size());
+			pack(root, inputs);
+
+			if (this->width == 4)
+			{
+				collapse(root, nodes4);
+			}
+			else if (this->width == 8)
+			{
+				collapse(root, nodes8);
+			}
+			else
+			{
+				nodes.reserve(2 * primitives.size());
+				flatten(root);
+			}
+			builtCost = stats().sah;
+
+			if (!file.empty())
+			{
+				saveCache(file, key);
+			}
+		}
+
+
+		BVHAccel::~BVHAccel() {
+			// (PathTracer):
+			// Implement a proper destructor for your BVH accelerator aggregate
+			recursiveDelete(root);
+			root = nullptr;
+
+		}
+
+		BBox BVHAccel::get_bbox() const { return root->bb; }
+
+		// float bounds that contain [lo, hi]
+		static inline float round_down(double lo) {
+			float f = (float)lo;
+			return f > lo ? std::nextafter(f, -INFINITY) : f;
+		}
+
+		static inline float round_up(double hi) {
+			float f = (float)hi;
+			return f < hi ? std::nextafter(f, INFINITY) : f;
+		}
+
+		uint32_t BVHAccel::flatten(const BVHNode* node)
+		{
+			uint32_t index = nodes.size();
+			nodes.push_back(LinearBVHNode());
+			for (int i = 0; i < 3; i++)
+			{
+				nodes[index].min[i] = round_down(node->bb.min[i]);
+				nodes[index].max[i] = round_up(node->bb.max[i]);
+			}
+
+			if (node->isLeaf())
+			{
+				nodes[index].offset = node->start;
+				nodes[index].count = node->range;
+				nodes[index].axis = 0;
+			}
+			else
+			{
+				// the first child follows its parent
+				flatten(node->l);
+				uint32_t second = flatten(node->r);
+				nodes[index].offset = second;
+				nodes[index].count = 0;
+				nodes[index].axis = node->axis;
+			}
+			return index;
+		}
+
+		void BVHAccel::pack(const BVHNode* node, const std::vector<Primitive*>& inputs)
+		{
+			if (!node->isLeaf())
+			{
+				pack(node->l, inputs);
+				pack(node->r, inputs);
+				return;
+			}
+
+			std::vector<uint32_t>::iterator first = order.begin() + node->start;
+			std::vector<uint32_t>::iterator last = std::stable_partition(first, first + node->range,
+				[&inputs](uint32_t i) { return dynamic_cast<const Triangle*>(inputs[i]) != nullptr; });
+			for (size_t i = node->start; i < node->start + node->range; i++)
+			{
+				primitives[i] = inputs[order[i]];
+			}
+
+			LeafTriangles& leaf = leafTriangles[node->start];
+			leaf.block = blocks.size();
+			leaf.triangles = last - first;
+			for (uint32_t i = 0; i < leaf.triangles; i += 4)
+			{
+				blocks.push_back(packBlock(node->start + i, std::min(leaf.triangles - i, 4u)));
+			}
+		}
+
+		TriangleBlock BVHAccel::packBlock(uint32_t first, uint32_t count) const
+		{
+			TriangleBlock block = TriangleBlock();
+			for (uint32_t lane = 0; lane < count; lane++)
+			{
+				uint32_t index = first + lane;
+				Vector3D p0, p1, p2;
+				static_cast<const Triangle*>(primitives[index])->get_vertices(p0, p1, p2);
+				Vector3D e1 = p1 - p0;
+				Vector3D e2 = p2 - p0;
+				for (int j = 0; j < 3; j++)
+				{
+					block.p0[j][lane] = p0[j];
+					block.e1[j][lane] = e1[j];
+					block.e2[j][lane] = e2[j];
+				}
+				block.primitive[lane] = index;
+			}
+			return block;
+		}
+
+		// Refitting keeps the topology of the tree, which gets worse as the
+		// primitives move. A refitted tree whose SAH cost grew by more than
+		// kMaxRefitCost times its cost when built is reported for a rebuild.
+		static const double kMaxRefitCost = 1.25;
+
+		void BVHAccel::refitNode(BVHNode* node)
+		{
+			if (node->isLeaf())
+			{
+				BBox bb;
+				for (size_t i = node->start; i < node->start + node->range; i++)
+				{
+					bb.expand(primitives[i]->get_bbox());
+				}
+				node->bb = bb;
+				return;
+			}
+
+			#pragma omp task if(node->range >= kTaskSize)
+			refitNode(node->l);
+			refitNode(node->r);
+			#pragma omp taskwait
+			node->bb = node->l->bb;
+			node->bb.expand(node->r->bb);
+		}
+
+		static inline bool same_bounds(const BBox& a, const BBox& b)
+		{
+			return a.min.x == b.min.x && a.min.y == b.min.y && a.min.z == b.min.z &&
+				a.max.x == b.max.x && a.max.y == b.max.y && a.max.z == b.max.z;
+		}
+
+		bool BVHAccel::refit(const std::vector<Primitive*>& _primitives)
+		{
+			if (_primitives.size() != numInputs)
+			{
+				return false;
+			}
+
+			// Trees whose primitives did not move keep their bounds, which are
+			// tighter than refitted bounds if references were clipped by
+			// spatial splits
+			int n = primitives.size();
+			bool moved = false;
+			#pragma omp parallel for reduction(||:moved) if(n >= kTaskSize)
+			for (int i = 0; i < n; i++)
+			{
+				moved = moved || !same_bounds(_primitives[order[i]]->get_bbox(), primitives[i]->get_bbox());
+			}
+
+			#pragma omp parallel for if(n >= kTaskSize)
+			for (int i = 0; i < n; i++)
+			{
+				primitives[i] = _primitives[order[i]];
+			}
+
+			#pragma omp parallel for schedule(dynamic, 64) if(n >= kTaskSize)
+			for (int i = 0; i < n; i++)
+			{
+				const LeafTriangles& leaf = leafTriangles[i];
+				for (uint32_t j = 0; j < leaf.triangles; j += 4)
+				{
+					blocks[leaf.block + j / 4] = packBlock(i + j, std::min(leaf.triangles - j, 4u));
+				}
+			}
+
+			if (!moved)
+			{
+				return true;
+			}
 
-			// (PathTracer):
-			// Construct a BVH from the given vector of primitives and maximum leaf
-			// size configuration. The starter code build a BVH aggregate with a
-			// single leaf node (which is also the root) that encloses all the
-			// primitives.
+			#pragma omp parallel if(n >= kTaskSize)
+			#pragma omp single
+			refitNode(root);
 
-			// Initialize primitiveInfo array for primitives
-			std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
-			for (size_t i = 0; i < primitives.size(); i++)
+			// Flatten the refitted bounds again
+			if (width == 4)
 			{
-				primitiveInfo[i] = BVHPrimitiveInfo(i, primitives[i]->get_bbox());
+				nodes4.clear();
+				collapse(root, nodes4);
 			}
+			else if (width == 8)
+			{
+				nodes8.clear();
+				collapse(root, nodes8);
+			}
+			else
+			{
+				nodes.clear();
+				flatten(root);
+			}
+
+			return stats().sah <= kMaxRefitCost * builtCost;
+		}
+
+		// Moller-Trumbore on the four triangles of a block in float, with the
+		// same culling of triangles facing away as Triangle. Finds the closest
+		// hit within [min_t, max_t].
+		static inline bool intersect_block(const TriangleBlock& block, const float o[3], const float d[3],
+			float min_t, float max_t, float& t, float& u, float& v, int& lane)
+		{
+#if defined(__SSE__) || defined(_M_X64)
+			__m128 dx = _mm_set1_ps(d[0]), dy = _mm_set1_ps(d[1]), dz = _mm_set1_ps(d[2]);
+			__m128 e1x = _mm_loadu_ps(block.e1[0]), e1y = _mm_loadu_ps(block.e1[1]), e1z = _mm_loadu_ps(block.e1[2]);
+			__m128 e2x = _mm_loadu_ps(block.e2[0]), e2y = _mm_loadu_ps(block.e2[1]), e2z = _mm_loadu_ps(block.e2[2]);
+			__m128 sx = _mm_sub_ps(_mm_set1_ps(o[0]), _mm_loadu_ps(block.p0[0]));
+			__m128 sy = _mm_sub_ps(_mm_set1_ps(o[1]), _mm_loadu_ps(block.p0[1]));
+			__m128 sz = _mm_sub_ps(_mm_set1_ps(o[2]), _mm_loadu_ps(block.p0[2]));
+
+			// e1 x d and s x e2
+			__m128 cx = _mm_sub_ps(_mm_mul_ps(e1y, dz), _mm_mul_ps(e1z, dy));
+			__m128 cy = _mm_sub_ps(_mm_mul_ps(e1z, dx), _mm_mul_ps(e1x, dz));
+			__m128 cz = _mm_sub_ps(_mm_mul_ps(e1x, dy), _mm_mul_ps(e1y, dx));
+			__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e2z), _mm_mul_ps(sz, e2y));
+			__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e2x), _mm_mul_ps(sx, e2z));
+			__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e2y), _mm_mul_ps(sy, e2x));
 
-			// Build BVH tree for primitives using primitiveInfo
-			std::vector<Primitive*> orderedPrims;
-			root = recursiveBuild(primitiveInfo, 0, primitives.size(), orderedPrims);
-			primitives.swap(orderedPrims);
+			__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, e2x), _mm_mul_ps(cy, e2y)), _mm_mul_ps(cz, e2z));
+			__m128 inv = _mm_div_ps(_mm_set1_ps(1.f), det);
+			__m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, dx), _mm_mul_ps(qy, dy)), _mm_mul_ps(qz, dz)), inv);
+			__m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, sx), _mm_mul_ps(cy, sy)), _mm_mul_ps(cz, sz)), inv);
+			__m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, e1x), _mm_mul_ps(qy, e1y)), _mm_mul_ps(qz, e1z)), inv);
+			__m128 zero = _mm_setzero_ps();
+			uu = _mm_sub_ps(zero, uu);
+			tt = _mm_sub_ps(zero, tt);
+
+			__m128 valid = _mm_cmpge_ps(det, _mm_set1_ps(0.000001f));
+			valid = _mm_and_ps(valid, _mm_cmpge_ps(uu, zero));
+			valid = _mm_and_ps(valid, _mm_cmpge_ps(vv, zero));
+			valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(uu, vv), _mm_set1_ps(1.f)));
+			valid = _mm_and_ps(valid, _mm_cmpge_ps(tt, _mm_set1_ps(min_t)));
+			valid = _mm_and_ps(valid, _mm_cmple_ps(tt, _mm_set1_ps(max_t)));
+			int mask = _mm_movemask_ps(valid);
+			if (!mask)
+			{
+				return false;
+			}
 
+			float ts[4], us[4], vs[4];
+			_mm_storeu_ps(ts, tt);
+			_mm_storeu_ps(us, uu);
+			_mm_storeu_ps(vs, vv);
+#else
+			float ts[4], us[4], vs[4];
+			int mask = 0;
+			for (int i = 0; i < 4; i++)
+			{
+				float e1[3] = { block.e1[0][i], block.e1[1][i], block.e1[2][i] };
+				float e2[3] = { block.e2[0][i], block.e2[1][i], block.e2[2][i] };
+				float s[3] = { o[0] - block.p0[0][i], o[1] - block.p0[1][i], o[2] - block.p0[2][i] };
+				float c[3] = { e1[1] * d[2] - e1[2] * d[1], e1[2] * d[0] - e1[0] * d[2], e1[0] * d[1] - e1[1] * d[0] };
+				float q[3] = { s[1] * e2[2] - s[2] * e2[1], s[2] * e2[0] - s[0] * e2[2], s[0] * e2[1] - s[1] * e2[0] };
+				float det = c[0] * e2[0] + c[1] * e2[1] + c[2] * e2[2];
+				float inv = 1.f / det;
+				us[i] = -(q[0] * d[0] + q[1] * d[1] + q[2] * d[2]) * inv;
+				vs[i] = (c[0] * s[0] + c[1] * s[1] + c[2] * s[2]) * inv;
+				ts[i] = -(q[0] * e1[0] + q[1] * e1[1] + q[2] * e1[2]) * inv;
+				if (det >= 0.000001f && us[i] >= 0 && vs[i] >= 0 && us[i] + vs[i] <= 1 &&
+					ts[i] >= min_t && ts[i] <= max_t)
+				{
+					mask |= 1 << i;
+				}
+			}
+			if (!mask)
+			{
+				return false;
+			}
+#endif
+			lane = -1;
+			for (int i = 0; i < 4; i++)
+			{
+				if ((mask & (1 << i)) && (lane < 0 || ts[i] < ts[lane]))
+				{
+					lane = i;
+				}
+			}
+			t = ts[lane];
+			u = us[lane];
+			v = vs[lane];
+			return true;
 		}
 
+		bool BVHAccel::intersectLeaf(uint32_t offset, uint32_t count, const float o[3], const float d[3],
+			const Ray& ray, Intersection* isect, TriangleHit& closest) const
+		{
+			bool hit = false;
+			const LeafTriangles& leaf = leafTriangles[offset];
+			uint32_t end = leaf.block + (leaf.triangles + 3) / 4;
+			for (uint32_t b = leaf.block; b < end; b++)
+			{
+				float t, u, v;
+				int lane;
+				if (intersect_block(blocks[b], o, d, ray.min_t, ray.max_t, t, u, v, lane))
+				{
+					if (!isect)
+					{
+						return true;
+					}
+					ray.max_t = t;
+					closest.primitive = blocks[b].primitive[lane];
+					closest.u = u;
+					closest.v = v;
+					hit = true;
+				}
+			}
 
-		BVHAccel::~BVHAccel() {
-			// (PathTracer):
-			// Implement a proper destructor for your BVH accelerator aggregate
-			recursiveDelete(root);
-			root = nullptr;
+			for (uint32_t i = offset + leaf.triangles; i < offset + count; i++)
+			{
+				if (!isect)
+				{
+					if (primitives[i]->intersect(ray))
+					{
+						return true;
+					}
+				}
+				else if (primitives[i]->intersect(ray, isect))
+				{
+					// closer than any triangle so far
+					closest = TriangleHit();
+					hit = true;
+				}
+			}
+			return hit;
+		}
 
+		void BVHAccel::finishHit(const TriangleHit& closest, const Ray& ray, Intersection* isect) const
+		{
+			if (isect && closest.found())
+			{
+				static_cast<const Triangle*>(primitives[closest.primitive])->set_intersection(
+					ray, ray.max_t, closest.u, closest.v, isect);
+			}
 		}
 
-		BBox BVHAccel::get_bbox() const { return root->bb; }
+		template <int N>
+		uint32_t BVHAccel::collapse(const BVHNode* node, std::vector<WideBVHNode<N> >& wide)
+		{
+			const BVHNode* children[N];
+			int n = 1;
+			children[0] = node;
+			while (n < N)
+			{
+				int open = -1;
+				double area = -1;
+				for (int i = 0; i < n; i++)
+				{
+					if (!children[i]->isLeaf() && children[i]->bb.surface_area() > area)
+					{
+						open = i;
+						area = children[i]->bb.surface_area();
+					}
+				}
+				if (open < 0)
+				{
+					break;
+				}
+				children[n++] = children[open]->r;
+				children[open] = children[open]->l;
+			}
+
+			// Children are collapsed after the node is appended, which may move it
+			uint32_t index = wide.size();
+			wide.push_back(WideBVHNode<N>());
+			for (int i = 0; i < N; i++)
+			{
+				WideBVHNode<N>& w = wide[index];
+				if (i >= n || children[i]->range == 0)
+				{
+					for (int j = 0; j < 3; j++)
+					{
+						w.min[j][i] = INFINITY;
+						w.max[j][i] = -INFINITY;
+					}
+					w.child[i] = 0;
+					w.count[i] = 0;
+					continue;
+				}
+
+				for (int j = 0; j < 3; j++)
+				{
+					w.min[j][i] = round_down(children[i]->bb.min[j]);
+					w.max[j][i] = round_up(children[i]->bb.max[j]);
+				}
+				if (children[i]->isLeaf())
+				{
+					w.child[i] = children[i]->start;
+					w.count[i] = children[i]->range;
+				}
+				else
+				{
+					w.count[i] = 0;
+					uint32_t child = collapse(children[i], wide);
+					wide[index].child[i] = child;
+				}
+			}
+			return index;
+		}
 
-		void BVHAccel::find_closest_hit(const Ray& ray, BVHNode* node, Intersection* closest, double t0, double t1) const
+		// Ray - node slab test in float within [t0, t1]. Axes the ray is
+		// parallel to give NaN or infinite times, which leave the interval as is.
+		static inline bool intersect_node(const LinearBVHNode& node, const float o[3],
+			const float inv_d[3], const int sign[3], float t0, float t1)
 		{
-			if (node->isLeaf())
+			const float* bounds[2] = { node.min, node.max };
+			for (int i = 0; i < 3; i++)
 			{
-				for (size_t i = node->start; i < node->start + node->range; i++)
+				float ta = (bounds[sign[i]][i] - o[i]) * inv_d[i];
+				float tb = (bounds[1 - sign[i]][i] - o[i]) * inv_d[i];
+				t0 = ta > t0 ? ta : t0;
+				t1 = tb < t1 ? tb : t1;
+				if (t1 < t0)
 				{
-					primitives[i]->intersect(ray, closest);
+					return false;
 				}
 			}
-			else
+			return true;
+		}
+
+		bool BVHAccel::traverse(const Ray& ray, Intersection* isect) const
+		{
+			if (nodes.empty())
+			{
+				return false;
+			}
+
+			float o[3] = { (float)ray.o.x, (float)ray.o.y, (float)ray.o.z };
+			float inv_d[3] = { (float)ray.inv_d.x, (float)ray.inv_d.y, (float)ray.inv_d.z };
+			float d[3] = { (float)ray.d.x, (float)ray.d.y, (float)ray.d.z };
+			TriangleHit closest;
+
+			// Primitives shorten the ray to the closest hit found so far, occlusion
+			// queries stop at the first one. The far end is widened by the
+			// rounding error of the float slab test.
+			bool hit = false;
+			uint32_t stack[kMaxDepth];
+			int todo = 0;
+			uint32_t current = 0;
+			while (true)
 			{
-				double t10 = t0, t11 = t1, t20 = t0, t21 = t1;
-				bool hit1 = node->l->bb.intersect(ray, t10, t11);
-				bool hit2 = node->r->bb.intersect(ray, t20, t21);
+				const LinearBVHNode& node = nodes[current];
+				if (intersect_node(node, o, inv_d, ray.sign, round_down(ray.min_t), round_up(ray.max_t) * 1.0000004f))
+				{
+					if (node.count == 0)
+					{
+						// visit the child on the near side of the split first
+						if (ray.sign[node.axis])
+						{
+							stack[todo++] = current + 1;
+							current = node.offset;
+						}
+						else
+						{
+							stack[todo++] = node.offset;
+							current = current + 1;
+						}
+						continue;
+					}
+
+					if (intersectLeaf(node.offset, node.count, o, d, ray, isect, closest))
+					{
+						if (!isect)
+						{
+							return true;
+						}
+						hit = true;
+					}
+				}
+
+				if (todo == 0)
+				{
+					break;
+				}
+				current = stack[--todo];
+			}
+			finishHit(closest, ray, isect);
+			return hit;
+		}
 
-				if (hit1 && !hit2)
+		// Slab test of the ray against all children of a wide node within
+		// [t0, t1], like intersect_node. Returns the mask of the children hit
+		// and stores their entry distances in tnear.
+		template <int N>
+		static inline unsigned intersect_children(const WideBVHNode<N>& node, const float o[3],
+			const float inv_d[3], const int sign[3], float t0, float t1, float tnear[N])
+		{
+			unsigned mask = 0;
+#if defined(__AVX__)
+			if (N == 8)
+			{
+				__m256 lo = _mm256_set1_ps(t0);
+				__m256 hi = _mm256_set1_ps(t1);
+				for (int i = 0; i < 3; i++)
 				{
-					find_closest_hit(ray, node->l, closest, t10, t11);
+					const float* bounds[2] = { node.min[i], node.max[i] };
+					__m256 oi = _mm256_set1_ps(o[i]);
+					__m256 inv = _mm256_set1_ps(inv_d[i]);
+					__m256 ta = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[sign[i]]), oi), inv);
+					__m256 tb = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[1 - sign[i]]), oi), inv);
+					// max and min return their second operand if either is NaN
+					lo = _mm256_max_ps(ta, lo);
+					hi = _mm256_min_ps(tb, hi);
 				}
-				else if (!hit1 && hit2)
+				_mm256_storeu_ps(tnear, lo);
+				return _mm256_movemask_ps(_mm256_cmp_ps(lo, hi, _CMP_LE_OQ));
+			}
+#endif
+#if defined(__SSE__) || defined(_M_X64)
+			for (int c = 0; c < N; c += 4)
+			{
+				__m128 lo = _mm_set1_ps(t0);
+				__m128 hi = _mm_set1_ps(t1);
+				for (int i = 0; i < 3; i++)
+				{
+					const float* bounds[2] = { node.min[i] + c, node.max[i] + c };
+					__m128 oi = _mm_set1_ps(o[i]);
+					__m128 inv = _mm_set1_ps(inv_d[i]);
+					__m128 ta = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[sign[i]]), oi), inv);
+					__m128 tb = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[1 - sign[i]]), oi), inv);
+					// max and min return their second operand if either is NaN
+					lo = _mm_max_ps(ta, lo);
+					hi = _mm_min_ps(tb, hi);
+				}
+				_mm_storeu_ps(tnear + c, lo);
+				mask |= _mm_movemask_ps(_mm_cmple_ps(lo, hi)) << c;
+			}
+#else
+			for (int c = 0; c < N; c++)
+			{
+				float lo = t0;
+				float hi = t1;
+				for (int i = 0; i < 3; i++)
+				{
+					const float* bounds[2] = { node.min[i], node.max[i] };
+					float ta = (bounds[sign[i]][c] - o[i]) * inv_d[i];
+					float tb = (bounds[1 - sign[i]][c] - o[i]) * inv_d[i];
+					lo = ta > lo ? ta : lo;
+					hi = tb < hi ? tb : hi;
+				}
+				tnear[c] = lo;
+				mask |= (lo <= hi) << c;
+			}
+#endif
+			return mask;
+		}
+
+		template <int N>
+		bool BVHAccel::traverseWide(const std::vector<WideBVHNode<N> >& wide, const Ray& ray, Intersection* isect) const
+		{
+			if (wide.empty())
+			{
+				return false;
+			}
+
+			float o[3] = { (float)ray.o.x, (float)ray.o.y, (float)ray.o.z };
+			float inv_d[3] = { (float)ray.inv_d.x, (float)ray.inv_d.y, (float)ray.inv_d.z };
+			float d[3] = { (float)ray.d.x, (float)ray.d.y, (float)ray.d.z };
+			TriangleHit closest;
+
+			// Children are pushed farthest first and skipped when popped behind
+			// the closest hit found since they were pushed. Every level of the
+			// tree leaves at most N - 1 children on the stack.
+			struct Entry {
+				uint32_t child;
+				uint32_t count;
+				float t;
+			};
+			Entry stack[kMaxDepth * N];
+			int todo = 0;
+			stack[todo++] = { 0, 0, -INFINITY };
+
+			bool hit = false;
+			while (todo > 0)
+			{
+				Entry entry = stack[--todo];
+				float t1 = round_up(ray.max_t) * 1.0000004f;
+				if (entry.t > t1)
 				{
-					find_closest_hit(ray, node->r, closest, t20, t21);
+					continue;
 				}
-				else if (hit1 && hit2)
+
+				if (entry.count > 0)
 				{
-					BVHNode* first = t10 <= t20 ? node->l : node->r;
-					BVHNode* second = t10 <= t20 ? node->r : node->l;
+					if (intersectLeaf(entry.child, entry.count, o, d, ray, isect, closest))
+					{
+						if (!isect)
+						{
+							return true;
+						}
+						hit = true;
+					}
+					continue;
+				}
 
-					find_closest_hit(ray, node->l, closest, t10, t11);
-					if (t20 < closest->t)
+				const WideBVHNode<N>& node = wide[entry.child];
+				float tnear[N];
+				unsigned mask = intersect_children(node, o, inv_d, ray.sign, round_down(ray.min_t), t1, tnear);
+
+				// insert the children hit by distance, nearest on top
+				int first = todo;
+				for (int c = 0; c < N; c++)
+				{
+					if (!(mask & (1u << c)))
 					{
-						find_closest_hit(ray, node->r, closest, t20, t21);
+						continue;
 					}
-				}				
+					Entry child = { node.child[c], node.count[c], tnear[c] };
+					int j = todo++;
+					while (j > first && stack[j - 1].t < child.t)
+					{
+						stack[j] = stack[j - 1];
+						j--;
+					}
+					stack[j] = child;
+				}
 			}
+			finishHit(closest, ray, isect);
+			return hit;
 		}
 
-		bool BVHAccel::intersect(const Ray& ray) const {
-			// TODO (PathTracer):
-			// Implement ray - bvh aggregate intersection test. A ray intersects
-			// with a BVH aggregate if and only if it intersects a primitive in
-			// the BVH that is not an aggregate.
-			Intersection isect;
-			double t0 = ray.min_t, t1 = ray.max_t;
+		// Bounds of the origins and inverse directions of a packet of rays that
+		// agree in direction signs, and of their intervals [t0, t1]
+		struct PacketBounds {
+			float o[2][3];
+			float inv_d[2][3];
+			float t0, t1;
+		};
+
+		// Conservative slab test of a packet against a node, false only if
+		// every ray misses the node. Float subtraction and multiplication are
+		// monotonic, so the bounds hold for the times intersect_node computes
+		// for each ray.
+		static inline bool intersect_packet(const LinearBVHNode& node, const PacketBounds& packet, const int sign[3])
+		{
+			const float* bounds[2] = { node.min, node.max };
+			float t0 = packet.t0;
+			float t1 = packet.t1;
+			for (int i = 0; i < 3; i++)
+			{
+				// near and far plane offsets from the origins
+				float na = bounds[sign[i]][i] - packet.o[1][i];
+				float nb = bounds[sign[i]][i] - packet.o[0][i];
+				float fa = bounds[1 - sign[i]][i] - packet.o[1][i];
+				float fb = bounds[1 - sign[i]][i] - packet.o[0][i];
+				float ia = packet.inv_d[0][i];
+				float ib = packet.inv_d[1][i];
+				float ta = std::min(std::min(na * ia, na * ib), std::min(nb * ia, nb * ib));
+				float tb = std::max(std::max(fa * ia, fa * ib), std::max(fb * ia, fb * ib));
+				t0 = ta > t0 ? ta : t0;
+				t1 = tb < t1 ? tb : t1;
+				if (t1 < t0)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		// Bound of the far ends of the rays, which shrink as hits are found
+		static inline float far_end(const Ray* rays, size_t n)
+		{
+			float t1 = -INFINITY;
+			for (size_t i = 0; i < n; i++)
+			{
+				t1 = std::max(t1, round_up(rays[i].max_t) * 1.0000004f);
+			}
+			return t1;
+		}
+
+		void BVHAccel::intersect(const Ray* rays, Intersection* isects, bool* hits, size_t n) const
+		{
+			bool coherent = width == 2 && n <= kPacketSize;
+			for (size_t i = 1; i < n && coherent; i++)
+			{
+				for (int j = 0; j < 3; j++)
+				{
+					coherent = coherent && rays[i].sign[j] == rays[0].sign[j];
+				}
+			}
+
+			if (!coherent)
+			{
+				for (size_t i = 0; i < n; i++)
+				{
+					hits[i] = intersect(rays[i], &isects[i]);
+				}
+				return;
+			}
+			traversePacket(rays, isects, hits, n);
+		}
+
+		void BVHAccel::traversePacket(const Ray* rays, Intersection* isects, bool* hits, size_t n) const
+		{
+			for (size_t i = 0; i < n; i++)
+			{
+				hits[i] = false;
+			}
+			if (nodes.empty() || n == 0)
+			{
+				return;
+			}
+
+			float o[kPacketSize][3];
+			float inv_d[kPacketSize][3];
+			float d[kPacketSize][3];
+			TriangleHit closest[kPacketSize];
+			PacketBounds packet;
+			packet.t0 = INFINITY;
+			packet.t1 = -INFINITY;
+			for (int j = 0; j < 3; j++)
+			{
+				packet.o[0][j] = packet.inv_d[0][j] = INFINITY;
+				packet.o[1][j] = packet.inv_d[1][j] = -INFINITY;
+			}
+			for (size_t i = 0; i < n; i++)
+			{
+				for (int j = 0; j < 3; j++)
+				{
+					o[i][j] = rays[i].o[j];
+					inv_d[i][j] = rays[i].inv_d[j];
+					d[i][j] = rays[i].d[j];
+					packet.o[0][j] = std::min(packet.o[0][j], o[i][j]);
+					packet.o[1][j] = std::max(packet.o[1][j], o[i][j]);
+					packet.inv_d[0][j] = std::min(packet.inv_d[0][j], inv_d[i][j]);
+					packet.inv_d[1][j] = std::max(packet.inv_d[1][j], inv_d[i][j]);
+				}
+				packet.t0 = std::min(packet.t0, round_down(rays[i].min_t));
+			}
+
+			packet.t1 = far_end(rays, n);
+
+			// Rays parallel to an axis give infinite or NaN bounds, such packets
+			// are only culled ray by ray
+			bool bounded = true;
+			for (int j = 0; j < 3; j++)
+			{
+				bounded = bounded && std::isfinite(packet.inv_d[0][j]) && std::isfinite(packet.inv_d[1][j]);
+			}
 
-			if (root->bb.intersect(ray, t0, t1))
+			const int* sign = rays[0].sign;
+			struct Entry {
+				uint32_t node;
+				uint32_t first;
+			};
+			Entry stack[kMaxDepth];
+			int todo = 0;
+			Entry current = { 0, 0 };
+			while (true)
 			{
-				find_closest_hit(ray, root, &isect, t0, t1);
-				if (isect.primitive != NULL)
+				const LinearBVHNode& node = nodes[current.node];
+
+				uint32_t first = current.first;
+				bool visit = !bounded || intersect_packet(node, packet, sign);
+
+				// Rays before the first one to hit a node miss its children
+				while (visit && first < n && !intersect_node(node, o[first], inv_d[first], sign,
+					round_down(rays[first].min_t), round_up(rays[first].max_t) * 1.0000004f))
+				{
+					first++;
+				}
+
+				if (visit && first < n)
+				{
+					if (node.count == 0)
+					{
+						// visit the child on the near side of the split first
+						if (sign[node.axis])
+						{
+							stack[todo++] = { current.node + 1, first };
+							current = { node.offset, first };
+						}
+						else
+						{
+							stack[todo++] = { node.offset, first };
+							current = { current.node + 1, first };
+						}
+						continue;
+					}
+
+					for (uint32_t i = first; i < n; i++)
+					{
+						if (i == first || intersect_node(node, o[i], inv_d[i], sign,
+							round_down(rays[i].min_t), round_up(rays[i].max_t) * 1.0000004f))
+						{
+							if (intersectLeaf(node.offset, node.count, o[i], d[i], rays[i], &isects[i], closest[i]))
+							{
+								hits[i] = true;
+							}
+						}
+					}
+					packet.t1 = far_end(rays, n);
+				}
+
+				if (todo == 0)
 				{
-					return true;
+					break;
 				}
+				current = stack[--todo];
+			}
+
+			for (size_t i = 0; i < n; i++)
+			{
+				finishHit(closest[i], rays[i], &isects[i]);
 			}
+		}
 
-			return false;
+		bool BVHAccel::intersect(const Ray& ray) const {
+			// TODO (PathTracer):
+			// Implement ray - bvh aggregate intersection test. A ray intersects
+			// with a BVH aggregate if and only if it intersects a primitive in
+			// the BVH that is not an aggregate.
+			if (width == 4) return traverseWide(nodes4, ray, nullptr);
+			if (width == 8) return traverseWide(nodes8, ray, nullptr);
+			return traverse(ray, nullptr);
 		}
 
 		bool BVHAccel::intersect(const Ray& ray, Intersection* isect) const {
@@ -110,20 +1742,126 @@ namespace CMU462 {
 			// the BVH that is not an aggregate. When an intersection does happen.
 			// You should store the non-aggregate primitive in the intersection data
 			// and not the BVH aggregate itself.
+			if (width == 4) return traverseWide(nodes4, ray, isect);
+			if (width == 8) return traverseWide(nodes8, ray, isect);
+			return traverse(ray, isect);
+		}
 
-			double t0 = ray.min_t, t1 = ray.max_t;
+		BVHInstance::BVHInstance(BVHAccel* bvh, const Matrix4x4& transform)
+			: bvh(bvh)
+		{
+			set_transform(transform);
+		}
 
-			if (root->bb.intersect(ray, t0, t1))
-			{
+		BVHInstance::~BVHInstance()
+		{
+			delete bvh;
+		}
 
-				find_closest_hit(ray, root, isect, t0, t1);
-				if (isect->primitive!=nullptr)
+		bool BVHInstance::is_identity(const Matrix4x4& transform)
+		{
+			for (int i = 0; i < 4; i++)
+			{
+				for (int j = 0; j < 4; j++)
 				{
-					return true;
+					if (transform(i, j) != (i == j ? 1. : 0.))
+					{
+						return false;
+					}
 				}
 			}
+			return true;
+		}
+
+		void BVHInstance::set_transform(const Matrix4x4& transform)
+		{
+			this->transform = transform;
+			inverse = transform.inv();
+			normalTransform = inverse.T();
+			identity = is_identity(transform);
+		}
+
+		BBox BVHInstance::get_bbox() const
+		{
+			BBox bounds = bvh->get_bbox();
+			if (identity || bvh->primitives.empty())
+			{
+				return bounds;
+			}
+
+			BBox world;
+			for (int i = 0; i < 8; i++)
+			{
+				Vector3D corner(i & 1 ? bounds.max.x : bounds.min.x,
+					i & 2 ? bounds.max.y : bounds.min.y,
+					i & 4 ? bounds.max.z : bounds.min.z);
+				world.expand((transform * Vector4D(corner, 1.0)).to3D());
+			}
+			return world;
+		}
+
+		Ray BVHInstance::to_object(const Ray& r) const
+		{
+			Ray local = r.transform_by(inverse);
+			local.depth = r.depth;
+			local.min_t = r.min_t;
+			local.max_t = r.max_t;
+			return local;
+		}
+
+		bool BVHInstance::intersect(const Ray& r) const
+		{
+			if (identity)
+			{
+				return bvh->intersect(r);
+			}
+
+			Ray local = to_object(r);
+			if (!bvh->intersect(local))
+			{
+				return false;
+			}
+			r.max_t = local.max_t;
+			return true;
+		}
+
+		bool BVHInstance::intersect(const Ray& r, Intersection* isect) const
+		{
+			if (identity)
+			{
+				return bvh->intersect(r, isect);
+			}
+
+			Ray local = to_object(r);
+			if (!bvh->intersect(local, isect))
+			{
+				return false;
+			}
+			r.max_t = local.max_t;
+			isect->n = (normalTransform * Vector4D(isect->n, 0.0)).to3D().unit();
+			return true;
+		}
+
+		void BVHInstance::draw(const Color& c) const
+		{
+			glPushMatrix();
+			glMultMatrixd(&transform(0, 0));
+			for (const Primitive* p : bvh->primitives)
+			{
+				p->draw(c);
+			}
+			glPopMatrix();
+		}
 
-			return false;
+		void BVHInstance::drawOutline(const Color& c) const
+		{
+			glPushMatrix();
+			glMultMatrixd(&transform(0, 0));
+			for (const Primitive* p : bvh->primitives)
+			{
+				p->drawOutline(c);
+			}
+			glPopMatrix();
 		}
 
 	}  // namespace StaticScene
@@ -4,7 +4,9 @@
 #include "static_scene/scene.h"
 #include "static_scene/aggregate.h"
 #include "bbox.h"
+#include <string>
 #include <vector>
+#include <stdint.h>
 
 namespace CMU462 {
 	namespace StaticScene {
@@ -20,9 +22,9 @@ namespace CMU462 {
 		 * constructing the BVH.
 		 */
 		struct BVHNode {
-			BVHNode() { bb = BBox(); start = 0; range = -1; l = nullptr; r = nullptr; }
+			BVHNode() { bb = BBox(); start = 0; range = -1; axis = 0; l = nullptr; r = nullptr; }
 			BVHNode(BBox bb, size_t start, size_t range)
-				: bb(bb), start(start), range(range), l(nullptr), r(nullptr) {}
+				: bb(bb), start(start), range(range), axis(0), l(nullptr), r(nullptr) {}
 
 			inline bool isLeaf() const { return l == nullptr && r == nullptr; }
 
@@ -40,6 +42,7 @@ namespace CMU462 {
 			* Initiate interior node
 			*/
 			void InitInterior(int axis, BVHNode* c0, BVHNode* c1, size_t start, size_t range) {
+				this->axis = axis;
 				l = c0;
 				r = c1;
 				bb = c0->bb;
@@ -51,10 +54,63 @@ namespace CMU462 {
 			BBox bb;       ///< bounding box of the node
 			size_t start;  ///< start index into the primitive list
 			size_t range;  ///< range of index into the primitive list
+			int axis;      ///< split axis of an interior node
 			BVHNode* l;    ///< left child node
 			BVHNode* r;    ///< right child node
 		};
 
+		/**
+		 * A node of the flattened BVH used for traversal. Nodes are stored depth
+		 * first, so the first child of an interior node directly follows it and
+		 * only the offset of the second child is stored. Bounds are rounded
+		 * outwards to float so that a node never misses a ray that its BVHNode
+		 * would hit.
+		 */
+		struct LinearBVHNode {
+			float min[3];         ///< min corner of the bounding box
+			float max[3];         ///< max corner of the bounding box
+			uint32_t offset;      ///< first primitive of a leaf, second child of an interior node
+			uint32_t count : 30;  ///< number of primitives of a leaf, 0 for interior nodes
+			uint32_t axis : 2;    ///< split axis of an interior node
+		};
+
+		static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
+
+		/**
+		 * A node of a wide BVH collapsed from the binary tree, with up to N
+		 * children. The child bounds are stored per axis so that one SIMD slab
+		 * test checks all children, unused children have empty bounds and are
+		 * never hit. Bounds are rounded outwards to float like LinearBVHNode.
+		 */
+		template <int N>
+		struct WideBVHNode {
+			float min[3][N];      ///< min corners of the child bounding boxes per axis
+			float max[3][N];      ///< max corners of the child bounding boxes per axis
+			uint32_t child[N];    ///< first primitive of a leaf child, node of an interior child
+			uint32_t count[N];    ///< number of primitives of a leaf child, 0 for interior children
+		};
+
+		/**
+		 * Four triangles of a BVH leaf packed for SIMD intersection, each stored
+		 * as a vertex and the two edges from it in float. Unused triangles have
+		 * zero edges and are never hit.
+		 */
+		struct TriangleBlock {
+			float p0[3][4];          ///< first vertices per axis
+			float e1[3][4];          ///< edges to the second vertices per axis
+			float e2[3][4];          ///< edges to the third vertices per axis
+			uint32_t primitive[4];   ///< indices of the triangles in the primitives
+		};
+
+		/**
+		 * The packed triangles of a leaf, which are the first primitives of the
+		 * leaf. The other primitives are intersected through Primitive.
+		 */
+		struct LeafTriangles {
+			uint32_t block;      ///< first TriangleBlock of the leaf
+			uint32_t triangles;  ///< number of triangles in the leaf
+		};
+
 		/**
 		 * For each primitive to be stored in the BVH, we store the centroid of its bounding box,
 		 * its complete bounding box, and its index in the primitives array in an instance of the
@@ -69,6 +125,20 @@ namespace CMU462 {
 			Vector3D centroid;
 		};
 
+		/**
+		 * Statistics of a BVH for comparing builds. The SAH cost is the expected
+		 * cost of a ray through the root, with a node visit costing 1/8 of a
+		 * primitive intersection as in the build.
+		 */
+		struct BVHStats {
+			size_t nodes;       ///< number of nodes
+			size_t leaves;      ///< number of leaves
+			size_t references;  ///< primitive references in leaves, more than the primitives with spatial splits
+			double sah;         ///< SAH cost of the tree
+		};
+
+		struct SpatialBuild;
+
 		/**
 		 * Bounding Volume Hierarchy for fast Ray - Primitive intersection.
 		 * Note that the BVHAccel is an Aggregate (A Primitive itself) that contains
@@ -87,8 +157,19 @@ namespace CMU462 {
 			 * in memory for the aggregate to function properly.
 			 * \param primitives primitives to build from
 			 * \param max_leaf_size maximum number of primitives to be stored in leaves
+			 * \param width branching factor of the traversed tree, 4 or 8 collapse
+			 *        the binary tree into a wide BVH whose children are tested
+			 *        together with SIMD
+			 * \param split_budget spatial splits (SBVH) may add up to this many
+			 *        primitive references per primitive, clipped to the split
+			 *        planes. 0 builds with object splits only
+			 * \param cache directory of cached trees, empty to always build.
+			 *        Trees are stored there after a build, keyed by a hash of
+			 *        the geometry of the primitives and the build settings, and
+			 *        memory mapped instead of built when the key matches
 			 */
-			BVHAccel(const std::vector<Primitive*>& primitives, size_t max_leaf_size = 4);
+			BVHAccel(const std::vector<Primitive*>& primitives, size_t max_leaf_size = 4, int width = 2,
+				float split_budget = 0, const std::string& cache = "");
 
 			/**
 			 * Destructor.
@@ -103,14 +184,12 @@ namespace CMU462 {
 			 */
 			BBox get_bbox() const;
 
-			//void find_closest_hit(const Ray& ray, BVHNode* node);
-
-			void find_closest_hit(const Ray& ray, BVHNode* node, Intersection* closest, double t0, double t1) const;
-
 			/**
 			 * Ray - Aggregate intersection.
 			 * Check if the given ray intersects with the aggregate (any primitive in
-			 * the aggregate), no intersection information is stored.
+			 * the aggregate), no intersection information is stored. This is an
+			 * occlusion query: traversal stops at the first hit found, which need
+			 * not be the closest one.
 			 * \param r ray to test intersection with
 			 * \return true if the given ray intersects with the aggregate,
 					   false otherwise
@@ -132,6 +211,21 @@ namespace CMU462 {
 			 */
 			bool intersect(const Ray& r, Intersection* i) const;
 
+			/**
+			 * Ray packet - Aggregate intersection.
+			 * Find the closest hits of n coherent rays, such as camera rays through
+			 * neighboring pixels, by traversing the tree with the whole packet.
+			 * Packets whose directions differ in sign, and wide trees, are
+			 * intersected one ray at a time.
+			 * \param rays rays to test intersection with
+			 * \param isects addresses to store intersection info of each ray
+			 * \param hits set to whether each ray intersects with the aggregate
+			 * \param n number of rays, at most kPacketSize
+			 */
+			void intersect(const Ray* rays, Intersection* isects, bool* hits, size_t n) const;
+
+			static const size_t kPacketSize = 64;  ///< maximum number of rays in a packet
+
 			/**
 			 * Get BSDF of the surface material
 			 * Note that this does not make sense for the BVHAccel aggregate
@@ -140,6 +234,32 @@ namespace CMU462 {
 			 */
 			BSDF* get_bsdf() const { return NULL; }
 
+			/**
+			 * Get the statistics of the tree.
+			 */
+			BVHStats stats() const;
+
+			/**
+			 * Refit the tree to new primitives given in the order of the
+			 * primitives the tree was built from, such as the triangles of the
+			 * next frame of a deforming mesh. The node bounds are recomputed
+			 * bottom-up and the tree is kept, which gets slower to traverse the
+			 * further the primitives move from where they were at the build.
+			 * The current primitives are compared against the new ones and must
+			 * still be valid.
+			 * \param primitives primitives to replace the current ones with
+			 * \return false if the number of primitives differs, in which case the
+			 *         tree is left untouched, or if refitting degraded the SAH
+			 *         cost of the tree too far from its cost when built. The tree
+			 *         should be rebuilt in both cases
+			 */
+			bool refit(const std::vector<Primitive*>& primitives);
+
+			/**
+			 * Whether the tree was loaded from the cache instead of built.
+			 */
+			bool is_cached() const { return cached; }
+
 			/**
 			 * Get entry point (root) - used in visualizer
 			 */
@@ -155,134 +275,6 @@ namespace CMU462 {
 			 */
 			void drawOutline(const Color& c) const {}
 
-			/**
-			 * recursively build BVH node
-			 */
-			BVHNode* recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo,
-				int start, int end, std::vector<Primitive*>& orderedPrims) {
-				BVHNode* node = new BVHNode();
-				// Compute bounds of all primitives in BVH node
-				BBox bounds;
-				for (int i = start; i < end; ++i) {
-					bounds.expand(primitiveInfo[i].bounds);
-				}
-
-				int firstPrimOffset = orderedPrims.size();
-				int nPrimitives = end - start;
-				if (nPrimitives <= maxPrimsInNode) {
-					// Create leaf BVHNode
-					for (int i = start; i < end; ++i) {
-						int primNum = primitiveInfo[i].primitiveNumber;
-						orderedPrims.push_back(primitives[primNum]);
-					}	
-					node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-				}
-				else {
-					// Compute bound of primitive centroids
-					BBox centroidBounds;
-					for (int i = start; i < end; ++i)
-						centroidBounds.expand(primitiveInfo[i].centroid);
-
-					// Partition primitives into two sets and build children
-					int mid;
-					float minCost[3];
-					int minCostSplitBucket[3];
-					constexpr int nBuckets = 12;
-
-					for (int dim = 0; dim < 3; ++dim) {
-
-						// Allocate BucketInfor for SAH partition buckets
-						struct BucketInfo {
-							int count = 0;
-							BBox bounds;
-						};
-						BucketInfo buckets[nBuckets];
-
-						// Initialize BucketInfo for SAH partition buckets
-						for (int i = start; i < end; ++i)
-						{
-							int b = nBuckets * centroidBounds.Offset(primitiveInfo[i].centroid)[dim];
-							if (b == nBuckets) {
-								b = nBuckets - 1;
-							}
-							buckets[b].count++;
-							buckets[b].bounds.expand(primitiveInfo[i].bounds);
-						}
-
-						// Compute costs for splitting after each bucket
-						float cost[nBuckets - 1];
-						for (int i = 0; i < nBuckets - 1; i++)
-						{
-							BBox b0, b1;
-							int count0 = 0, count1 = 0;
-							for (int j = 0; j <= i; j++)
-							{
-								b0.expand(buckets[j].bounds);
-								count0 += buckets[j].count;
-							}
-							for (int j = i + 1; j < nBuckets; j++)
-							{
-								b1.expand(buckets[j].bounds);
-								count1 += buckets[j].count;
-							}
-							cost[i] = .125f + (count0 * b0.surface_area() + count1 * b1.surface_area()) / bounds.surface_area();
-						}
-
-						// Find bucket to split at that minimizes SAH metric
-						minCost[dim] = cost[0];
-						minCostSplitBucket[dim] = 0;
-						for (int i = 1; i < nBuckets - 1; i++)
-						{
-							if (cost[i] < minCost[dim])
-							{
-								minCost[dim] = cost[i];
-								minCostSplitBucket[dim] = i;
-							}
-						}
-					}
-
-					int dim;
-					if (minCost[0] < minCost[1] && minCost[0] < minCost[2])
-						dim = 0;
-					else if (minCost[1] < minCost[2])
-						dim = 1;
-					else
-						dim = 2;
-
-					// Either create leaf or split primitives at selected SAH bucket
-					float leafCost = nPrimitives;
-					if (minCost[dim] < leafCost)
-					{
-						BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1,
-							[=](const BVHPrimitiveInfo& pi) {
-								int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim];
-								if (b == nBuckets)
-								{
-									b = nBuckets - 1;
-								}
-								return b <= minCostSplitBucket[dim];
-							});
-						mid = pmid - &primitiveInfo[0];
-						node->InitInterior(dim,
-							recursiveBuild(primitiveInfo, start, mid, orderedPrims),
-							recursiveBuild(primitiveInfo, mid, end, orderedPrims), firstPrimOffset, nPrimitives);
-					}
-					else
-					{
-						// Create leaf BVHBuildNode
-						for (int i = start; i < end; i++)
-						{
-							int primNum = primitiveInfo[i].primitiveNumber;
-							orderedPrims.push_back(primitives[primNum]);
-						}
-						node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-					}
-				}
-
-				return node;
-
-			}
-
 			void recursiveDelete(BVHNode *node)
 			{
 				if (!node->isLeaf())
@@ -294,8 +286,230 @@ namespace CMU462 {
 			}
 
 		private:
+			/**
+			 * Maximum depth of the tree, which bounds the traversal stack
+			 */
+			static const int kMaxDepth = 64;
+
+			/**
+			 * Recursively build the BVH node over primitiveInfo[start, end), nodes
+			 * at the maximum depth are leaves. The primitive info is partitioned in
+			 * place, so the primitives of a leaf are its range of the array.
+			 */
+			BVHNode* recursiveBuild(BVHPrimitiveInfo* primitiveInfo, int start, int end, int depth);
+
+			/**
+			 * Recursively build the BVH node over the references refs, choosing
+			 * between the best object split and the best spatial split. Leaves
+			 * append their references to the ordered references of the build.
+			 */
+			BVHNode* spatialBuild(std::vector<BVHPrimitiveInfo>& refs, SpatialBuild& build, int depth);
+
+			/**
+			 * Recompute the bounds of the subtree of node from its primitives,
+			 * large subtrees are refitted as OpenMP tasks.
+			 */
+			void refitNode(BVHNode* node);
+
+			/**
+			 * Hash the geometry of the primitives in their input order, which
+			 * covers the positions and indices of triangles, together with the
+			 * build settings.
+			 */
+			uint64_t cacheKey(float split_budget) const;
+
+			/**
+			 * Load the tree of the input primitives from a cache file, which is
+			 * checked against the key and the primitives.
+			 * \return false if the file is missing or does not match, in which
+			 *         case the tree is left untouched
+			 */
+			bool loadCache(const std::string& path, uint64_t key);
+
+			/**
+			 * Store the built tree in a cache file, replacing it atomically.
+			 */
+			void saveCache(const std::string& path, uint64_t key);
+
+			/**
+			 * Rebuild the subtree of the flattened node at index, whose leaves
+			 * must lie within the first references primitives.
+			 * \return null if the flattened nodes are not a valid tree
+			 */
+			BVHNode* unflatten(const LinearBVHNode* flat, uint32_t count, uint32_t index, size_t references,
+				int depth);
+
+			/**
+			 * Append the subtree of node to the flattened nodes depth first.
+			 * \return index of the node
+			 */
+			uint32_t flatten(const BVHNode* node);
+
+			/**
+			 * Put the primitives of the leaves in the subtree of node in their
+			 * order and pack their triangles into blocks, moving them to the
+			 * front of their leaves.
+			 * \param inputs primitives the tree was built from
+			 */
+			void pack(const BVHNode* node, const std::vector<Primitive*>& inputs);
+
+			/**
+			 * Pack count triangles from primitive first on into a block.
+			 */
+			TriangleBlock packBlock(uint32_t first, uint32_t count) const;
+
+			/**
+			 * Closest packed triangle hit during traversal, which is stored in
+			 * the intersection once traversal is done.
+			 */
+			struct TriangleHit {
+				TriangleHit() : primitive(-1) {}
+				bool found() const { return primitive != uint32_t(-1); }
+				uint32_t primitive;
+				float u, v;
+			};
+
+			/**
+			 * Intersect the ray with the primitives of the leaf starting at
+			 * offset, packed triangles first. Like traverse(), stops at the
+			 * first hit if isect is null.
+			 */
+			bool intersectLeaf(uint32_t offset, uint32_t count, const float o[3], const float d[3],
+				const Ray& ray, Intersection* isect, TriangleHit& closest) const;
+
+			/**
+			 * Store the closest hit of a traversal in isect if it was on a
+			 * packed triangle.
+			 */
+			void finishHit(const TriangleHit& closest, const Ray& ray, Intersection* isect) const;
+
+			/**
+			 * Find the closest hit of the ray and store it in isect, or any hit
+			 * if isect is null.
+			 */
+			bool traverse(const Ray& ray, Intersection* isect) const;
+
+			/**
+			 * intersect() for packets of rays that agree in direction signs.
+			 * Nodes are culled for the whole packet by interval bounds of the
+			 * rays, and otherwise visited from the first ray that hits them.
+			 */
+			void traversePacket(const Ray* rays, Intersection* isects, bool* hits, size_t n) const;
+
+			/**
+			 * Append the wide node that collapses the subtree of node, opening
+			 * the interior child with the largest surface area until the node
+			 * has N children.
+			 * \return index of the node
+			 */
+			template <int N>
+			uint32_t collapse(const BVHNode* node, std::vector<WideBVHNode<N> >& wide);
+
+			/**
+			 * traverse() over a wide BVH, children that are hit are visited
+			 * nearest first.
+			 */
+			template <int N>
+			bool traverseWide(const std::vector<WideBVHNode<N> >& wide, const Ray& ray, Intersection* isect) const;
+
 			BVHNode* root;  ///< root node of the BVH
 			int maxPrimsInNode;
+			int width;      ///< number of children of the traversed nodes
+			size_t numInputs;  ///< number of primitives the tree was built from
+			double builtCost;  ///< SAH cost of the tree when it was built
+			bool cached;       ///< whether the tree was loaded from the cache
+			std::vector<uint32_t> order;  ///< index of each primitive in the primitives the tree was built from
+			std::vector<LinearBVHNode> nodes;  ///< flattened tree, nodes[0] is the root
+			std::vector<WideBVHNode<4> > nodes4;  ///< 4-wide tree if width is 4
+			std::vector<WideBVHNode<8> > nodes8;  ///< 8-wide tree if width is 8
+			std::vector<TriangleBlock> blocks;          ///< packed triangles of the leaves
+			std::vector<LeafTriangles> leafTriangles;   ///< packed triangles of the leaf starting at each primitive
+		};
+
+		/**
+		 * An object placed in the scene by a transform, for the top level of a
+		 * two-level BVH. The BVH of the object is built in object space and rays
+		 * are transformed into object space on entry, so moving the object only
+		 * changes the bounding box of the instance. Directions are transformed
+		 * without normalizing, so hit times are the same in both spaces.
+		 */
+		class BVHInstance : public Primitive {
+		public:
+			/**
+			 * Constructor.
+			 * \param bvh BVH of the object in object space, owned by the instance
+			 * \param transform object to world space transform
+			 */
+			BVHInstance(BVHAccel* bvh, const Matrix4x4& transform);
+
+			/**
+			 * Destructor.
+			 * Destroys the BVH of the object but not its primitives.
+			 */
+			~BVHInstance();
+
+			/**
+			 * Whether a transform leaves rays unchanged, instances with such
+			 * transforms intersect their BVH directly.
+			 */
+			static bool is_identity(const Matrix4x4& transform);
+
+			/**
+			 * Move the object, the BVH that instances it must be rebuilt.
+			 */
+			void set_transform(const Matrix4x4& transform);
+
+			/**
+			 * Get the BVH of the object.
+			 */
+			BVHAccel* get_bvh() const { return bvh; }
+
+			/**
+			 * Get the world space bounding box of the transformed BVH.
+			 */
+			BBox get_bbox() const;
+
+			bool test() const { return false; }
+
+			/**
+			 * Ray - Instance intersection, see BVHAccel::intersect().
+			 */
+			bool intersect(const Ray& r) const;
+
+			/**
+			 * Ray - Instance intersection 2, the primitive stored in the
+			 * intersection is the primitive of the object that was hit and the
+			 * normal is in world space.
+			 */
+			bool intersect(const Ray& r, Intersection* i) const;
+
+			/**
+			 * Instances have no surface material of their own.
+			 */
+			BSDF* get_bsdf() const { return NULL; }
+
+			/**
+			 * Draw the primitives of the object with OpenGL, transformed
+			 */
+			void draw(const Color& c) const;
+
+			/**
+			 * Draw the outlines of the primitives of the object with OpenGL,
+			 * transformed
+			 */
+			void drawOutline(const Color& c) const;
+
+		private:
+			/**
+			 * Get the ray in object space, with the same extent.
+			 */
+			Ray to_object(const Ray& r) const;
+
+			BVHAccel* bvh;           ///< BVH of the object
+			Matrix4x4 transform;     ///< object to world space transform
+			Matrix4x4 inverse;       ///< world to object space transform
+			Matrix4x4 normalTransform;  ///< object to world space transform of normals
+			bool identity;           ///< whether the transform is the identity
 		};
 
 	}  // namespace StaticScene
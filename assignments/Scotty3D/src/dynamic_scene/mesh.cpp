@@ -909,13 +909,15 @@ namespace CMU462 {
 
 			Matrix4x4 transform = T * R_homogeneous * S;
 
+			// The mesh stays in object space, the transform places it so that
+			// moving it does not rebuild its BVH
 			for (VertexIter v = mesh.verticesBegin(); v != mesh.verticesEnd(); v++) {
 				originalPositions.push_back(v->position);
-				Vector4D tmp = Vector4D(v->position + v->offset * v->normal(), 1.0);
-				v->position = (transform * tmp).to3D();
+				v->position += v->offset * v->normal();
 			}
 
 			StaticScene::SceneObject* output = new StaticScene::Mesh(mesh, bsdf);
+			output->transform = transform;
 
 			int i = 0;
 			for (VertexIter v = mesh.verticesBegin(); v != mesh.verticesEnd(); v++) {
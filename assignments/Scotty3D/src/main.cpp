@@ -29,6 +29,9 @@ void usage(const char* binaryName) {
   printf("  -l  <INT>        Number of samples per area light\n");
   printf("  -t  <INT>        Number of render threads\n");
   printf("  -m  <INT>        Maximum ray depth\n");
+  printf("  -f               Trace paths wavefront, a bounce at a time\n");
+  printf("  -b  <FLOAT>      BVH spatial split references per primitive\n");
+  printf("  -c  <PATH>       Directory to cache built BVHs in\n");
   printf("  -e  <PATH>       Path to environment map\n");
   printf("  -w  <PATH>       Run Pathtracer without GUI, save render to PATH\n");
   printf("  -h               Print this help message\n");
@@ -75,7 +78,7 @@ int main(int argc, char** argv) {
   // get the options
   AppConfig config;
   int opt;
-  while ((opt = getopt(argc, argv, "s:l:t:m:e:w:h")) !=
+  while ((opt = getopt(argc, argv, "s:l:t:m:fb:c:e:w:h")) !=
          -1) {  // for each option...
     switch (opt) {
       case 's':
@@ -90,6 +93,15 @@ int main(int argc, char** argv) {
       case 'm':
         config.pathtracer_max_ray_depth = atoi(optarg);
         break;
+      case 'f':
+        config.pathtracer_wavefront = true;
+        break;
+      case 'b':
+        config.pathtracer_split_budget = atof(optarg);
+        break;
+      case 'c':
+        config.pathtracer_bvh_cache = optarg;
+        break;
       case 'e':
         config.pathtracer_envmap = load_exr(optarg);
         break;
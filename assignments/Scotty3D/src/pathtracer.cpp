@@ -5,6 +5,8 @@
 #include <stack>
 #include <random>
 #include <algorithm>
+#include <typeindex>
+#include <typeinfo>
 
 #include "CMU462/CMU462.h"
 #include "CMU462/vector3D.h"
@@ -26,10 +28,21 @@ namespace CMU462 {
 
 //#define ENABLE_RAY_LOGGING 1
 
+	// camera rays are traced in packets of kPacketWidth x kPacketWidth pixels
+	static const size_t kPacketWidth = 8;
+
+	// the wavefront integrator traces at most this many paths of a tile at
+	// once, which bounds the memory of its queues
+	static const size_t kWavefrontBatch = 1 << 16;
+
 	PathTracer::PathTracer(size_t ns_aa, size_t max_ray_depth, size_t ns_area_light,
 		size_t ns_diff, size_t ns_glsy, size_t ns_refr,
-		size_t num_threads, HDRImageBuffer * envmap) {
+		size_t num_threads, HDRImageBuffer * envmap, bool wavefront, float split_budget,
+		const string& bvh_cache) {
 		state = INIT, this->ns_aa = ns_aa;
+		this->wavefront = wavefront;
+		this->split_budget = split_budget;
+		this->bvh_cache = bvh_cache;
 		this->max_ray_depth = max_ray_depth;
 		this->ns_area_light = ns_area_light;
 		this->ns_diff = ns_diff;
@@ -63,7 +76,7 @@ namespace CMU462 {
 	}
 
 	PathTracer::~PathTracer() {
-		delete bvh;
+		delete_accel();
 		delete gridSampler;
 		delete hemisphereSampler;
 	}
@@ -75,7 +88,7 @@ namespace CMU462 {
 
 		if (this->scene != nullptr) {
 			delete scene;
-			delete bvh;
+			delete_accel();
 			selectionHistory.pop();
 		}
 
@@ -91,6 +104,76 @@ namespace CMU462 {
 		}
 	}
 
+	// Whether any object of the scene is placed by a transform, in which case
+	// the objects are instanced by a two-level BVH
+	static bool has_transforms(const Scene* scene) {
+		for (SceneObject* obj : scene->objects) {
+			if (!BVHInstance::is_identity(obj->transform)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void PathTracer::update_scene(Scene* scene) {
+		if (state != READY) {
+			return;
+		}
+
+		if (this->envLight != nullptr) {
+			scene->lights.push_back(this->envLight);
+		}
+
+		if (scene->objects.size() != this->scene->objects.size() ||
+			has_transforms(scene) == instances.empty()) {
+			this->scene = scene;
+			delete_accel();
+			selectionHistory.pop();
+			build_accel();
+			return;
+		}
+
+		// The BVHs are refitted to the primitives of the new frame and only
+		// rebuilt if their primitives changed or refitting degraded them. The
+		// previous frame is left to the caller as in clear()
+		fprintf(stdout, "[PathTracer] Refitting BVH... ");
+		fflush(stdout);
+		timer.start();
+		size_t rebuilt = 0;
+		if (instances.empty()) {
+			vector<Primitive*> primitives;
+			for (SceneObject* obj : scene->objects) {
+				const vector<Primitive*>& obj_prims = obj->get_primitives();
+				primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
+			}
+			if (!bvh->refit(primitives)) {
+				delete bvh;
+				bvh = new BVHAccel(primitives, 4, 2, split_budget);
+				rebuilt++;
+			}
+		} else {
+			for (size_t i = 0; i < instances.size(); i++) {
+				SceneObject* obj = scene->objects[i];
+				vector<Primitive*> primitives = obj->get_primitives();
+				if (instances[i]->get_bvh()->refit(primitives)) {
+					instances[i]->set_transform(obj->transform);
+				} else {
+					delete instances[i];
+					instances[i] = new BVHInstance(new BVHAccel(primitives, 4, 2, split_budget), obj->transform);
+					rebuilt++;
+				}
+			}
+			delete bvh;
+			bvh = new BVHAccel(vector<Primitive*>(instances.begin(), instances.end()), 1);
+		}
+		this->scene = scene;
+		timer.stop();
+		fprintf(stdout, "Done! (%.4f sec, %lu BVHs rebuilt)\n", timer.duration(), rebuilt);
+
+		selectionHistory.pop();
+		selectionHistory.push(bvh->get_root());
+	}
+
 	void PathTracer::set_camera(Camera* camera) {
 		if (state != INIT) {
 			return;
@@ -163,8 +246,7 @@ namespace CMU462 {
 
 	void PathTracer::clear() {
 		if (state != READY) return;
-		delete bvh;
-		bvh = NULL;
+		delete_accel();
 		scene = NULL;
 		camera = NULL;
 		selectionHistory.pop();
@@ -217,11 +299,17 @@ namespace CMU462 {
 		fprintf(stdout, "[PathTracer] Collecting primitives... ");
 		fflush(stdout);
 		timer.start();
-		vector<Primitive*> primitives;
+		bool instanced = has_transforms(scene);
+		vector<vector<Primitive*> > objectPrimitives;
 		for (SceneObject* obj : scene->objects) {
-			const vector<Primitive*>& obj_prims = obj->get_primitives();
-			primitives.reserve(primitives.size() + obj_prims.size());
-			primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
+			objectPrimitives.push_back(obj->get_primitives());
+		}
+		vector<Primitive*> primitives;
+		if (!instanced) {
+			for (const vector<Primitive*>& obj_prims : objectPrimitives) {
+				primitives.reserve(primitives.size() + obj_prims.size());
+				primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
+			}
 		}
 		timer.stop();
 		fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
@@ -230,14 +318,41 @@ namespace CMU462 {
 		fprintf(stdout, "[PathTracer] Building BVH... ");
 		fflush(stdout);
 		timer.start();
-		bvh = new BVHAccel(primitives);
+		if (instanced) {
+			// Objects placed by a transform get a BVH each in object space,
+			// which a top level BVH instances
+			for (size_t i = 0; i < scene->objects.size(); i++) {
+				instances.push_back(new BVHInstance(
+					new BVHAccel(objectPrimitives[i], 4, 2, split_budget, bvh_cache), scene->objects[i]->transform));
+			}
+			bvh = new BVHAccel(vector<Primitive*>(instances.begin(), instances.end()), 1);
+		} else {
+			bvh = new BVHAccel(primitives, 4, 2, split_budget, bvh_cache);
+		}
 		timer.stop();
-		fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+		size_t cached = bvh->is_cached() ? 1 : 0;
+		for (BVHInstance* instance : instances) {
+			cached += instance->get_bvh()->is_cached() ? 1 : 0;
+		}
+		fprintf(stdout, "Done! (%.4f sec, %lu BVHs loaded from cache)\n", timer.duration(), cached);
+
+		BVHStats stats = bvh->stats();
+		fprintf(stdout, "[PathTracer] BVH: %lu nodes, %lu leaves, %lu references, SAH cost %.2f\n",
+			stats.nodes, stats.leaves, stats.references, stats.sah);
 
 		// initial visualization //
 		selectionHistory.push(bvh->get_root());
 	}
 
+	void PathTracer::delete_accel() {
+		delete bvh;
+		bvh = NULL;
+		for (BVHInstance* instance : instances) {
+			delete instance;
+		}
+		instances.clear();
+	}
+
 	void PathTracer::log_ray_miss(const Ray& r) {
 		rayLog.push_back(LoggedRay(r, -1.0));
 	}
@@ -396,8 +511,11 @@ namespace CMU462 {
 
 	Spectrum PathTracer::trace_ray(const Ray& r) {
 		Intersection isect;
+		return shade_ray(r, bvh->intersect(r, &isect) ? &isect : nullptr);
+	}
 
-		if (!bvh->intersect(r, &isect)) {
+	Spectrum PathTracer::shade_ray(const Ray& r, const Intersection* hit) {
+		if (!hit) {
 			// log ray miss
 #ifdef ENABLE_RAY_LOGGING
 			log_ray_miss(r);
@@ -416,6 +534,8 @@ namespace CMU462 {
 			}
 		}
 
+		const Intersection& isect = *hit;
+
 		// log ray hit
 #ifdef ENABLE_RAY_LOGGING
 		log_ray_hit(r, isect.t);
@@ -559,6 +679,242 @@ namespace CMU462 {
 		return Spectrum(spectrum.r / ns_aa, spectrum.g / ns_aa, spectrum.b / ns_aa);
 	}
 
+	void PathTracer::raytrace_packet(size_t x0, size_t y0, size_t w, size_t h) {
+		// Camera rays through neighboring pixels are coherent, each sample of
+		// the block is intersected as one packet
+		size_t n = w * h;
+		std::vector<Ray> rays;
+		rays.reserve(n);
+		Intersection isects[BVHAccel::kPacketSize];
+		bool hits[BVHAccel::kPacketSize];
+		Spectrum spectrum[BVHAccel::kPacketSize];
+
+		for (size_t i = 0; i < ns_aa; i++)
+		{
+			rays.clear();
+			for (size_t y = y0; y < y0 + h; y++)
+			{
+				for (size_t x = x0; x < x0 + w; x++)
+				{
+					// jittered within the pixel, each ray of the packet its own sample
+					Vector2D sample = gridSampler->get_sample();
+					Vector2D p = Vector2D((x + sample.x) / (double)camera->width(), (y + sample.y) / (double)camera->height());
+					rays.push_back(camera->generate_ray(p.x, p.y));
+				}
+			}
+
+			bvh->intersect(rays.data(), isects, hits, n);
+			for (size_t j = 0; j < n; j++)
+			{
+				spectrum[j] += shade_ray(rays[j], hits[j] ? &isects[j] : nullptr);
+			}
+		}
+
+		for (size_t j = 0; j < n; j++)
+		{
+			const Spectrum& s = spectrum[j];
+			sampleBuffer.update_pixel(Spectrum(s.r / ns_aa, s.g / ns_aa, s.b / ns_aa), x0 + j % w, y0 + j / w);
+		}
+	}
+
+	// Queue of paths or shadow rays of the wavefront integrator, stored by
+	// field. weight is the throughput of a path up to its ray, or the light a
+	// shadow ray carries if it is not occluded.
+	struct RayQueue {
+		vector<Ray> rays;
+		vector<Spectrum> weight;
+		vector<uint32_t> pixel;
+
+		size_t size() const { return rays.size(); }
+
+		void push(const Ray& r, const Spectrum& w, uint32_t p) {
+			rays.push_back(r);
+			weight.push_back(w);
+			pixel.push_back(p);
+		}
+
+		void clear() {
+			rays.clear();
+			weight.clear();
+			pixel.clear();
+		}
+
+		void swap(RayQueue& q) {
+			rays.swap(q.rays);
+			weight.swap(q.weight);
+			pixel.swap(q.pixel);
+		}
+	};
+
+	void PathTracer::raytrace_wavefront(size_t x0, size_t y0, size_t x1, size_t y1) {
+		size_t w = x1 - x0;
+		vector<Spectrum> L(w * (y1 - y0));
+		RayQueue paths, next, shadows;
+		vector<Intersection> isects;
+		vector<size_t> order;
+
+		// the samples of the tile are traced in batches, sample s is sample
+		// s / area of pixel s % area
+		size_t area = w * (y1 - y0);
+		size_t total = ns_aa * area;
+		for (size_t s0 = 0; s0 < total && continueRaytracing; s0 += kWavefrontBatch)
+		{
+			// generate: a camera path per sample of the batch
+			size_t s1 = min(s0 + kWavefrontBatch, total);
+			paths.clear();
+			for (size_t s = s0; s < s1; s++)
+			{
+				size_t x = x0 + (s % area) % w;
+				size_t y = y0 + (s % area) / w;
+				Vector2D sample = gridSampler->get_sample();
+				Vector2D p = Vector2D((x + sample.x) / (double)camera->width(), (y + sample.y) / (double)camera->height());
+				paths.push(camera->generate_ray(p.x, p.y), Spectrum(1, 1, 1), s % area);
+			}
+
+			for (size_t depth = 0; paths.size() > 0 && continueRaytracing; depth++)
+			{
+				// extend: find the closest hits, camera rays in packets
+				isects.resize(paths.size());
+				order.clear();
+				bool hits[BVHAccel::kPacketSize];
+				for (size_t j = 0; j < paths.size(); j += BVHAccel::kPacketSize)
+				{
+					size_t n = min(BVHAccel::kPacketSize, paths.size() - j);
+					if (depth == 0)
+					{
+						bvh->intersect(&paths.rays[j], &isects[j], hits, n);
+					}
+					else for (size_t k = 0; k < n; k++)
+					{
+						hits[k] = bvh->intersect(paths.rays[j + k], &isects[j + k]);
+					}
+
+					for (size_t k = 0; k < n; k++)
+					{
+						const Ray& r = paths.rays[j + k];
+						if (hits[k])
+						{
+#ifdef ENABLE_RAY_LOGGING
+							log_ray_hit(r, isects[j + k].t);
+#endif
+							order.push_back(j + k);
+							continue;
+						}
+#ifdef ENABLE_RAY_LOGGING
+						log_ray_miss(r);
+#endif
+						if (envLight)
+						{
+							L[paths.pixel[j + k]] += paths.weight[j + k] * envLight->sample_dir(r);
+						}
+					}
+				}
+
+				// shade: hits with the same kind of BSDF are shaded together
+				std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+					std::type_index ta = typeid(*isects[a].bsdf);
+					std::type_index tb = typeid(*isects[b].bsdf);
+					return ta < tb || (ta == tb && isects[a].bsdf < isects[b].bsdf);
+				});
+
+				next.clear();
+				shadows.clear();
+				for (size_t j : order)
+				{
+					const Ray& r = paths.rays[j];
+					const Intersection& isect = isects[j];
+					const Spectrum& beta = paths.weight[j];
+					uint32_t pixel = paths.pixel[j];
+
+					L[pixel] += beta * isect.bsdf->get_emission();
+
+					Vector3D hit_p = r.o + r.d * isect.t;
+					Matrix3x3 o2w;
+					make_coord_space(o2w, isect.n);
+					Matrix3x3 w2o = o2w.T();
+					Vector3D w_out = w2o * (r.o - hit_p);
+					w_out.normalize();
+
+					// direct lighting, as in trace_ray, queued as shadow rays
+					if (!isect.bsdf->is_delta()) {
+						Vector3D dir_to_light;
+						float dist_to_light;
+						float pr;
+						for (SceneLight* light : scene->lights) {
+							int num_light_samples = light->is_delta_light() ? 1 : ns_area_light;
+							for (int i = 0; i < num_light_samples; i++) {
+								const Spectrum& light_L = light->sample_L(hit_p, &dir_to_light, &dist_to_light, &pr);
+								const Vector3D& w_in = w2o * dir_to_light;
+								if (w_in.z < 0) continue;
+
+								float sumPr = isect.bsdf->pdf(w_out, w_in);
+								for (auto l : scene->lights)
+								{
+									int num_samples = l->is_delta_light() ? 1 : ns_area_light;
+									sumPr += num_samples * l->pdf(hit_p, dir_to_light);
+								}
+								const Spectrum& f = isect.bsdf->f(w_out, w_in);
+
+								Ray shadow_ray(hit_p + EPS_D * dir_to_light, dir_to_light);
+								shadow_ray.max_t = dist_to_light / dir_to_light.norm() - EPS_D;
+								shadows.push(shadow_ray, beta * (w_in.z / sumPr) * f * light_L, pixel);
+							}
+						}
+					}
+
+					// indirect lighting, the path continues with the weight that
+					// trace_ray gives the light from the next bounce
+					double depthP = r.depth < max_ray_depth ? 0.0 : 0.5;
+					if (((double)rand() / (double)RAND_MAX) < depthP)
+						continue;
+
+					Vector3D w_in;
+					float pdf;
+					Spectrum f = isect.bsdf->sample_f(w_out, &w_in, &pdf);
+					double cos_theta = w_in.z;
+					double terminateProbability = !isect.bsdf->is_delta() && f.illum() * fabs(w_in.z) < 0.0618f ? 0.8 : 0.0;
+					if (((double)std::rand() / (double)RAND_MAX) < terminateProbability)
+						continue;
+
+					Vector3D dir = o2w * w_in;
+					float sumPr = pdf;
+					if (!isect.bsdf->is_delta())
+					{
+						for (auto light : scene->lights)
+						{
+							int num_light_samples = light->is_delta_light() ? 1 : ns_area_light;
+							sumPr += num_light_samples * light->pdf(hit_p, dir);
+						}
+					}
+
+					// compact: surviving paths are appended to the next queue
+					next.push(Ray(hit_p + EPS_D * dir, dir, INF_D, r.depth + 1),
+						beta * f * (fabs(cos_theta) / (sumPr * (1 - terminateProbability) * (1 - depthP))), pixel);
+				}
+
+				// connect: unoccluded shadow rays add their light
+				for (size_t j = 0; j < shadows.size(); j++)
+				{
+					if (!bvh->intersect(shadows.rays[j]))
+					{
+						L[shadows.pixel[j]] += shadows.weight[j];
+					}
+				}
+
+				paths.swap(next);
+			}
+		}
+
+		for (size_t y = y0; y < y1; y++)
+		{
+			for (size_t x = x0; x < x1; x++)
+			{
+				const Spectrum& s = L[(x - x0) + (y - y0) * w];
+				sampleBuffer.update_pixel(Spectrum(s.r / ns_aa, s.g / ns_aa, s.b / ns_aa), x, y);
+			}
+		}
+	}
+
 	void PathTracer::raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h) {
 		size_t w = sampleBuffer.w;
 		size_t h = sampleBuffer.h;
@@ -573,11 +929,15 @@ namespace CMU462 {
 		size_t tile_idx_y = tile_y / imageTileSize;
 		size_t num_samples_tile = tile_samples[tile_idx_x + tile_idx_y * num_tiles_w];
 
-		for (size_t y = tile_start_y; y < tile_end_y; y++) {
+		if (wavefront) {
+			raytrace_wavefront(tile_start_x, tile_start_y, tile_end_x, tile_end_y);
+			if (!continueRaytracing) return;
+		}
+		else for (size_t y = tile_start_y; y < tile_end_y; y += kPacketWidth) {
 			if (!continueRaytracing) return;
-			for (size_t x = tile_start_x; x < tile_end_x; x++) {
-				Spectrum s = raytrace_pixel(x, y);
-				sampleBuffer.update_pixel(s, x, y);
+			for (size_t x = tile_start_x; x < tile_end_x; x += kPacketWidth) {
+				raytrace_packet(x, y, std::min(kPacketWidth, tile_end_x - x),
+					std::min(kPacketWidth, tile_end_y - y));
 			}
 		}
 
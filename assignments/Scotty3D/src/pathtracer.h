@@ -23,6 +23,9 @@ using CMU462::StaticScene::EnvironmentLight;
 
 using CMU462::StaticScene::BVHNode;
 using CMU462::StaticScene::BVHAccel;
+using CMU462::StaticScene::Intersection;
+using CMU462::StaticScene::BVHStats;
+using CMU462::StaticScene::BVHInstance;
 
 namespace CMU462 {
 
@@ -57,7 +60,8 @@ class PathTracer {
   PathTracer(size_t ns_aa = 1, size_t max_ray_depth = 4,
              size_t ns_area_light = 1, size_t ns_diff = 1, size_t ns_glsy = 1,
              size_t ns_refr = 1, size_t num_threads = 1,
-             HDRImageBuffer* envmap = NULL);
+             HDRImageBuffer* envmap = NULL, bool wavefront = false,
+             float split_budget = 0, const string& bvh_cache = "");
 
   /**
    * Destructor.
@@ -74,6 +78,17 @@ class PathTracer {
    */
   void set_scene(Scene* scene);
 
+  /**
+   * If in the READY state, replaces the scene with the next frame of it, in
+   * which objects may have moved or deformed. The BVHs of the objects are
+   * refitted to their new primitives and only rebuilt if an object changed
+   * its number of primitives or refitting degraded its BVH too far, the top
+   * level BVH over moved objects is rebuilt. Scenes that gained or lost
+   * objects are rebuilt as by set_scene.
+   * \param scene pointer to the new scene to be rendered
+   */
+  void update_scene(Scene* scene);
+
   /**
    * If in the INIT state, configures the pathtracer to use the given camera. If
    * configuration is done, transitions to the READY state.
@@ -157,6 +172,11 @@ class PathTracer {
    */
   void build_accel();
 
+  /**
+   * Delete acceleration structures.
+   */
+  void delete_accel();
+
   /**
    * Visualize acceleration structures.
    */
@@ -167,11 +187,31 @@ class PathTracer {
    */
   Spectrum trace_ray(const Ray& ray);
 
+  /**
+   * Shade a ray given its closest hit in the scene, or a miss if isect is
+   * null.
+   */
+  Spectrum shade_ray(const Ray& ray, const Intersection* isect);
+
   /**
    * Trace a camera ray given by the pixel coordinate.
    */
   Spectrum raytrace_pixel(size_t x, size_t y);
 
+  /**
+   * Trace the camera rays of a block of at most 8x8 pixels as packets and
+   * update the sample buffer. Bounces are traced one ray at a time.
+   */
+  void raytrace_packet(size_t x, size_t y, size_t w, size_t h);
+
+  /**
+   * Trace all samples of the pixels in [x0, x1) x [y0, y1) with the wavefront
+   * integrator and update the sample buffer. The paths are traced a bounce
+   * at a time in queues, with the same estimator as trace_ray, in batches
+   * of a bounded number of samples.
+   */
+  void raytrace_wavefront(size_t x0, size_t y0, size_t x1, size_t y1);
+
   /**
    * Raytrace a tile of the scene and update the frame buffer. Is run
    * in a worker thread.
@@ -215,6 +255,9 @@ class PathTracer {
   size_t ns_diff;        ///< number of samples - diffuse surfaces
   size_t ns_glsy;        ///< number of samples - glossy surfaces
   size_t ns_refr;        ///< number of samples - refractive surfaces
+  bool wavefront;        ///< trace the paths of a tile a bounce at a time
+  float split_budget;    ///< references per primitive BVH spatial splits may add
+  string bvh_cache;      ///< directory of cached BVHs, empty to always build
 
   // Integration state //
 
@@ -225,6 +268,7 @@ class PathTracer {
   // Components //
 
   BVHAccel* bvh;                 ///< BVH accelerator aggregate
+  vector<BVHInstance*> instances;  ///< objects instanced by bvh, if any object has a transform
   EnvironmentLight* envLight;    ///< environment map
   Sampler2D* gridSampler;        ///< samples unit grid
   Sampler3D* hemisphereSampler;  ///< samples unit hemisphere
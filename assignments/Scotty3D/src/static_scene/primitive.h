@@ -14,6 +14,8 @@ namespace StaticScene {
  */
 class Primitive {
  public:
+  virtual ~Primitive() {}
+
   /**
    * Get the world space bounding box of the primitive.
    * \return world space bounding box of the primitive
@@ -2,6 +2,7 @@
 #define CMU462_STATICSCENE_SCENE_H
 
 #include "CMU462/CMU462.h"
+#include "CMU462/matrix4x4.h"
 #include "primitive.h"
 
 #include <vector>
@@ -14,6 +15,8 @@ namespace CMU462 {
 		 */
 		class SceneObject {
 		public:
+			SceneObject() : transform(Matrix4x4::identity()) {}
+
 			/**
 			 * Get all the primitives in the scene object.
 			 * \return a vector of all the primitives in the scene object
@@ -25,6 +28,12 @@ namespace CMU462 {
 			 * \return the BSDF of the objects's surface
 			 */
 			virtual BSDF* get_bsdf() const = 0;
+
+			/**
+			 * Object to world space transform of the primitives. Objects whose
+			 * primitives are in object space are instanced by the BVH.
+			 */
+			Matrix4x4 transform;
 		};
 
 		/**
@@ -40,7 +49,8 @@ namespace CMU462 {
 
 		/**
 		 * Represents a scene in a raytracer-friendly format. To speed up raytracing,
-		 * all data is already transformed to world space.
+		 * all data is already transformed to world space, except for the
+		 * primitives of objects with a transform.
 		 */
 		struct Scene {
 			Scene(const std::vector<SceneObject*>& objects,
@@ -55,42 +55,24 @@ namespace CMU462 {
 		}
 
 		bool Sphere::intersect(const Ray& r, Intersection* isect) const {
-			// TODO (PathTracer):
+			// (PathTracer):
 			// Implement ray - sphere intersection.
 			// Note again that you might want to use the the Sphere::test helper here.
 			// When an intersection takes place, the Intersection data should be updated
 			// correspondingly.
-			double t1, t2;
-			if (test(r, t1, t2))
+			// The occlusion test finds the nearest root and shortens the ray to it,
+			// only the shading information is added here.
+			if (!intersect(r))
 			{
-				float t;
-				if (t1 > r.min_t && t1 < r.max_t)
-				{
-					t = t1;
-					r.max_t = t1;
-					isect->t = t1;
-					isect->primitive = this;
-					isect->n = normal(r.at_time(t1));
-					isect->bsdf = get_bsdf();
-
-					return true;
-				}
-				else if (t2 > r.min_t && t2 < r.max_t)
-				{
-					t = t2;
-					r.max_t = t2;
-					isect->t = t2;
-					isect->primitive = this;
-					isect->n = normal(r.at_time(t2));
-					isect->bsdf = get_bsdf();
-
+				return false;
+			}
 
-					return true;
-				}
+			isect->t = r.max_t;
+			isect->primitive = this;
+			isect->n = normal(r.at_time(r.max_t));
+			isect->bsdf = get_bsdf();
 
-				return true;
-			}
-			return false;
+			return true;
 		}
 
 		void Sphere::draw(const Color& c) const { Misc::draw_sphere_opengl(o, r, c); }
@@ -22,16 +22,15 @@ namespace CMU462 {
 			return bb;
 		}
 
-		bool Triangle::intersect(const Ray& r) const {
-			// TODO (PathTracer): implement ray-triangle intersection
-			Vector3D p0 = mesh->getPosition(v1);
-			Vector3D p1 = mesh->getPosition(v2);
-			Vector3D p2 = mesh->getPosition(v3);
-			Vector3D o = r.o;
-			Vector3D d = r.d;
+		bool Triangle::hit(const Ray& r, double& t, double& u, double& v) const {
+			// Moller-Trumbore, triangles facing away from the ray are culled
+			const Vector3D& p0 = mesh->positions[v1];
+			const Vector3D& p1 = mesh->positions[v2];
+			const Vector3D& p2 = mesh->positions[v3];
+			const Vector3D& d = r.d;
 			Vector3D e1 = p1 - p0;
 			Vector3D e2 = p2 - p0;
-			Vector3D s = o - p0;
+			Vector3D s = r.o - p0;
 			Vector3D e1_cross_d = cross(e1, d);
 			double det = dot(e1_cross_d, e2);
 			if (det < 0.000001)
@@ -42,9 +41,9 @@ namespace CMU462 {
 			double det1 = -dot(s_cross_e2, d);
 			double det2 = dot(e1_cross_d, s);
 			double det3 = -dot(s_cross_e2, e1);
-			double u = det1 / det;
-			double v = det2 / det;
-			double t = det3 / det;
+			u = det1 / det;
+			v = det2 / det;
+			t = det3 / det;
 
 			if (u > 1 || u < 0 || v>1 || v < 0 || (1 - u - v)>1 || (1 - u - v) < 0)
 			{
@@ -54,55 +53,50 @@ namespace CMU462 {
 			{
 				return false;
 			}
+			return true;
+		}
+
+		bool Triangle::intersect(const Ray& r) const {
+			// (PathTracer): ray-triangle intersection for occlusion queries, the
+			// normal and BSDF are not needed
+			double t, u, v;
+			if (!hit(r, t, u, v))
+			{
+				return false;
+			}
 			r.max_t = t;
 
 			return true;
 		}
 
 		bool Triangle::intersect(const Ray& r, Intersection* isect) const {
-			// TODO (PathTracer):
+			// (PathTracer):
 			// implement ray-triangle intersection. When an intersection takes
 			// place, the Intersection data should be updated accordingly
-			Vector3D p0 = mesh->getPosition(v1);
-			Vector3D p1 = mesh->getPosition(v2);
-			Vector3D p2 = mesh->getPosition(v3);
-			Vector3D o = r.o;
-			Vector3D d = r.d;
-			Vector3D e1 = p1 - p0;
-			Vector3D e2 = p2 - p0;
-			Vector3D s = o - p0;
-			Vector3D e1_cross_d = cross(e1, d);
-			double det = dot(e1_cross_d, e2);
-			if (det < 0.000001)
-			{
-				return false;
-			}
-			Vector3D s_cross_e2 = cross(s, e2);
-			double det1 = -dot(s_cross_e2, d);
-			double det2 = dot(e1_cross_d, s);
-			double det3 = -dot(s_cross_e2, e1);
-			double u = det1 / det;
-			double v = det2 / det;
-			double t = det3 / det;
-
-			if (u > 1 || u < 0 || v>1 || v < 0 || (1 - u - v)>1 || (1 - u - v) < 0)
-			{
-				return false;
-			}
-			if (t<r.min_t || t>r.max_t)
+			double t, u, v;
+			if (!hit(r, t, u, v))
 			{
 				return false;
 			}
 
 			r.max_t = t;
+			set_intersection(r, t, u, v, isect);
+
+			return true;
+		}
 
+		void Triangle::get_vertices(Vector3D& p0, Vector3D& p1, Vector3D& p2) const {
+			p0 = mesh->positions[v1];
+			p1 = mesh->positions[v2];
+			p2 = mesh->positions[v3];
+		}
+
+		void Triangle::set_intersection(const Ray& r, double t, double u, double v, Intersection* isect) const {
 			Vector3D N = (1 - u - v) * mesh->normals[v1] + u * mesh->normals[v2] + v * mesh->normals[v3];
 			isect->t = t;
 			isect->primitive = this;
-			isect->n = dot(d, N) <= 0 ? N : -N;
+			isect->n = dot(r.d, N) <= 0 ? N : -N;
 			isect->bsdf = get_bsdf();
-
-			return true;
 		}
 
 		void Triangle::draw(const Color& c) const {
@@ -32,8 +32,9 @@ class Triangle : public Primitive {
 	  return false;
   }//FIXME
   /**
-   * Get the world space bounding box of the triangle.
-   * \return world space bounding box of the triangle
+   * Get the object space bounding box of the triangle, the space of its
+   * mesh's positions, which the mesh's instance transform places in the world.
+   * \return object space bounding box of the triangle
    */
   BBox get_bbox() const;
 
@@ -59,6 +60,29 @@ class Triangle : public Primitive {
    */
   bool intersect(const Ray& r, Intersection* i) const;
 
+  /**
+   * Get the object space positions of the triangle vertices.
+   */
+  void get_vertices(Vector3D& p0, Vector3D& p1, Vector3D& p2) const;
+
+  /**
+   * Get the indices of the triangle vertices in the mesh attribute arrays.
+   */
+  void get_indices(size_t& i1, size_t& i2, size_t& i3) const {
+    i1 = v1; i2 = v2; i3 = v3;
+  }
+
+  /**
+   * Store a hit of the ray on the triangle found by other means than
+   * intersect(), such as the packed triangles of a BVH leaf, in i.
+   * \param r ray that hit the triangle
+   * \param t time of the hit
+   * \param u barycentric coordinate of the second vertex at the hit
+   * \param v barycentric coordinate of the third vertex at the hit
+   * \param i address to store intersection info
+   */
+  void set_intersection(const Ray& r, double t, double u, double v, Intersection* i) const;
+
   /**
    * Get BSDF.
    * In the case of a triangle, the surface material BSDF is stored in
@@ -91,6 +115,16 @@ class Triangle : public Primitive {
   void drawOutline(const Color& c) const;
 
  private:
+  /**
+   * Ray - Triangle hit test shared by both intersections.
+   * \param r ray to test intersection with
+   * \param t time of the hit within the ray interval
+   * \param u barycentric coordinate of the second vertex at the hit
+   * \param v barycentric coordinate of the third vertex at the hit
+   * \return true if the ray hits the front of the triangle
+   */
+  bool hit(const Ray& r, double& t, double& u, double& v) const;
+
   const Mesh* mesh;  ///< pointer to the mesh the triangle is a part of
 
   size_t v1;  ///< index into the mesh attribute arrays